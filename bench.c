@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2010 Joachim Schipper <joachim@joachimschipper.nl>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmarks for randomize; see "make bench".
+ *
+ * randomize-bench [-p program] [-r runs] [-S size] [scenario ...]
+ *
+ * Generates inputs of about size bytes (default 64M) of lines of 8 bytes to
+ * 1M, runs program (default ./randomize) on them in a number of scenarios
+ * (only those matching one of the scenario patterns, if given; see fnmatch(3))
+ * and prints one line of JSON per scenario, with the best time of runs runs
+ * (default 1). For instance, -S 8G yields 10^9 records of 8 bytes.
+ *
+ * max_rss_kb is as reported by getrusage(2); spool_bytes, the largest total
+ * size of the temporary files of randomize seen while it ran, is only
+ * available on Linux (and is null otherwise).
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A scenario runs program with args on the input with lines of len bytes,
+ * read from a file or from a pipe. If nhalf is set, "-n" followed by half the
+ * number of records is added to args.
+ */
+static const struct scenario {
+	const char	*name;
+	size_t		 len;
+	int		 pipe;
+	int		 nhalf;
+	const char	*args[5];
+} scenarios[] = {
+#define BENCH_LINES(len, name) \
+	{ name "/file", len, 0, 0, { NULL } }, \
+	{ name "/pipe", len, 1, 0, { NULL } }, \
+	{ name "/pipe-spool", len, 1, 0, { "-m", "0", NULL } }, \
+	{ name "/file-n10", len, 0, 0, { "-n", "10", NULL } }, \
+	{ name "/pipe-n10", len, 1, 0, { "-n", "10", NULL } }, \
+	{ name "/file-nhalf", len, 0, 1, { NULL } }
+	BENCH_LINES(8, "8"),
+	BENCH_LINES(100, "100"),
+	BENCH_LINES(10 * 1024, "10k"),
+	BENCH_LINES(1024 * 1024, "1M"),
+	{ "100/file-regex", 100, 0, 0, { "-e", "\\r?\\n", NULL } },
+	{ "100/pipe-regex", 100, 1, 0, { "-e", "\\r?\\n", NULL } },
+	{ "100/file-amp", 100, 0, 0, { "-o", "&", NULL } },
+	{ "100/file-backref", 100, 0, 0, { "-e", "(\\n)", "-o", "\\1", NULL } },
+	{ "100/file-x", 100, 0, 0, { "-x", "-m", "16M", NULL } },
+	{ "100/pipe-spool-z", 100, 1, 0, { "-z", "-m", "0", NULL } },
+	{ "1M/file-regex", 1024 * 1024, 0, 0, { "-e", "(\\n)", NULL } },
+	{ "1M/pipe-regex", 1024 * 1024, 1, 0, { "-e", "(\\n)", "-m", "0", NULL } }
+};
+#define NSCENARIOS (sizeof(scenarios) / sizeof(scenarios[0]))
+
+/* Result of a run */
+struct result {
+	double		 seconds;
+	long		 max_rss_kb;
+	long long	 spool_bytes;	/* -1 if unknown */
+	int		 status;	/* As for waitpid() */
+};
+
+static void usage(void) __attribute__((noreturn));
+static void sigchld(int sig);
+static off_t parse_size(const char *s);
+static void generate(const char *path, size_t len, off_t size);
+static void feed(const char *path, int fd);
+static long long spool_bytes(pid_t pid);
+static void run(const struct scenario *sc, const char *program, const char *path, uint64_t nrecords, struct result *r);
+
+static void
+usage(void)
+{
+	fprintf(stderr, "randomize-bench [-p program] [-r runs] [-S size] [scenario ...]\n");
+	exit(127);
+}
+
+static void
+sigchld(int sig)
+{
+	/* Just interrupt nanosleep() in run() */
+}
+
+/*
+ * Parse a size like 64M, as for randomize -m (without percentages).
+ */
+static off_t
+parse_size(const char *s)
+{
+	char		*end;
+	unsigned long long size;
+
+	errno = 0;
+	size = strtoull(s, &end, 10);
+	if (errno != 0 || end == s)
+		errx(1, "invalid size: %s", s);
+	switch (*end) {
+	case 'T':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'G':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'M':
+		size *= 1024;
+		/* FALLTHROUGH */
+	case 'k':
+		size *= 1024;
+		end++;
+		break;
+	}
+	if (*end != '\0' || size == 0 || size > LLONG_MAX)
+		errx(1, "invalid size: %s", s);
+
+	return size;
+}
+
+/*
+ * Write size bytes (rounded up to a whole line) of lines of len bytes to
+ * path. The lines consist of pseudo-random words, so that they compress
+ * about as well as text.
+ */
+static void
+generate(const char *path, size_t len, off_t size)
+{
+	static const char *words[] = {
+		"the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+		"was", "with", "be", "by", "on", "not", "he", "this", "are",
+		"or", "his", "from", "at", "which", "but", "have", "an", "had",
+		"they", "you", "were", "their", "one", "all", "we", "can", "her",
+		"has", "there", "been", "if", "more", "when", "will", "would",
+		"who", "so", "no", "record", "random", "order", "shuffle",
+		"input", "output", "file", "line", "data", "error", "request",
+		"server", "2010", "GET", "200", "404"
+	};
+	FILE		*file;
+	const char	*w;
+	uint64_t	 x;
+	off_t		 written;
+	size_t		 i;
+
+	if ((file = fopen(path, "w")) == NULL)
+		err(1, "Failed to create %s", path);
+
+	x = len;
+	w = "";
+	for (written = 0; written < size; written += len) {
+		for (i = 0; i < len - 1; i++) {
+			if (*w == '\0') {
+				x = x * UINT64_C(6364136223846793005) + UINT64_C(1442695040888963407);
+				w = words[(x >> 32) % (sizeof(words) / sizeof(words[0]))];
+				if (i != 0) {
+					putc(' ', file);
+					continue;
+				}
+			}
+			putc(*w++, file);
+		}
+		putc('\n', file);
+	}
+
+	if (fclose(file) != 0)
+		err(1, "Failed to write %s", path);
+}
+
+/*
+ * Copy path to fd, for pipe scenarios; runs in a child process.
+ */
+static void
+feed(const char *path, int fd)
+{
+	char		 buf[64 * 1024];
+	ssize_t		 nbytes, i, n;
+	int		 in;
+
+	if ((in = open(path, O_RDONLY)) == -1)
+		err(1, "Failed to open %s", path);
+	while ((nbytes = read(in, buf, sizeof(buf))) > 0)
+		for (i = 0; i < nbytes; i += n)
+			if ((n = write(fd, &buf[i], nbytes - i)) == -1)
+				/* randomize -n may stop reading early */
+				_exit(errno == EPIPE ? 0 : 1);
+	_exit(nbytes == 0 ? 0 : 1);
+}
+
+/*
+ * Return the total size of the temporary files that pid has open, or -1 if
+ * that cannot be determined.
+ */
+static long long
+spool_bytes(pid_t pid)
+{
+#ifdef __linux__
+	DIR		*dir;
+	struct dirent	*d;
+	struct stat	 sb;
+	char		 path[PATH_MAX], target[PATH_MAX];
+	ssize_t		 len;
+	long long	 total;
+
+	snprintf(path, sizeof(path), "/proc/%ld/fd", (long) pid);
+	if ((dir = opendir(path)) == NULL)
+		return -1;
+
+	total = 0;
+	while ((d = readdir(dir)) != NULL) {
+		snprintf(path, sizeof(path), "/proc/%ld/fd/%s", (long) pid, d->d_name);
+		if ((len = readlink(path, target, sizeof(target) - 1)) == -1)
+			continue;
+		target[len] = '\0';
+		if (strstr(target, "/randomize.") == NULL &&
+		    strstr(target, "memfd:randomize") == NULL)
+			continue;
+		if (stat(path, &sb) == 0)
+			total += sb.st_size;
+	}
+	closedir(dir);
+
+	return total;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Run sc once on path (holding nrecords records), storing the results in r.
+ */
+static void
+run(const struct scenario *sc, const char *program, const char *path, uint64_t nrecords, struct result *r)
+{
+	struct timespec	 start, end, delay;
+	struct rusage	 ru;
+	/* execv() takes char *const *, but does not modify the strings */
+	union {
+		const char	*c[16];
+		char		*v[16];
+	}		 argv;
+	char		 n[32];
+	pid_t		 pid, feeder;
+	long long	 spool;
+	int		 argc, i, fd[2], out, status;
+
+	argc = 0;
+	argv.c[argc++] = program;
+	for (i = 0; sc->args[i] != NULL; i++)
+		argv.c[argc++] = sc->args[i];
+	if (sc->nhalf) {
+		snprintf(n, sizeof(n), "%" PRIu64, nrecords / 2 > 0 ? nrecords / 2 : 1);
+		argv.c[argc++] = "-n";
+		argv.c[argc++] = n;
+	}
+	if (!sc->pipe)
+		argv.c[argc++] = path;
+	argv.c[argc] = NULL;
+
+	if ((out = open("/dev/null", O_WRONLY)) == -1)
+		err(1, "Failed to open /dev/null");
+	if (sc->pipe && pipe(fd) == -1)
+		err(1, "Failed to create pipe");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	feeder = -1;
+	if (sc->pipe) {
+		if ((feeder = fork()) == -1)
+			err(1, "Failed to fork");
+		if (feeder == 0) {
+			close(fd[0]);
+			feed(path, fd[1]);
+		}
+		close(fd[1]);
+	}
+	if ((pid = fork()) == -1)
+		err(1, "Failed to fork");
+	if (pid == 0) {
+		if ((sc->pipe && dup2(fd[0], STDIN_FILENO) == -1) ||
+		    dup2(out, STDOUT_FILENO) == -1)
+			_exit(127);
+		execv(program, argv.v);
+		_exit(127);
+	}
+	if (sc->pipe)
+		close(fd[0]);
+	close(out);
+
+	/*
+	 * Poll the size of the temporary files until randomize exits; SIGCHLD
+	 * interrupts nanosleep(), so this does not affect the timing.
+	 */
+	r->spool_bytes = spool_bytes(pid);
+	delay.tv_sec = 0;
+	delay.tv_nsec = 10 * 1000 * 1000;
+	while (wait4(pid, &status, WNOHANG, &ru) == 0) {
+		if (r->spool_bytes != -1 && (spool = spool_bytes(pid)) > r->spool_bytes)
+			r->spool_bytes = spool;
+		nanosleep(&delay, NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (feeder != -1)
+		waitpid(feeder, NULL, 0);
+
+	r->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	r->max_rss_kb = ru.ru_maxrss;
+	r->status = status;
+}
+
+int
+main(int argc, char **argv)
+{
+	const struct scenario *sc;
+	struct sigaction sa;
+	struct result	 best, r;
+	const char	*program, *tmpdir;
+	char		*dir, path[PATH_MAX];
+	off_t		 size;
+	uint64_t	 nrecords;
+	size_t		 len;
+	unsigned int	 i;
+	long		 runs;
+	int		 ch, j, k, found;
+
+	program = "./randomize";
+	runs = 1;
+	size = 64 * 1024 * 1024;
+	while ((ch = getopt(argc, argv, "p:r:S:")) != -1) {
+		switch (ch) {
+		case 'p':
+			program = optarg;
+			break;
+		case 'r':
+			if ((runs = strtol(optarg, NULL, 10)) < 1)
+				errx(1, "invalid number of runs: %s", optarg);
+			break;
+		case 'S':
+			size = parse_size(optarg);
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	/* randomize -n may close the pipe early */
+	signal(SIGPIPE, SIG_IGN);
+	sa.sa_handler = sigchld;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL || tmpdir[0] == '\0')
+		tmpdir = "/tmp";
+	if (asprintf(&dir, "%s/randomize-bench.XXXXXX", tmpdir) == -1 ||
+	    mkdtemp(dir) == NULL)
+		err(1, "Failed to create temporary directory");
+
+	len = 0;
+	for (i = 0; i < NSCENARIOS; i++) {
+		sc = &scenarios[i];
+		for (found = argc == 0, j = 0; j < argc && !found; j++)
+			found = fnmatch(argv[j], sc->name, 0) == 0;
+		if (!found)
+			continue;
+
+		/* Generate the input, replacing the previous one if needed */
+		snprintf(path, sizeof(path), "%s/%zu.in", dir, sc->len);
+		if (sc->len != len) {
+			if (len != 0) {
+				snprintf(path, sizeof(path), "%s/%zu.in", dir, len);
+				unlink(path);
+				snprintf(path, sizeof(path), "%s/%zu.in", dir, sc->len);
+			}
+			len = sc->len;
+			generate(path, len, size);
+		}
+		nrecords = (size + len - 1) / len;
+
+		for (k = 0; k < runs; k++) {
+			run(sc, program, path, nrecords, &r);
+			if (k == 0 || r.seconds < best.seconds)
+				best = r;
+			if (r.max_rss_kb > best.max_rss_kb)
+				best.max_rss_kb = r.max_rss_kb;
+			if (r.spool_bytes > best.spool_bytes)
+				best.spool_bytes = r.spool_bytes;
+		}
+
+		printf("{\"scenario\": \"%s\", \"bytes\": %" PRIu64 ", \"records\": %" PRIu64 ", \"status\": %d, \"seconds\": %.3f, \"mb_per_s\": %.1f, \"records_per_s\": %.0f, \"max_rss_kb\": %ld, \"spool_bytes\": ",
+		    sc->name, nrecords * len, nrecords,
+		    WIFEXITED(best.status) ? WEXITSTATUS(best.status) : 128 + WTERMSIG(best.status),
+		    best.seconds, nrecords * len / 1e6 / best.seconds,
+		    nrecords / best.seconds, best.max_rss_kb);
+		if (best.spool_bytes == -1)
+			printf("null}\n");
+		else
+			printf("%lld}\n", best.spool_bytes);
+		fflush(stdout);
+	}
+
+	if (len != 0) {
+		snprintf(path, sizeof(path), "%s/%zu.in", dir, len);
+		unlink(path);
+	}
+	rmdir(dir);
+	free(dir);
+
+	return 0;
+}
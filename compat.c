@@ -323,3 +323,32 @@ strtonum(const char *numstr, long long minval, long long maxval,
 	return (ll);
 }
 #endif
+
+#ifndef HAVE_MEMMEM
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Find the first occurrence of the byte string little in big; a simple loop
+ * around memchr(), which is good enough for the short strings we need.
+ */
+void *
+memmem(const void *big, size_t big_len, const void *little, size_t little_len)
+{
+	const char	*p, *end;
+
+	if (little_len == 0)
+		/* LINTED casting away const, as memmem(3) does */
+		return (void *) (uintptr_t) big;
+	if (big_len < little_len)
+		return NULL;
+
+	p = big;
+	end = p + (big_len - little_len);
+	for (; p <= end && (p = memchr(p, *(const char *) little, end - p + 1)) != NULL; p++)
+		if (memcmp(p, little, little_len) == 0)
+			return (void *) (uintptr_t) p;
+
+	return NULL;
+}
+#endif
@@ -82,3 +82,7 @@ size_t   strlcat(char *, const char *, size_t);
 long long
          strtonum(const char *, long long, long long, const char **);
 #endif
+
+#ifndef HAVE_MEMMEM
+void    *memmem(const void *, size_t, const void *, size_t);
+#endif
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2010 Joachim Schipper <joachim@joachimschipper.nl>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+
+#include "compat.h"
+#include "prng.h"
+
+/* Helper functions for the fast generator */
+static uint64_t prng_splitmix64(uint64_t *x) __attribute__((nonnull(1)));
+static void prng_fill(struct prng *p) __attribute__((nonnull(1)));
+
+/* Is the fast generator used? */
+static int	 fast = 0;
+/* The default stream */
+static struct prng default_prng;
+
+/*
+ * SplitMix64 (Steele, Lea and Flood), used to turn a seed into a state for
+ * xoshiro256++ as recommended by its authors.
+ */
+static uint64_t
+prng_splitmix64(uint64_t *x)
+{
+	uint64_t	 z;
+
+	z = (*x += UINT64_C(0x9e3779b97f4a7c15));
+	z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+	z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+	return z ^ (z >> 31);
+}
+
+void
+prng_seed(uint64_t seed)
+{
+	fast = 1;
+	prng_init(&default_prng, seed, 0);
+}
+
+void
+prng_init(struct prng *p, uint64_t key, uint64_t stream)
+{
+	uint64_t	 x;
+	int		 i;
+
+	/* Mix stream in thoroughly, so that nearby streams are unrelated */
+	x = key ^ prng_splitmix64(&stream);
+	for (i = 0; i < 4; i++)
+		p->internal_only.s[i] = prng_splitmix64(&x);
+	p->internal_only.pos = PRNG_BUF;
+}
+
+/*
+ * Refill p->internal_only.buf using xoshiro256++ (Blackman and Vigna).
+ */
+static void
+prng_fill(struct prng *p)
+{
+	uint64_t	*s, r, t;
+	int		 i;
+
+	s = p->internal_only.s;
+	for (i = 0; i < PRNG_BUF; i += 2) {
+		r = s[0] + s[3];
+		r = ((r << 23) | (r >> 41)) + s[0];
+		t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = (s[3] << 45) | (s[3] >> 19);
+
+		/* LINTED truncation is intended */
+		p->internal_only.buf[i] = (uint32_t) r;
+		p->internal_only.buf[i + 1] = r >> 32;
+	}
+	p->internal_only.pos = 0;
+}
+
+uint32_t
+prng_uniform(struct prng *p, uint32_t max)
+{
+	uint64_t	 m;
+	uint32_t	 threshold;
+
+	if (!fast)
+		return random_uniform(max);
+
+	if (p == NULL)
+		p = &default_prng;
+
+	/*
+	 * Lemire's nearly divisionless method: the high half of x * max is
+	 * uniform if we reject the (rare) low halves below 2**32 % max.
+	 */
+	if (p->internal_only.pos == PRNG_BUF)
+		prng_fill(p);
+	m = (uint64_t) p->internal_only.buf[p->internal_only.pos++] * max;
+	if ((uint32_t) m < max) {
+		/* LINTED unsigned negation is intended */
+		threshold = -max % max;
+		while ((uint32_t) m < threshold) {
+			if (p->internal_only.pos == PRNG_BUF)
+				prng_fill(p);
+			m = (uint64_t) p->internal_only.buf[p->internal_only.pos++] * max;
+		}
+	}
+
+	/* LINTED m >> 32 is less than max */
+	return m >> 32;
+}
+
+uint64_t
+prng_uniform64(struct prng *p, uint64_t max)
+{
+	uint64_t	 mask, r;
+
+	if (max <= UINT32_MAX)
+		/* LINTED max fits */
+		return prng_uniform(p, (uint32_t) max);
+
+	/*
+	 * Rejection sampling from the smallest power of two that is at least
+	 * max; this takes fewer than two tries on average.
+	 */
+	mask = max - 1;
+	mask |= mask >> 1;
+	mask |= mask >> 2;
+	mask |= mask >> 4;
+	mask |= mask >> 8;
+	mask |= mask >> 16;
+	mask |= mask >> 32;
+	do
+		r = prng_random64(p) & mask;
+	while (r >= max);
+
+	return r;
+}
+
+uint64_t
+prng_random64(struct prng *p)
+{
+	uint64_t	 r;
+	int		 i;
+
+	if (!fast) {
+		for (r = 0, i = 0; i < 4; i++)
+			r = (r << 16) | random_uniform(UINT32_C(1) << 16);
+		return r;
+	}
+
+	if (p == NULL)
+		p = &default_prng;
+
+	if (p->internal_only.pos >= PRNG_BUF - 1)
+		prng_fill(p);
+	r = (uint64_t) p->internal_only.buf[p->internal_only.pos] << 32 |
+	    p->internal_only.buf[p->internal_only.pos + 1];
+	p->internal_only.pos += 2;
+
+	return r;
+}
+
+double
+prng_real(struct prng *p)
+{
+	/* 53 random bits, plus a half so that the result is never 0 */
+	return ((prng_random64(p) >> 11) + 0.5) / 9007199254740992.0;
+}
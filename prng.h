@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2010 Joachim Schipper <joachim@joachimschipper.nl>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Random number generators. Requires <inttypes.h>.
+ *
+ * By default, random_uniform() from compat.h (i.e. arc4random_uniform(), if
+ * available) is used. After prng_seed(), a fast xoshiro256++ generator is used
+ * instead; its output depends only on the seed.
+ */
+
+#ifndef __GNUC__
+#ifndef __attribute__
+#define __attribute__(x) /* Not supported by non-GCC compilers */
+#endif
+#endif
+
+/* Number of 32-bit words generated at once by the fast generator */
+#define PRNG_BUF 128
+
+/*
+ * The state of an independent stream of random numbers. For internal use
+ * only!
+ */
+struct prng {
+	struct {
+		uint64_t	 s[4];
+		uint32_t	 buf[PRNG_BUF];
+		int		 pos;
+	} internal_only;
+};
+
+/*
+ * Use the fast generator, seeded with seed, from now on.
+ */
+void prng_seed(uint64_t seed);
+
+/*
+ * Initialize p as an independent stream, determined by key (which should be
+ * obtained from prng_random64(), in order to depend on the seed) and stream.
+ * This is useful to give each thread its own stream.
+ */
+void prng_init(struct prng *p, uint64_t key, uint64_t stream) __attribute__((nonnull(1)));
+
+/*
+ * Return a random number chosen uniformly from 0, 1, ..., max - 1 (or 0, if
+ * max is 0), from stream p or, if p is NULL, from the default stream. Unless
+ * prng_seed() was called, p is ignored.
+ *
+ * The default stream must only be used by one thread at a time.
+ */
+uint32_t prng_uniform(struct prng *p, uint32_t max);
+
+/*
+ * As prng_uniform(), but for any 64-bit max. For max up to UINT32_MAX, this
+ * returns exactly what prng_uniform() would.
+ */
+uint64_t prng_uniform64(struct prng *p, uint64_t max);
+
+/*
+ * Return 64 random bits, as above.
+ */
+uint64_t prng_random64(struct prng *p);
+
+/*
+ * Return a random number chosen uniformly from the open interval (0, 1), as
+ * above.
+ */
+double prng_real(struct prng *p);
@@ -18,104 +18,1837 @@
  * Various randomization algorithms.
  */
 
-#ifndef HAVE_ARC4RANDOM
-#ifndef HAVE_SRANDOMDEV
 #include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <assert.h>
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PCRE2_CODE_UNIT_WIDTH 8
+#include <pcre2.h>
+
+#include "compat.h"
+#include "prng.h"
+#include "record.h"
+
+#ifndef __GNUC__
+#ifndef __attribute__
+#define __attribute__(x) /* Not supported by non-GCC compilers */
+#endif
+#endif
+#ifndef MIN
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#endif
+#ifndef MAX
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
+/*
+ * Set by SIGINFO, SIGUSR1 and (with --progress) SIGALRM, to print a progress
+ * report.
+ */
+static volatile sig_atomic_t got_progress = 0;
+static void handle_progress(int sig);
+
+/*
+ * Statistics (--stats): the wall and CPU time spent in each phase, and what the
+ * rec_* functions did (see rec_get_stats()), are printed as JSON to
+ * stats_file at exit and, instead of the usual progress reports, whenever
+ * got_progress is set. Nothing is measured if stats_file is NULL.
+ */
+enum phase {
+	PHASE_PARSE,
+	PHASE_SHUFFLE,
+	PHASE_OUTPUT,
+	PHASE_DONE
+};
+static const char *const phase_name[] = { "parse", "shuffle", "output", "done" };
+static FILE	*stats_file = NULL;
+static enum phase phase = PHASE_DONE;
+static double	 phase_wall[PHASE_DONE], phase_cpu[PHASE_DONE];
+static double	 phase_start_wall, phase_start_cpu;
+static uint64_t	 records_written = 0;
+/* The initial value of memory_cache in main() */
+static size_t	 stats_memory_cache;
+static void stats_phase(enum phase next);
+static void stats_print(void);
+static void stats_done(void);
+static double wall_clock(void);
+static double cpu_clock(void);
+
+/* Long options, which have no short equivalent */
+enum {
+	OPT_INDEX = CHAR_MAX + 1,
+	OPT_OUTPUT,
+	OPT_PROGRESS,
+	OPT_SAMPLE,
+	OPT_SHARDS,
+	OPT_SPLIT,
+	OPT_STATS
+};
+static const struct option longopts[] = {
+	{ "index",	no_argument,		NULL,	OPT_INDEX },
+	{ "output",	required_argument,	NULL,	OPT_OUTPUT },
+	{ "progress",	required_argument,	NULL,	OPT_PROGRESS },
+	{ "sample",	required_argument,	NULL,	OPT_SAMPLE },
+	{ "shards",	required_argument,	NULL,	OPT_SHARDS },
+	{ "split",	required_argument,	NULL,	OPT_SPLIT },
+	{ "stats",	optional_argument,	NULL,	OPT_STATS },
+	{ NULL,		0,			NULL,	0 }
+};
+
+int main(int argc, char **argv);
+
+static void usage(void) __attribute__((noreturn));
+static size_t regex_literal(const char *re_str, char *literal) __attribute__((nonnull(1, 2)));
+static size_t parse_size(const char *str) __attribute__((nonnull(1)));
+
+/*
+ * External shuffle (-x): records are scattered over BUCKETS temporary files
+ * at random, and each of those is then shuffled in memory (or, if it is still
+ * too large, scattered again). Since every record ends up in a uniformly
+ * random bucket, and the buckets are shuffled independently, this is a
+ * uniformly random permutation. All I/O on the temporary files is
+ * sequential.
+ */
+#define BUCKETS 128
+/* Size of the stdio buffer for each bucket */
+#define BUCKET_BUFSIZ (64 * 1024)
+struct buckets {
+	FILE		*file[BUCKETS];
+	uint64_t	 count[BUCKETS];
+	char		*buf;
+	FILE		*all;		/* If not NULL, gets every record too (-r) */
+};
+static void buckets_open(struct buckets *b) __attribute__((nonnull(1)));
+static void buckets_save(struct buckets *b, const struct rec *rec) __attribute__((nonnull(1, 2)));
+static void buckets_reload(struct buckets *b, FILE *all) __attribute__((nonnull(1, 2)));
+static void buckets_shuffle(struct buckets *b, const size_t *memory_cache, uint64_t *written, uint64_t n) __attribute__((nonnull(1, 2, 3)));
+static void write_recs(struct rec *rec, uint64_t len, uint64_t *written, uint64_t n, int keep) __attribute__((nonnull(1, 3)));
+static uint64_t reservoir_skip(double *w, uint64_t k, struct prng *p) __attribute__((nonnull(1)));
+
+/*
+ * The records read so far, to be shuffle()d: all of them or, with -n, a
+ * reservoir of at most k of them; see sample_read(). n counts every record
+ * read, including those that did not make it into the reservoir.
+ */
+struct sample {
+	struct rec	*rec;
+	uint64_t	 size;		/* Of rec[] */
+	uint64_t	 k;
+	uint64_t	 n;
+	uint64_t	 skip;		/* For Algorithm L, once n >= k */
+	double		 w;
+};
+/*
+ * An operand (a file, or stdin), with the -e and -o that apply to it.
+ */
+struct operand {
+	const char	*name;		/* For messages */
+	const char	*path;		/* NULL for stdin */
+	const char	*re_str;	/* The source of re */
+	pcre2_code	*re;
+	char		 literal[REC_LITERAL_MAX];
+	size_t		 literal_len;
+	const char	*delim;
+	int		 rfd;
+#ifdef HAVE_PTHREAD
+	/* See struct ingest */
+	struct sample	 sample;
+	int		 done;
+	struct rec_stats stats;
+#endif
+};
+
+static void sample_init(struct sample *s, uint64_t k) __attribute__((nonnull(1)));
+static void sample_reserve(struct sample *s, uint64_t n) __attribute__((nonnull(1)));
+static void sample_read(struct sample *s, struct rec_ctx *c, struct operand *op, struct prng *p, struct buckets *b) __attribute__((nonnull(1, 2, 3)));
+static void samples_read(struct sample *s, size_t ns, struct operand *op) __attribute__((nonnull(1, 3)));
+static void window_read(struct sample *s, struct operand *op, struct rec *batch, uint64_t window, uint64_t *written) __attribute__((nonnull(1, 2, 3, 5)));
+static void read_error(const struct operand *op) __attribute__((nonnull(1), noreturn));
+
+#ifdef HAVE_PTHREAD
+static void sample_merge(struct sample *s, struct sample *from) __attribute__((nonnull(1, 2)));
+
+/*
+ * Parallel ingestion: with several operands (and no -x), a pool of threads
+ * reads one operand at a time each, with a record context and stream of
+ * random numbers of its own, into a sample of its own. main() merges these
+ * samples into its own in the order of the operands, as soon as each is done;
+ * since sample_merge() is exact and the streams depend only on the operand,
+ * the output is a uniformly random permutation (or sample, with -n) that does
+ * not depend on how the threads were scheduled.
+ *
+ * The rfds are all opened beforehand, by main(). The threads report their
+ * record statistics in stats when progress is asked for (see got_progress),
+ * and when done.
+ */
+struct ingest {
+	pthread_mutex_t	 mutex;
+	pthread_cond_t	 cond;		/* Signals done and stats */
+	struct operand	*op;
+	size_t		 nops, next;
+	uint64_t	 key;		/* For prng_init() */
+	uint64_t	 k;
+};
+static struct ingest ingest = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0 };
+static void ingest_run(struct sample *s, struct operand *op, size_t nops, long threads) __attribute__((nonnull(1, 2)));
+static void *ingest_thread(void *arg) __attribute__((nonnull(1)));
+static void ingest_report(struct operand *op, const struct rec_ctx *c) __attribute__((nonnull(1, 2)));
+static void ingest_stats(struct rec_stats *st) __attribute__((nonnull(1)));
+#endif
+
+/*
+ * Shuffling all records at once, instead of while reading them. For many
+ * records, this uses MergeShuffle (Bacher, Bodini, Hollender and Lumbroso,
+ * 2015): blocks of records are shuffled independently (in parallel, if
+ * possible), and then merged pairwise in a way that keeps the result uniformly
+ * random. The merges mostly access memory sequentially, which avoids most of
+ * the cache misses of a plain Fisher-Yates shuffle of a large array.
+ *
+ * Each block and merge uses its own stream of random numbers, and the blocks
+ * depend only on the number of records, so the result does not depend on the
+ * number of threads.
+ */
+static void shuffle(struct rec *rec, uint64_t n, int threads);
+static void shuffle_block(struct rec *rec, uint64_t n, struct prng *p) __attribute__((nonnull(1)));
+/* Below this number of records, shuffle() just uses shuffle_block() */
+#define SHUFFLE_MERGE_MIN (64 * 1024)
+/* Maximum number of blocks used by shuffle() */
+#define SHUFFLE_BLOCKS_MAX 256
+/* One step of shuffle(); see shuffle_thread() */
+struct shuffle_level {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	 mutex;
+#endif
+	struct rec	*rec;
+	uint64_t	 n;
+	uint64_t	 key;	/* For prng_init() */
+	unsigned int	 nblocks, width, njobs, next;
+};
+static void *shuffle_thread(void *arg) __attribute__((nonnull(1)));
+static void shuffle_merge(struct rec *rec, uint64_t mid, uint64_t n, struct prng *p) __attribute__((nonnull(1, 4)));
+
+/* Appended to the name of a file to get the name of its index (--index) */
+#define INDEX_SUFFIX ".randomize-index"
+
+/*
+ * Outputs (--split, --shards and --sample). write_recs() deals every
+ * permutation of output_period records over the output_ncur outputs starting
+ * at output_cur (see output_set()), in order: output i gets records end[i - 1]
+ * to end[i] - 1 of each, i.e. a share proportional to its weight. --shards
+ * adds outputs of weight 1. For --sample, each sample has an output of its
+ * own, and weight is its size instead. Without any of these, output[0] is
+ * stdout.
+ */
+struct output {
+	char		*path;
+	FILE		*file;
+	uint64_t	 weight;
+	uint64_t	 end;
+#ifdef HAVE_PTHREAD
+	/* See struct write_pool */
+	struct rec_ctx	*ctx;
+	struct rec	*rec;
+	uint64_t	 len;
+#endif
+};
+static struct output *output = NULL;
+static size_t	 noutputs = 0;
+static struct output *output_cur = NULL;
+static size_t	 output_ncur = 0;
+static uint64_t	 output_period = 0;
+/* Maximum for the sum of all --split weights, see output_set() */
+#define OUTPUT_WEIGHT_MAX UINT32_MAX
+static void output_add(const char *arg, uint64_t max, const char *what) __attribute__((nonnull(1, 3)));
+static void output_open(const char *path, uint64_t weight) __attribute__((nonnull(1)));
+static void output_shards(const char *pattern, unsigned int n) __attribute__((nonnull(1)));
+static void output_set(struct output *o, size_t n, uint64_t period) __attribute__((nonnull(1)));
+static struct output *output_find(uint64_t written, uint64_t *left) __attribute__((nonnull(2)));
+
+#ifdef HAVE_PTHREAD
+/*
+ * Parallel output: if write_threads > 1, write_recs() hands the records for
+ * every output to a pool of up to write_threads threads (including the
+ * calling thread, which waits for the others), one output at a time. Each
+ * output has a context of its own, so that every thread has its own buffers
+ * and templates, and its own FILE, so the output does not depend on the number
+ * of threads. The records are freed afterwards, by the calling thread.
+ */
+struct write_pool {
+	pthread_mutex_t	 mutex;
+	size_t		 next;		/* Into output_cur[] */
+};
+static struct write_pool write_pool = { PTHREAD_MUTEX_INITIALIZER, 0 };
+static long	 write_threads = 1;
+static int write_parallel(struct rec *rec, uint64_t len, uint64_t written) __attribute__((nonnull(1)));
+static void *write_thread(void *arg) __attribute__((nonnull(1)));
+static void write_stats(struct rec_stats *st) __attribute__((nonnull(1)));
+#endif
+
+/* Default for -m */
+static const size_t memory_cache_default = 64 * 1024 * 1024;
+/* How many records to write at once; see write_recs() */
+static const size_t write_batch = 4096;
+/* Used for all rec_* calls */
+static struct rec_ctx *ctx;
+/* The records read so far, for -u; see unique_filter() */
+static struct rec_unique *unique = NULL;
+static size_t unique_filter(struct rec_ctx *c, struct rec *rec, size_t n, const struct operand *op) __attribute__((nonnull(1, 2, 4)));
+
+static void
+usage(void)
+{
+	fprintf(stderr, "randomize [-Mduxz] [-a | -b size | -e regex] [-o str] [-j threads]\n"
+	    "          [-m size] [-n number] [-r count] [-R fast | system] [-s seed]\n"
+	    "          [-w window] [--index] [--progress=seconds]\n"
+	    "          [--sample=number:file ...] [--shards=count --output=pattern]\n"
+	    "          [--split=weight:file ...] [--stats[=file]] [arg [arg ...]]\n");
+	exit(127);
+}
+
+/*
+ * If the regular expression re_str (compiled as in main()) matches exactly
+ * one fixed string of at most REC_LITERAL_MAX bytes, store that string in
+ * literal and return its length. Otherwise, return 0. Only common cases such
+ * as "\n", "\0" or "--\n" are recognized; anything else is left to PCRE2.
+ */
+static size_t
+regex_literal(const char *re_str, char *literal)
+{
+	size_t		 len;
+	int		 i, value;
+
+	for (len = 0; *re_str != '\0'; len++) {
+		if (len == REC_LITERAL_MAX)
+			return 0;
+
+		if (strchr("^$.[|()?*+{", *re_str) != NULL)
+			/* Metacharacter */
+			return 0;
+		if (*re_str != '\\') {
+			literal[len] = *re_str++;
+			continue;
+		}
+
+		/* Escape sequence */
+		switch (*++re_str) {
+		case 'a':
+			literal[len] = '\a';
+			break;
+		case 'e':
+			literal[len] = '\033';
+			break;
+		case 'f':
+			literal[len] = '\f';
+			break;
+		case 'n':
+			literal[len] = '\n';
+			break;
+		case 'r':
+			literal[len] = '\r';
+			break;
+		case 't':
+			literal[len] = '\t';
+			break;
+		case '0':
+			/* \0 followed by up to two more octal digits */
+			for (i = 0, value = 0; i < 2 && re_str[1] >= '0' && re_str[1] <= '7'; i++)
+				value = 8 * value + *++re_str - '0';
+			literal[len] = value;
+			break;
+		case 'x':
+			/* One or two hex digits */
+			for (i = 0, value = 0; i < 2 && isxdigit((unsigned char) re_str[1]); i++) {
+				re_str++;
+				value = 16 * value + (isdigit((unsigned char) *re_str) ? *re_str - '0' :
+						      tolower((unsigned char) *re_str) - 'a' + 10);
+			}
+			if (i == 0)
+				return 0;
+			literal[len] = value;
+			break;
+		default:
+			/* A backslash followed by punctuation is literal */
+			if (!isascii((unsigned char) *re_str) || !ispunct((unsigned char) *re_str))
+				return 0;
+			literal[len] = *re_str;
+			break;
+		}
+		re_str++;
+	}
+
+	return len;
+}
+
+/*
+ * Parse the argument to -m: a number of bytes, optionally followed by k, M, G
+ * or T (powers of 1024), or a percentage of physical memory followed by %.
+ * Exits on error.
+ */
+static size_t
+parse_size(const char *str)
+{
+	unsigned long long size, mult;
+	long		 pages, pagesize;
+	char		*end;
+
+	if (!isdigit((unsigned char) str[0]))
+		errx(1, "memory size is invalid: %s", str);
+	errno = 0;
+	size = strtoull(str, &end, 10);
+	if (errno == ERANGE)
+		errx(1, "memory size is too large: %s", str);
+
+	mult = 1;
+	switch (*end) {
+	case '\0':
+		break;
+	case '%':
+		if (size > 100)
+			errx(1, "memory size is too large: %s", str);
+#ifdef _SC_PHYS_PAGES
+		pages = sysconf(_SC_PHYS_PAGES);
+		pagesize = sysconf(_SC_PAGESIZE);
+#else
+		pages = pagesize = -1;
 #endif
+		if (pages == -1 || pagesize == -1)
+			errx(1, "cannot determine the amount of physical memory: %s", str);
+		/* LINTED pages and pagesize are positive */
+		size = (unsigned long long) pages / 100 * size * (unsigned long long) pagesize;
+		break;
+	case 'T': case 't':
+		mult *= 1024; /* FALLTHROUGH */
+	case 'G': case 'g':
+		mult *= 1024; /* FALLTHROUGH */
+	case 'M': case 'm':
+		mult *= 1024; /* FALLTHROUGH */
+	case 'K': case 'k':
+		mult *= 1024;
+		break;
+	default:
+		errx(1, "memory size is invalid: %s", str);
+	}
+	if (*end != '\0' && end[1] != '\0')
+		errx(1, "memory size is invalid: %s", str);
+	if (size > SIZE_MAX / mult)
+		errx(1, "memory size is too large: %s", str);
+
+	/* LINTED size * mult fits in a size_t, per above */
+	return size * mult;
+}
+
+/*
+ * Create BUCKETS empty buckets. Exits on error.
+ */
+static void
+buckets_open(struct buckets *b)
+{
+	unsigned int	 i;
+
+	if ((b->buf = malloc(BUCKETS * BUCKET_BUFSIZ)) == NULL)
+		err(1, "Failed to allocate memory for temporary files");
+
+	for (i = 0; i < BUCKETS; i++) {
+		if ((b->file[i] = rec_tmpfile()) == NULL)
+			err(1, "Failed to create temporary file");
+		if (setvbuf(b->file[i], &b->buf[i * BUCKET_BUFSIZ], _IOFBF, BUCKET_BUFSIZ) != 0)
+			err(1, "Failed to set buffer for temporary file");
+		b->count[i] = 0;
+	}
+	b->all = NULL;
+}
+
+/*
+ * Save rec to a random bucket. Exits on error.
+ */
+static void
+buckets_save(struct buckets *b, const struct rec *rec)
+{
+	const char	*errstr;
+	uint64_t	 r;
+
+	r = prng_uniform(NULL, BUCKETS);
+	if ((errstr = rec_save(ctx, rec, b->file[r])) != NULL)
+		errx(1, "%s", errstr);
+	b->count[r]++;
+	if (b->all != NULL && (errstr = rec_save(ctx, rec, b->all)) != NULL)
+		errx(1, "%s", errstr);
+}
+
+/*
+ * Create new buckets holding the records in all (see struct buckets), for
+ * another permutation. Exits on error.
+ */
+static void
+buckets_reload(struct buckets *b, FILE *all)
+{
+	struct rec	 tmp;
+
+	if (fseeko(all, 0, SEEK_SET) != 0)
+		err(1, "Failed to rewind temporary file");
+	buckets_open(b);
+	while (rec_load(ctx, &tmp, all) == 0) {
+		buckets_save(b, &tmp);
+		rec_free(&tmp);
+	}
+	if (errno != 0)
+		err(1, "Failed to load record from temporary file%s",
+		    errno == ENOMEM ? " (try a larger -m)" : "");
+}
+
+/*
+ * Write out the records in all buckets, in random order, and close the
+ * buckets; *written counts the records written so far, out of n. Exits on
+ * error.
+ *
+ * A bucket is shuffled in memory if it fits in half of *memory_cache, which
+ * leaves room for allocation overhead; otherwise, it is split up further.
+ */
+static void
+buckets_shuffle(struct buckets *b, const size_t *memory_cache, uint64_t *written, uint64_t n)
+{
+	struct buckets	 next;
+	struct rec	*rec, tmp;
+	unsigned int	 i;
+	uint64_t	 j, r;
+	off_t		 size;
+
+	for (i = 0; i < BUCKETS; i++) {
+		stats_phase(PHASE_SHUFFLE);
+		if ((size = ftello(b->file[i])) == -1)
+			err(1, "Failed to determine size of temporary file");
+		if (fflush(b->file[i]) != 0 || fseeko(b->file[i], 0, SEEK_SET) != 0)
+			err(1, "Failed to rewind temporary file");
+
+		if (b->count[i] > 1 && (uintmax_t) size > *memory_cache / 2) {
+			/* Too large, so scatter it again */
+			buckets_open(&next);
+			while (rec_load(ctx, &tmp, b->file[i]) == 0) {
+				buckets_save(&next, &tmp);
+				rec_free(&tmp);
+			}
+			if (errno != 0)
+				err(1, "Failed to load record from temporary file%s",
+				    errno == ENOMEM ? " (try a larger -m)" : "");
+			if (fclose(b->file[i]) != 0)
+				err(1, "Failed to close temporary file");
+
+			buckets_shuffle(&next, memory_cache, written, n);
+			continue;
+		}
+
+		if (b->count[i] > SIZE_MAX / sizeof(*rec) ||
+		    (rec = malloc(MAX(b->count[i], 1) * sizeof(*rec))) == NULL)
+			err(1, "Failed to allocate memory for records");
+
+		/* Shuffle while loading, as in main() */
+		for (j = 0; j < b->count[i]; j++) {
+			r = prng_uniform64(NULL, j + 1);
+			if (r != j)
+				rec[j] = rec[r];
+			if (rec_load(ctx, &rec[r], b->file[i]) != 0)
+				err(1, "Failed to load record from temporary file%s",
+				    errno == ENOMEM ? " (try a larger -m)" : "");
+		}
+		if (fclose(b->file[i]) != 0)
+			err(1, "Failed to close temporary file");
+
+		stats_phase(PHASE_OUTPUT);
+		write_recs(rec, b->count[i], written, n, 0);
+		free(rec);
+	}
+
+	free(b->buf);
+}
+
+/*
+ * Add an output for --split or --sample (which is what) from arg, i.e. a
+ * number between 1 and max, a colon and a file name ("-" for stdout). Exits
+ * on error.
+ */
+static void
+output_add(const char *arg, uint64_t max, const char *what)
+{
+	const char	*path, *errstr;
+	char		*number;
+	uint64_t	 weight;
+
+	if ((path = strchr(arg, ':')) == NULL || path[1] == '\0')
+		errx(1, "%s needs a number and a file name: %s", what, arg);
+	if ((number = strndup(arg, path - arg)) == NULL)
+		err(1, "Failed to allocate memory");
+	path++;
+
+	/* LINTED max fits */
+	weight = strtonum(number, 1, (long long) MIN(max, LLONG_MAX), &errstr);
+	if (errstr)
+		errx(1, "number for %s is %s: %s", what, errstr, number);
+	free(number);
+	output_open(path, weight);
+}
+
+/*
+ * Add an output of the given weight, writing to path ("-" for stdout). Exits
+ * on error.
+ */
+static void
+output_open(const char *path, uint64_t weight)
+{
+	struct output	*o;
+	void		*tmp;
+
+	if ((tmp = realloc(output, (noutputs + 1) * sizeof(*output))) == NULL)
+		err(1, "Failed to allocate memory for outputs");
+	output = tmp;
+	o = &output[noutputs++];
+	o->weight = weight;
+	if (strcmp(path, "-") == 0) {
+		o->path = strdup("stdout");
+		o->file = stdout;
+	} else {
+		o->path = strdup(path);
+		if ((o->file = fopen(path, "w")) == NULL)
+			err(1, "Failed to open %s", path);
+	}
+	if (o->path == NULL)
+		err(1, "Failed to allocate memory");
+#ifdef HAVE_PTHREAD
+	o->ctx = NULL;
+	o->len = 0;
 #endif
+}
+
+/*
+ * Add n outputs of weight 1 for --shards, writing to pattern with "%d"
+ * replaced by 0 to n - 1 and "%%" by "%". Exits on error.
+ */
+static void
+output_shards(const char *pattern, unsigned int n)
+{
+	const char	*p;
+	char		*path, *q;
+	size_t		 len;
+	unsigned int	 i;
+	int		 found;
+
+	for (p = pattern, found = 0; (p = strchr(p, '%')) != NULL; p += 2)
+		if (p[1] == 'd' && !found)
+			found = 1;
+		else if (p[1] != '%')
+			errx(1, "--output needs exactly one %%d, and no other %%: %s", pattern);
+	if (!found)
+		errx(1, "--output needs exactly one %%d, and no other %%: %s", pattern);
+
+	/* sizeof(unsigned int) * 3 digits suffice */
+	len = strlen(pattern) + sizeof(i) * 3 + 1;
+	if ((path = malloc(len)) == NULL)
+		err(1, "Failed to allocate memory");
+	for (i = 0; i < n; i++) {
+		for (p = pattern, q = path; *p != '\0'; p++) {
+			if (*p != '%')
+				*q++ = *p;
+			else if (*++p == '%')
+				*q++ = '%';
+			else
+				/* LINTED this fits, see above */
+				q += snprintf(q, len - (q - path), "%u", i);
+		}
+		*q = '\0';
+		output_open(path, 1);
+	}
+	free(path);
+}
+
+/*
+ * Make write_recs() deal every permutation of period records over o[0] to
+ * o[n - 1], as described at struct output; the sum of their weights must be
+ * at most OUTPUT_WEIGHT_MAX.
+ */
+static void
+output_set(struct output *o, size_t n, uint64_t period)
+{
+	uint64_t	 sum, cum;
+	size_t		 i;
+
+	for (i = 0, sum = 0; i < n; i++)
+		sum += o[i].weight;
+	assert(sum > 0 && sum <= OUTPUT_WEIGHT_MAX);
+	for (i = 0, cum = 0; i < n; i++) {
+		cum += o[i].weight;
+		/* floor(period * cum / sum), which cannot overflow */
+		o[i].end = period / sum * cum + period % sum * cum / sum;
+	}
+	assert(o[n - 1].end == period);
+
+	output_cur = o;
+	output_ncur = n;
+	output_period = period;
+}
+
+/*
+ * Return the output for record written of the current permutations (see
+ * output_set()), and set *left to the number of records, starting with that
+ * one, that go there as well.
+ */
+static struct output *
+output_find(uint64_t written, uint64_t *left)
+{
+	uint64_t	 pos;
+	size_t		 i;
+
+	assert(output_period > 0);
+	pos = written % output_period;
+	for (i = 0; output_cur[i].end <= pos; i++)
+		assert(i + 1 < output_ncur);
+	*left = output_cur[i].end - pos;
+
+	return &output_cur[i];
+}
+
+/*
+ * Write rec[0] to rec[len - 1] to the outputs (see struct output) and, unless
+ * keep is set, free them; *written counts the records written so far, out of
+ * n. Exits on error.
+ */
+static void
+write_recs(struct rec *rec, uint64_t len, uint64_t *written, uint64_t n, int keep)
+{
+	const char	*errstr;
+	FILE		*file;
+	uint64_t	 i, left;
+	size_t		 done, j;
+
+#ifdef HAVE_PTHREAD
+	if (write_threads > 1 && write_parallel(rec, len, *written)) {
+		for (i = 0; !keep && i < len; i++)
+			rec_free(&rec[i]);
+		*written += len;
+		records_written += len;
+		return;
+	}
+#endif
+
+	for (i = 0; i < len; i += done) {
+		if (got_progress) {
+			got_progress = 0;
+			if (stats_file != NULL)
+				stats_print();
+			else if (n == UINT64_MAX)
+				/* Unknown, for -w */
+				fprintf(stderr, "Writing record %" PRIu64 "\n", *written + 1);
+			else
+				fprintf(stderr, "Writing record %" PRIu64 "/%" PRIu64 "\n",
+				    *written + 1, n);
+		}
+
+		file = output_find(*written, &left)->file;
+		/* LINTED the batch is at most write_batch records */
+		errstr = rec_write_batch(ctx, &rec[i], MIN(MIN(len - i, left), write_batch), NULL, file, &done);
+		for (j = 0; !keep && j < done; j++)
+			rec_free(&rec[i + j]);
+		*written += done;
+		records_written += done;
+		if (errstr != NULL && errno != EAGAIN && errno != EINTR)
+			errx(1, "%s", errstr);
+	}
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * write_recs() using the pool of writer threads, see struct write_pool.
+ * Returns 1 if rec[0] to rec[len - 1] were written, starting at record
+ * written of the current permutations, and 0 if they all go to the same
+ * output (which is better left to write_recs() itself). Exits on error.
+ */
+static int
+write_parallel(struct rec *rec, uint64_t len, uint64_t written)
+{
+	struct output	*o = NULL;
+	pthread_t	*thread;
+	uint64_t	 i, left;
+	long		 j, n;
+
+	for (i = 0, n = 0; i < len; i += o->len, n++) {
+		o = output_find(written + i, &left);
+		/* All records written at once go to different outputs */
+		assert(o->len == 0);
+		o->rec = &rec[i];
+		o->len = MIN(len - i, left);
+	}
+	if (n < 2) {
+		if (n == 1)
+			o->len = 0;
+		return 0;
+	}
+
+	for (j = 0; (size_t) j < output_ncur; j++)
+		if (output_cur[j].len > 0 && output_cur[j].ctx == NULL &&
+		    (output_cur[j].ctx = rec_ctx_new()) == NULL)
+			err(1, "Failed to allocate memory");
+	n = MIN(n, write_threads) - 1;
+	if ((thread = calloc(MAX(n, 1), sizeof(*thread))) == NULL)
+		err(1, "Failed to allocate memory for threads");
+	write_pool.next = 0;
+	/* If no more threads can be created, the others do more work */
+	for (j = 0; j < n; j++)
+		if (pthread_create(&thread[j], NULL, write_thread, &write_pool) != 0)
+			break;
+	write_thread(&write_pool);
+	for (n = j, j = 0; j < n; j++)
+		if ((errno = pthread_join(thread[j], NULL)) != 0)
+			err(1, "Failed to join thread");
+	free(thread);
+
+	return 1;
+}
+
+/*
+ * Write out the records for every output in the pool, one at a time, as
+ * described at struct write_pool. Exits on error.
+ */
+static void *
+write_thread(void *arg)
+{
+	struct write_pool *pool;
+	struct output	*o;
+	const char	*errstr;
+	uint64_t	 i;
+	size_t		 done, next;
+
+	pool = arg;
+	for (;;) {
+		pthread_mutex_lock(&pool->mutex);
+		while (pool->next < output_ncur && output_cur[pool->next].len == 0)
+			pool->next++;
+		next = pool->next < output_ncur ? pool->next++ : output_ncur;
+		pthread_mutex_unlock(&pool->mutex);
+		if (next == output_ncur)
+			break;
+
+		o = &output_cur[next];
+		for (i = 0; i < o->len; i += done) {
+			/* LINTED the batch is at most write_batch records */
+			errstr = rec_write_batch(o->ctx, &o->rec[i], MIN(o->len - i, write_batch), NULL, o->file, &done);
+			if (errstr != NULL && errno != EAGAIN && errno != EINTR)
+				errx(1, "%s", errstr);
+		}
+		o->len = 0;
+	}
+
+	return NULL;
+}
+
+/*
+ * Add the statistics of the contexts of all outputs (see struct write_pool)
+ * to st. Must not be called while any writer threads are running.
+ */
+static void
+write_stats(struct rec_stats *st)
+{
+	struct rec_stats add;
+	size_t		 i;
+
+	for (i = 0; i < noutputs; i++) {
+		if (output[i].ctx == NULL)
+			continue;
+		rec_get_stats(output[i].ctx, &add);
+		st->preads += add.preads;
+		st->pread_bytes += add.pread_bytes;
+	}
+}
+#endif
+
+/*
+ * For Algorithm L (see sample_read()): update w for a reservoir of k records,
+ * and return the number of records to skip before the next replacement, using
+ * stream p (see prng_uniform()).
+ */
+static uint64_t
+reservoir_skip(double *w, uint64_t k, struct prng *p)
+{
+	double		 skip;
+
+	*w *= exp(log(prng_real(p)) / k);
+	/* Note that log1p(-1) is -infinity, so skip is 0 if *w is 1 */
+	skip = floor(log(prng_real(p)) / log1p(-*w));
+
+	/* LINTED skip is a nonnegative integer, and fits if it is small enough */
+	return skip < 0x1p64 ? (uint64_t) skip : UINT64_MAX;
+}
+
+/*
+ * Initialize s as an empty sample of at most k records. Exits on error.
+ */
+static void
+sample_init(struct sample *s, uint64_t k)
+{
+	if ((s->rec = malloc((s->size = 128) * sizeof(*s->rec))) == NULL)
+		err(1, "Failed to allocate memory for records");
+	s->k = k;
+	s->n = 0;
+	s->skip = 0;
+	s->w = 1;
+}
+
+/*
+ * Make room for at least n records in s->rec[]. Exits on error.
+ */
+static void
+sample_reserve(struct sample *s, uint64_t n)
+{
+	void		*tmp;
+	uint64_t	 size;
+
+	if (n <= s->size)
+		return;
+
+	for (size = s->size; size < n; size *= 2)
+		if (size > SIZE_MAX / 2 / sizeof(*s->rec))
+			err(1, "Too many records");
+	/* LINTED size * sizeof(*s->rec) fits, see above */
+	if ((tmp = realloc(s->rec, size * sizeof(*s->rec))) == NULL)
+		err(1, "Failed to allocate memory for more records");
+
+	s->rec = tmp;
+	s->size = size;
+}
+
+/*
+ * Read all records of op->rfd into s, using context c and stream p (see
+ * prng_uniform()). Exits on error.
+ *
+ * With -n, s->rec[] is a reservoir of s->k records, maintained with Li's
+ * Algorithm L: once the reservoir is full, skip a random number of records,
+ * and let the next one replace a random record in the reservoir. Every record
+ * is equally likely to end up in the reservoir, but only about
+ * k * log(n / k) random numbers are needed, and skipped records are discarded
+ * by rec_next() without ever being stored.
+ *
+ * If b is not NULL (for -x), the records are passed through s->rec[] to the
+ * buckets instead.
+ *
+ * Records are read in batches (see rec_next_batch()) where possible, i.e.
+ * unless the reservoir is full; skipped records are skipped all at once where
+ * possible (see rec_skip()).
+ */
+static void
+sample_read(struct sample *s, struct rec_ctx *c, struct operand *op, struct prng *p, struct buckets *b)
+{
+	struct rec	*target, next;
+	uint64_t	 r;
+	size_t		 batch;
+	ssize_t		 nread;
+
+	while (1) {
+		batch = 0;
+		if (b != NULL) {
+			target = s->rec;
+			/* LINTED s->size is the size of rec[] */
+			batch = s->size;
+		} else if (s->n < s->k) {
+			sample_reserve(s, s->n + 1);
+			target = &s->rec[s->n];
+			/* LINTED idem */
+			batch = MIN(s->size, s->k) - s->n;
+		} else if (s->skip > 0 && unique == NULL)
+			target = NULL;
+		else
+			/* With -u, even skipped records must be looked at */
+			target = &next;
+
+try_again:
+		if (got_progress) {
+#ifdef HAVE_PTHREAD
+			if (ingest.op != NULL)
+				/* Leave the reporting to main() */
+				ingest_report(op, c);
+			else
+#endif
+			{
+				got_progress = 0;
+				if (stats_file != NULL)
+					stats_print();
+				else {
+					fprintf(stderr, "Reading %s: read %" PRIu64 " records (in total)\n",
+					    op->name, s->n);
+					fflush(stderr);
+				}
+			}
+		}
+		if (batch > 0)
+			nread = rec_next_batch(c, op->rfd, target, batch);
+		else if (target == NULL)
+			nread = rec_skip(c, op->rfd, s->skip);
+		else
+			nread = rec_next(c, op->rfd, target) == 0 ? 1 : -1;
+		if (nread == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				goto try_again;
+			else if (errno == 0)
+				break;
+			else
+				read_error(op);
+		}
+		/* LINTED nread is positive */
+		if (unique != NULL && (nread = unique_filter(c, target, nread, op)) == 0)
+			continue;
+
+		if (b != NULL) {
+			/* LINTED idem */
+			for (r = 0; r < (uint64_t) nread; r++) {
+				buckets_save(b, &s->rec[r]);
+				rec_free(&s->rec[r]);
+			}
+		} else if (target == NULL)
+			/* LINTED idem */
+			s->skip -= nread;
+		else if (target == &next && s->skip > 0) {
+			/* Only with -u, see above */
+			rec_free(&next);
+			s->skip--;
+		} else if (target == &next) {
+			r = prng_uniform64(p, s->k);
+			rec_free(&s->rec[r]);
+			s->rec[r] = next;
+			s->skip = reservoir_skip(&s->w, s->k, p);
+		}
+
+		/* LINTED idem */
+		s->n += nread;
+		if (s->n == s->k && b == NULL) {
+			/* The reservoir is full */
+			s->w = 1;
+			s->skip = reservoir_skip(&s->w, s->k, p);
+		}
+	}
+}
+
+/*
+ * Read all records of op->rfd into the independent samples s[0] to
+ * s[ns - 1] (for --sample), as sample_read() does for one, without -x. Only
+ * the records that no sample wants are skipped; a record that several samples
+ * want is copied with rec_dup(). Exits on error.
+ */
+static void
+samples_read(struct sample *s, size_t ns, struct operand *op)
+{
+	struct rec	 next, *slot;
+	uint64_t	 skip, r;
+	size_t		 i, used;
+	ssize_t		 nread;
+
+	for (;;) {
+		for (i = 0, skip = UINT64_MAX; i < ns; i++)
+			skip = MIN(skip, s[i].n < s[i].k ? 0 : s[i].skip);
+
+try_again:
+		if (got_progress) {
+			got_progress = 0;
+			if (stats_file != NULL)
+				stats_print();
+			else {
+				fprintf(stderr, "Reading %s: read %" PRIu64 " records (in total)\n",
+				    op->name, s[0].n);
+				fflush(stderr);
+			}
+		}
+		/* With -u, even skipped records must be looked at */
+		if (unique != NULL)
+			skip = 0;
+		if (skip > 0)
+			nread = rec_skip(ctx, op->rfd, skip);
+		else
+			nread = rec_next(ctx, op->rfd, &next) == 0 ? 1 : -1;
+		if (nread == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				goto try_again;
+			else if (errno == 0)
+				break;
+			else
+				read_error(op);
+		}
+
+		if (unique != NULL && unique_filter(ctx, &next, 1, op) == 0)
+			continue;
+		if (skip > 0) {
+			/* All samples are full, and none wanted these */
+			for (i = 0; i < ns; i++) {
+				/* LINTED nread is positive */
+				s[i].skip -= nread;
+				s[i].n += nread;
+			}
+			continue;
+		}
+
+		for (i = 0, used = 0; i < ns; i++) {
+			if (s[i].n < s[i].k) {
+				sample_reserve(&s[i], s[i].n + 1);
+				slot = &s[i].rec[s[i].n];
+			} else if (s[i].skip > 0) {
+				s[i].skip--;
+				s[i].n++;
+				continue;
+			} else {
+				r = prng_uniform64(NULL, s[i].k);
+				rec_free(&s[i].rec[r]);
+				slot = &s[i].rec[r];
+				s[i].skip = reservoir_skip(&s[i].w, s[i].k, NULL);
+			}
+
+			if (used++ == 0)
+				*slot = next;
+			else if (rec_dup(ctx, &next, slot) == -1)
+				err(1, "Failed to copy record from %s (try a larger -m)", op->name);
+			if (++s[i].n == s[i].k) {
+				/* The reservoir is full */
+				s[i].w = 1;
+				s[i].skip = reservoir_skip(&s[i].w, s[i].k, NULL);
+			}
+		}
+		if (used == 0)
+			/* Only with -u, see above */
+			rec_free(&next);
+	}
+}
+
+/*
+ * Stream the records of op->rfd through the pool s->rec[] of up to window
+ * records (for -w): until the pool is full, records just go in; after that,
+ * every record replaces a random one in the pool, which is written out right
+ * away. *written counts the records written so far. This needs room for
+ * write_batch records in batch[]. Exits on error.
+ *
+ * The pool holds the first MIN(s->n, s->k) records of s->rec[]. Records are
+ * never spooled (see rec_stream()), so if the next one does not fit in
+ * memory, the pool shrinks instead: a random record is written out to make
+ * room, and s->k drops below window until the pool can grow again.
+ *
+ * Records are read in batches; a short batch means that no more data was
+ * available, so the output is flushed before reading more.
+ */
+static void
+window_read(struct sample *s, struct operand *op, struct rec *batch, uint64_t window, uint64_t *written)
+{
+	struct rec	*target, tmp;
+	uint64_t	 r, pool;
+	size_t		 i, max;
+	ssize_t		 nread;
+	int		 short_batch;
+
+	for (;;) {
+		pool = MIN(s->n, s->k);
+		if (pool < window) {
+			sample_reserve(s, pool + 1);
+			target = &s->rec[pool];
+			/* LINTED s->size is the size of rec[] */
+			max = MIN(s->size, window) - pool;
+		} else {
+			target = batch;
+			max = write_batch;
+		}
+
+try_again:
+		if (got_progress) {
+			got_progress = 0;
+			if (stats_file != NULL)
+				stats_print();
+			else {
+				fprintf(stderr, "Reading %s: read %" PRIu64 " records (in total), wrote %" PRIu64 "\n",
+				    op->name, s->n, *written);
+				fflush(stderr);
+			}
+		}
+		if ((nread = rec_next_batch(ctx, op->rfd, target, max)) == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				goto try_again;
+			else if (errno == 0)
+				break;
+			else if (errno != ENOBUFS)
+				read_error(op);
+
+			/* Out of memory, so make room */
+			if (pool == 0)
+				errx(1, "Record from %s does not fit in memory (try a larger -m)", op->name);
+			r = prng_uniform64(NULL, pool);
+			tmp = s->rec[r];
+			s->rec[r] = s->rec[pool - 1];
+			s->k = pool - 1;
+			write_recs(&tmp, 1, written, UINT64_MAX, 0);
+			continue;
+		}
+		/* LINTED nread is positive */
+		short_batch = (size_t) nread < max;
+		/* LINTED idem */
+		if (unique != NULL && (nread = unique_filter(ctx, target, nread, op)) == 0)
+			continue;
+
+		/* LINTED idem */
+		s->n += nread;
+		if (target != batch) {
+			/* The pool grew, possibly back to window */
+			s->k = MAX(s->k, pool + nread);
+			continue;
+		}
+		/* LINTED idem */
+		for (i = 0; i < (size_t) nread; i++) {
+			r = prng_uniform64(NULL, pool);
+			tmp = s->rec[r];
+			s->rec[r] = batch[i];
+			batch[i] = tmp;
+		}
+		/* LINTED idem */
+		write_recs(batch, nread, written, UINT64_MAX, 0);
+		if (short_batch && fflush(output[0].file) == EOF)
+			err(1, "Failed to write %s", output[0].path);
+	}
+}
+
+/*
+ * For -u: drop the records in rec[0] to rec[n - 1], just read from op with
+ * context c, that have been read before, and move the others to the front.
+ * Returns the number of records left. Exits on error.
+ */
+static size_t
+unique_filter(struct rec_ctx *c, struct rec *rec, size_t n, const struct operand *op)
+{
+	size_t		 i, left;
+
+	for (i = 0, left = 0; i < n; i++)
+		switch (rec_unique_add(c, unique, &rec[i])) {
+		case 1:
+			rec[left++] = rec[i];
+			break;
+		case 0:
+			rec_free(&rec[i]);
+			break;
+		default:
+			err(1, "Failed to remember record from %s", op->name);
+		}
+
+	return left;
+}
+
+/*
+ * Report a failure to read from op, with errno set as by rec_next(), and exit.
+ */
+static void
+read_error(const struct operand *op)
+{
+	errx(1, "Failed to read from %s: %s%s", op->name, strerror(errno),
+	    errno == EINVAL ? ", error in regular expression or zero-length match" : "");
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Add the records of from, which was read separately (with the same k), to s
+ * as if sample_read() had read them into s directly, and free from. Exits on
+ * error.
+ *
+ * Until the reservoir is full, every record simply goes in. After that, run
+ * Algorithm L on the remaining records of from, without looking at them, to
+ * find the slots that they would replace. Since from->rec[] is a uniformly
+ * random sample of MIN(k, from->n) of its records, and at most that many
+ * slots are filled, those slots get distinct records chosen at random from
+ * from->rec[]; the rest is freed.
+ */
+static void
+sample_merge(struct sample *s, struct sample *from)
+{
+	struct rec	 tmp;
+	uint64_t	*slot, *taken;
+	uint64_t	 old, fill, left, stored, nslots, slot_size, i, r;
+
+	assert(from->k == s->k);
+	old = MIN(s->n, s->k);
+	stored = MIN(from->n, from->k);
+	fill = MIN(s->k - old, from->n);
+	left = from->n - fill;
+
+	if (old == 0) {
+		/* Every record of from goes in, so just take over from->rec[] */
+		free(s->rec);
+		s->rec = from->rec;
+		s->size = from->size;
+		from->rec = NULL;
+	} else
+		sample_reserve(s, old + fill);
+	if (s->n < s->k && s->n + fill == s->k) {
+		/* The reservoir is full */
+		s->w = 1;
+		s->skip = reservoir_skip(&s->w, s->k, NULL);
+	}
+
+	/* Replacements; note that the last fill slots already hold records of from */
+	slot = taken = NULL;
+	nslots = slot_size = 0;
+	if (left > 0) {
+		assert(old + fill == s->k);
+		/* LINTED s->k fits, since s->rec[] is at least that large */
+		if ((taken = calloc(s->k / 64 + 1, sizeof(*taken))) == NULL)
+			err(1, "Failed to allocate memory for merging records");
+	}
+	while (left > 0) {
+		if (s->skip >= left) {
+			s->skip -= left;
+			break;
+		}
+		left -= s->skip + 1;
+		r = prng_uniform64(NULL, s->k);
+		s->skip = reservoir_skip(&s->w, s->k, NULL);
+		if (r >= old || (taken[r / 64] & UINT64_C(1) << r % 64) != 0)
+			continue;
+
+		taken[r / 64] |= UINT64_C(1) << r % 64;
+		if (nslots == slot_size) {
+			slot_size = MAX(2 * slot_size, 128);
+			/* LINTED nslots is at most stored, which fits */
+			if ((slot = realloc(slot, slot_size * sizeof(*slot))) == NULL)
+				err(1, "Failed to allocate memory for merging records");
+		}
+		slot[nslots++] = r;
+	}
+	assert(fill + nslots <= stored);
+
+	/* Choose fill + nslots records of from at random */
+	if (fill + nslots < stored) {
+		for (i = 0; i < fill + nslots; i++) {
+			r = i + prng_uniform64(NULL, stored - i);
+			tmp = from->rec[i];
+			from->rec[i] = from->rec[r];
+			from->rec[r] = tmp;
+		}
+		for (; i < stored; i++)
+			rec_free(&from->rec[i]);
+	}
+
+	if (from->rec != NULL)
+		/* LINTED fill is at most the size of s->rec[] */
+		memcpy(&s->rec[old], from->rec, fill * sizeof(*s->rec));
+	for (i = 0; i < nslots; i++) {
+		rec_free(&s->rec[slot[i]]);
+		s->rec[slot[i]] = from->rec[fill + i];
+	}
+	s->n += from->n;
+
+	free(slot);
+	free(taken);
+	free(from->rec);
+}
+
+/*
+ * Read op[0] to op[nops - 1] into s with up to threads threads, as described
+ * at struct ingest. Exits on error.
+ */
+static void
+ingest_run(struct sample *s, struct operand *op, size_t nops, long threads)
+{
+	struct rec_stats st;
+	pthread_t	*thread;
+	size_t		 i, nthreads;
 
-#include <assert.h>
-#include <err.h>
-#include <errno.h>
-#include <fcntl.h>
-#include <inttypes.h>
-#include <limits.h>
-#ifdef HAVE_SIGINFO
-#include <signal.h>
+	ingest.nops = nops;
+	ingest.next = 0;
+	ingest.key = prng_random64(NULL);
+	ingest.k = s->k;
+	for (i = 0; i < nops; i++)
+		op[i].done = 0;
+	/* From now on, sample_read() calls ingest_report() */
+	ingest.op = op;
+
+	/* LINTED threads is positive */
+	if ((thread = malloc(MIN((size_t) threads, nops) * sizeof(*thread))) == NULL)
+		err(1, "Failed to allocate memory for threads");
+	for (nthreads = 0; nthreads < MIN((size_t) threads, nops); nthreads++)
+		if (pthread_create(&thread[nthreads], NULL, ingest_thread, &ingest) != 0)
+			break;
+	if (nthreads == 0)
+		/* Do it all here, before merging */
+		ingest_thread(&ingest);
+
+	/* Merge in order, reporting progress while waiting */
+	for (i = 0; i < nops; i++) {
+		pthread_mutex_lock(&ingest.mutex);
+		while (!op[i].done) {
+			if (got_progress) {
+				got_progress = 0;
+				pthread_mutex_unlock(&ingest.mutex);
+				if (stats_file != NULL)
+					stats_print();
+				else {
+					memset(&st, 0, sizeof(st));
+					ingest_stats(&st);
+					fprintf(stderr, "Reading %zu files: read %" PRIu64 " records (in total)\n",
+					    nops - i, st.records);
+					fflush(stderr);
+				}
+				pthread_mutex_lock(&ingest.mutex);
+				continue;
+			}
+			pthread_cond_wait(&ingest.cond, &ingest.mutex);
+		}
+		pthread_mutex_unlock(&ingest.mutex);
+
+		sample_merge(s, &op[i].sample);
+	}
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(thread[i], NULL);
+	free(thread);
+}
+
+/*
+ * Read operands for ingest_run(), until there are none left.
+ */
+static void *
+ingest_thread(void *arg)
+{
+	struct ingest	*in;
+	struct operand	*op;
+	struct rec_ctx	*c;
+	struct rec_stats st;
+	struct prng	 p;
+	size_t		 i;
+
+	in = arg;
+	for (;;) {
+		pthread_mutex_lock(&in->mutex);
+		i = in->next < in->nops ? in->next++ : in->nops;
+		pthread_mutex_unlock(&in->mutex);
+		if (i == in->nops)
+			break;
+
+		/* Every operand gets its own stream */
+		op = &in->op[i];
+		prng_init(&p, in->key, i);
+		if ((c = rec_ctx_new()) == NULL)
+			err(1, "Failed to allocate memory");
+		sample_init(&op->sample, in->k);
+		sample_read(&op->sample, c, op, &p, NULL);
+
+		/*
+		 * Freeing c makes sure that this thread never touches the
+		 * records of op again, so that main() can free them.
+		 */
+		rec_get_stats(c, &st);
+		rec_ctx_free(c);
+		pthread_mutex_lock(&in->mutex);
+		op->stats = st;
+		op->done = 1;
+		pthread_cond_broadcast(&in->cond);
+		pthread_mutex_unlock(&in->mutex);
+	}
+
+	return NULL;
+}
+
+/*
+ * Report the statistics of c, which is reading op, and wake up ingest_run().
+ */
+static void
+ingest_report(struct operand *op, const struct rec_ctx *c)
+{
+	struct rec_stats st;
+
+	rec_get_stats(c, &st);
+	pthread_mutex_lock(&ingest.mutex);
+	op->stats = st;
+	pthread_cond_broadcast(&ingest.cond);
+	pthread_mutex_unlock(&ingest.mutex);
+}
+
+/*
+ * Add the last reported statistics of all operands read by ingest_run(), if
+ * any, to st; memory_used and memory_peak are not per operand, and are left
+ * alone.
+ */
+static void
+ingest_stats(struct rec_stats *st)
+{
+	const struct rec_stats *add;
+	size_t		 i;
+
+	pthread_mutex_lock(&ingest.mutex);
+	for (i = 0; ingest.op != NULL && i < ingest.nops; i++) {
+		add = &ingest.op[i].stats;
+		st->records += add->records;
+		st->records_mem += add->records_mem;
+		st->records_disk += add->records_disk;
+		st->bytes_read += add->bytes_read;
+		st->bytes_spooled += add->bytes_spooled;
+		st->preads += add->preads;
+		st->pread_bytes += add->pread_bytes;
+		st->spool_wall += add->spool_wall;
+		st->spool_cpu += add->spool_cpu;
+		st->spool_wait += add->spool_wait;
+	}
+	pthread_mutex_unlock(&ingest.mutex);
+}
 #endif
-#include <stdio.h>
-#include <string.h>
-#ifndef HAVE_ARC4RANDOM
-#ifndef HAVE_SRANDOMDEV
-#include <time.h>
+
+/*
+ * Shuffle rec[0] to rec[n - 1], using up to threads threads.
+ */
+static void
+shuffle(struct rec *rec, uint64_t n, int threads)
+{
+	struct shuffle_level level;
+	struct prng	 p;
+#ifdef HAVE_PTHREAD
+	pthread_t	*thread;
+	int		 i, nthreads;
 #endif
+
+	if (n < SHUFFLE_MERGE_MIN) {
+		prng_init(&p, prng_random64(NULL), 0);
+		shuffle_block(rec, n, &p);
+		return;
+	}
+
+#ifdef HAVE_PTHREAD
+	if (pthread_mutex_init(&level.mutex, NULL) != 0)
+		err(1, "Failed to initialize mutex");
+	if ((thread = malloc(threads * sizeof(*thread))) == NULL)
+		err(1, "Failed to allocate memory for threads");
 #endif
-#include <unistd.h>
 
-#include <pcre.h>
+	/* A power of two blocks of at least SHUFFLE_MERGE_MIN / 2 records */
+	for (level.nblocks = 2;
+	     level.nblocks < SHUFFLE_BLOCKS_MAX && n / (2 * level.nblocks) >= SHUFFLE_MERGE_MIN / 2;
+	     level.nblocks *= 2);
+	level.rec = rec;
+	level.n = n;
+	level.key = prng_random64(NULL);
 
-#include "compat.h"
-#include "record.h"
+	/*
+	 * Shuffle each block (width 1), then merge pairs of blocks (width 2),
+	 * and so on. This thread helps out, so everything works even if no
+	 * threads can be created.
+	 */
+	for (level.width = 1; level.width <= level.nblocks; level.width *= 2) {
+		level.njobs = level.nblocks / level.width;
+		level.next = 0;
 
-#ifndef __GNUC__
-#ifndef __attribute__
-#define __attribute__(x) /* Not supported by non-GCC compilers */
-#endif
+#ifdef HAVE_PTHREAD
+		for (nthreads = 0; nthreads < MIN(threads, level.njobs) - 1; nthreads++)
+			if (pthread_create(&thread[nthreads], NULL, shuffle_thread, &level) != 0)
+				break;
 #endif
-#ifndef MIN
-#define MIN(x, y) ((x) < (y) ? (x) : (y))
+		shuffle_thread(&level);
+#ifdef HAVE_PTHREAD
+		for (i = 0; i < nthreads; i++)
+			pthread_join(thread[i], NULL);
 #endif
-#ifndef MAX
-#define MAX(x, y) ((x) > (y) ? (x) : (y))
+	}
+
+#ifdef HAVE_PTHREAD
+	free(thread);
+	pthread_mutex_destroy(&level.mutex);
 #endif
+}
 
-#ifdef HAVE_SIGINFO
-static volatile sig_atomic_t got_siginfo = 0;
-static void handle_siginfo(int sig);
+/*
+ * Shuffle rec[0] to rec[n - 1] using a Fisher-Yates shuffle.
+ */
+static void
+shuffle_block(struct rec *rec, uint64_t n, struct prng *p)
+{
+	struct rec	 tmp;
+	uint64_t	 i, r;
+
+	for (i = n; i > 1; i--) {
+		r = prng_uniform64(p, i);
+		tmp = rec[i - 1];
+		rec[i - 1] = rec[r];
+		rec[r] = tmp;
+	}
+}
+
+/*
+ * Run jobs from level until there are none left: shuffle a block (for width
+ * 1) or merge two runs of width / 2 blocks each.
+ */
+static void *
+shuffle_thread(void *arg)
+{
+	struct shuffle_level *level;
+	struct prng	 p;
+	uint64_t	 start, mid, end;
+	unsigned int	 job;
+
+	level = arg;
+	for (;;) {
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&level->mutex);
+#endif
+		job = level->next++;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&level->mutex);
 #endif
+		if (job >= level->njobs)
+			break;
 
-int main(int argc, char **argv);
+		/* Every job gets its own stream */
+		prng_init(&p, level->key, (uint64_t) level->width * SHUFFLE_BLOCKS_MAX + job);
 
-static void usage(void) __attribute__((noreturn));
+		/*
+		 * These cannot overflow, since level->n * level->nblocks is
+		 * far smaller than the size of rec[] in bytes
+		 */
+		start = level->n * job * level->width / level->nblocks;
+		end = level->n * (job + 1) * level->width / level->nblocks;
+		if (level->width == 1)
+			shuffle_block(&level->rec[start], end - start, &p);
+		else {
+			mid = level->n * (2 * job + 1) * (level->width / 2) / level->nblocks;
+			shuffle_merge(&level->rec[start], mid - start, end - start, &p);
+		}
+	}
 
-static const size_t memory_cache_initial = 16 * 1024;
+	return NULL;
+}
 
+/*
+ * Given that rec[0] to rec[mid - 1] and rec[mid] to rec[n - 1] are each
+ * uniformly shuffled, make rec[0] to rec[n - 1] a uniformly random shuffle:
+ * repeatedly take the next record from either half at random, until one of
+ * them runs out, and then insert the remaining records at random positions.
+ */
 static void
-usage(void)
+shuffle_merge(struct rec *rec, uint64_t mid, uint64_t n, struct prng *p)
 {
-	fprintf(stderr, "randomize [-a | -e regex] [-o str] [-n number] [arg [arg ...]]\n");
-	exit(127);
+	struct rec	 tmp;
+	uint64_t	 i, j, r;
+	uint64_t	 bits;
+	int		 nbits, coin;
+
+	nbits = 0;
+	bits = 0;
+	for (i = 0, j = mid; ; i++) {
+		if (nbits == 0) {
+			bits = prng_random64(p);
+			nbits = 64;
+		}
+		nbits--;
+		/* LINTED bits & 1 fits in an int */
+		coin = bits & 1;
+		bits >>= 1;
+		if (coin == 0) {
+			if (i == j)
+				break;
+		} else {
+			if (j == n)
+				break;
+			tmp = rec[i];
+			rec[i] = rec[j];
+			rec[j] = tmp;
+			j++;
+		}
+	}
+
+	for (; i < n; i++) {
+		r = prng_uniform64(p, i + 1);
+		tmp = rec[i];
+		rec[i] = rec[r];
+		rec[r] = tmp;
+	}
 }
 
-#ifdef HAVE_SIGINFO
 static void
-handle_siginfo(int sig)
+handle_progress(int sig)
+{
+	got_progress = 1;
+}
+
+/*
+ * Charge the time since the last call to the current phase, and go on with
+ * phase next.
+ */
+static void
+stats_phase(enum phase next)
 {
-	assert(sig == SIGINFO);
+	double		 wall, cpu;
+
+	if (stats_file == NULL)
+		return;
 
-	got_siginfo = 1;
+	wall = wall_clock();
+	cpu = cpu_clock();
+	if (phase != PHASE_DONE) {
+		phase_wall[phase] += wall - phase_start_wall;
+		phase_cpu[phase] += cpu - phase_start_cpu;
+	}
+	phase = next;
+	phase_start_wall = wall;
+	phase_start_cpu = cpu;
 }
+
+/*
+ * Print statistics for everything so far to stats_file, as a single line of
+ * JSON. Exits on error.
+ *
+ * Writing the temporary files happens while parsing, either in a writer thread
+ * or in between; the time that parsing waited for it, and the CPU time it
+ * took, are reported for "spool" instead of "parse".
+ */
+static void
+stats_print(void)
+{
+	struct rec_stats st;
+	struct rusage	 ru;
+	double		 wall, cpu;
+	int		 i;
+
+	/* Bring the current phase up to date */
+	stats_phase(phase);
+	rec_get_stats(ctx, &st);
+#ifdef HAVE_PTHREAD
+	ingest_stats(&st);
+	write_stats(&st);
 #endif
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		ru.ru_maxrss = 0;
+
+	fprintf(stats_file, "{\"phase\": \"%s\", \"records\": %" PRIu64
+	    ", \"records_in_memory\": %" PRIu64 ", \"records_on_disk\": %" PRIu64
+	    ", \"records_written\": %" PRIu64 ", \"bytes_read\": %" PRIu64
+	    ", \"bytes_spooled\": %" PRIu64 ", \"preads\": %" PRIu64
+	    ", \"pread_bytes\": %" PRIu64 ", \"memory_cache\": %zu"
+	    ", \"memory_cache_used\": %zu, \"memory_cache_peak\": %zu"
+	    ", \"max_rss_kb\": %ld",
+	    phase_name[phase], st.records, st.records_mem, st.records_disk,
+	    records_written, st.bytes_read, st.bytes_spooled, st.preads,
+	    st.pread_bytes, stats_memory_cache, st.memory_used, st.memory_peak,
+	    ru.ru_maxrss);
+
+	for (i = 0, wall = cpu = 0; i < PHASE_DONE; i++) {
+		wall += phase_wall[i];
+		cpu += phase_cpu[i];
+	}
+	fprintf(stats_file, ", \"wall\": %.6f, \"cpu\": %.6f", wall, cpu);
+	fprintf(stats_file, ", \"parse\": {\"wall\": %.6f, \"cpu\": %.6f}",
+	    MAX(phase_wall[PHASE_PARSE] - st.spool_wait, 0),
+	    MAX(phase_cpu[PHASE_PARSE] - st.spool_cpu, 0));
+	fprintf(stats_file, ", \"spool\": {\"wall\": %.6f, \"cpu\": %.6f, \"wait\": %.6f}",
+	    st.spool_wall, st.spool_cpu, st.spool_wait);
+	for (i = PHASE_SHUFFLE; i < PHASE_DONE; i++)
+		fprintf(stats_file, ", \"%s\": {\"wall\": %.6f, \"cpu\": %.6f}",
+		    phase_name[i], phase_wall[i], phase_cpu[i]);
+	fprintf(stats_file, "}\n");
+
+	if (fflush(stats_file) != 0)
+		err(1, "Failed to write statistics");
+}
+
+/*
+ * Print the final statistics, if any, and close stats_file. Exits on error.
+ */
+static void
+stats_done(void)
+{
+	if (stats_file == NULL)
+		return;
+
+	/* Include writing out whatever stdio still buffers */
+	fflush(stdout);
+	stats_phase(PHASE_DONE);
+	stats_print();
+	if (stats_file != stderr && fclose(stats_file) != 0)
+		err(1, "Failed to write statistics");
+	stats_file = NULL;
+}
+
+/*
+ * Return the time since some fixed point, in seconds.
+ */
+static double
+wall_clock(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		return 0;
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Return the CPU time used by all threads so far, in seconds.
+ */
+static double
+cpu_clock(void)
+{
+	struct rusage	 ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		return 0;
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
 
 int
 main(int argc, char **argv)
 {
-	const char	*re_str, *delim, *errstr;
-	int		 ch, fd, rfd, error_offset, rv, process_options;
-	unsigned int	 i, j;
-	uint_fast32_t	 r, nrecords, rec_size, rec_no;
-	struct rec	*rec, to_free;
-	void		*tmp;
-	pcre		*re;
-	pcre_extra	*re_extra;
-	size_t		 memory_cache;
-#ifndef NDEBUG
-	int		 to_free_valid;
-#endif
-#ifdef HAVE_SIGINFO
+	const char	*re_str, *delim, *errstr, *pattern;
+	int		 ch, fd, error_code, rv, process_options, external, fast, memfd, regex;
+	int		 compress, decompress, progress, parallel, use_index, sampling, splitting, dedup;
+	long		 threads;
+	long long	 seed;
+	unsigned int	 i, j, shards;
+	size_t		 width;
+	uint64_t	 r, nrecords, epochs, epoch, len, total, weight, window, streamed;
+	struct sample	*sample;
+	struct rec	*batch;
+	size_t		 nsamples;
+	struct operand	*op;
+	size_t		 nops, nstdin, nstdout;
+	char		*index_path;
+	struct buckets	 buckets;
+	FILE		*all;
+	char		*tmp_arg;
+	pcre2_code	*re;
+	PCRE2_SIZE	 error_offset;
+	PCRE2_UCHAR	 re_errstr[128];
+	size_t		 memory_cache, memory_cache_initial, literal_len;
+	char		 literal[REC_LITERAL_MAX];
 	struct sigaction act;
+	struct itimerval interval;
 
 	/*
-	 * Enable SIGINFO handler
+	 * Enable progress report handlers
 	 */
-	act.sa_handler = handle_siginfo;
+	act.sa_handler = handle_progress;
+	/* Do not block any other signals while handling this signal */
+	sigemptyset(&act.sa_mask);
+#ifdef HAVE_SIGINFO
 	/* We do *not* wish to restart read() and the like on SIGINFO */
 	act.sa_flags = 0;
-	/* Do not block any other signals while handling this signal */
-	act.sa_mask = 0;
-
 	sigaction(SIGINFO, &act, NULL);
 #endif
+	/*
+	 * SIGUSR1 and SIGALRM may arrive every few seconds, though; restart
+	 * interrupted system calls, so that an interrupted write is never
+	 * retried as a whole.
+	 */
+	act.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &act, NULL);
+	sigaction(SIGALRM, &act, NULL);
 #ifndef HAVE_ARC4RANDOM
 #ifdef HAVE_SRANDOMDEV
 	/* Initialize random number generator */
@@ -126,48 +1859,216 @@ main(int argc, char **argv)
 #endif
 #endif
 
-#ifndef NDEBUG
-	to_free_valid = 0;
-#endif
-	memory_cache = memory_cache_initial;
+	memory_cache_initial = memory_cache_default;
 	re = NULL;
-	re_extra = NULL;
-	tmp = NULL;
-	rfd = 0;
+	literal_len = 0;
+	nstdin = 0;
 
 	/* Defaults */
 	re_str = "\n";
-	delim = "\n";
-	nrecords = UINT32_MAX;
+	/* Was -e given? */
+	regex = 0;
+	/* "\n", or "" with -b; see below */
+	delim = NULL;
+	width = 0;
+	nrecords = UINT64_MAX;
+	epochs = 1;
+	window = 0;
 	process_options = 1;
+	external = 0;
+	/* -R system, unless -R fast or -s is given; see below */
+	fast = -1;
+	memfd = 0;
+	compress = 0;
+	decompress = 0;
+	dedup = 0;
+	use_index = 0;
+	sampling = 0;
+	splitting = 0;
+	shards = 0;
+	pattern = NULL;
+	progress = 0;
+	seed = -1;
+#ifdef _SC_NPROCESSORS_ONLN
+	if ((threads = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+#endif
+		threads = 1;
 
-	while ((ch = getopt(argc, argv, "+ae:n:o:")) != -1) {
+	while ((ch = getopt_long(argc, argv, "+MR:ab:de:j:m:n:o:r:s:uw:xz", longopts, NULL)) != -1) {
 		/*
 		 * Note: option processing is *partially* duplicated below,
 		 * search for "== '-'"
 		 */
 		switch (ch) {
+		case 'M':
+			memfd = 1;
+			break;
+		case 'R':
+			if (strcmp(optarg, "fast") == 0)
+				fast = 1;
+			else if (strcmp(optarg, "system") == 0)
+				fast = 0;
+			else
+				errx(1, "unknown random number generator: %s", optarg);
+			break;
 		case 'a':
 			re_str = NULL;
 			break;
+		case 'b':
+			width = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "record size is %s: %s", errstr, optarg);
+			break;
+		case 'd':
+			decompress = 1;
+			break;
 		case 'e':
 			re_str = optarg;
+			regex = 1;
+			break;
+		case 'j':
+			threads = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "number of threads is %s: %s", errstr, optarg);
+			break;
+		case 'm':
+			memory_cache_initial = parse_size(optarg);
 			break;
 		case 'n':
 			/* LINTED conversion clearly works */
-			nrecords = strtonum(optarg, 1, UINT32_MAX - 1, &errstr);
+			nrecords = strtonum(optarg, 1, LLONG_MAX, &errstr);
 			if (errstr)
 				errx(1, "number of records is %s: %s", errstr, optarg);
 			break;
 		case 'o':
 			delim = optarg;
 			break;
+		case 'r':
+			/* LINTED conversion clearly works */
+			epochs = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "number of permutations is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			seed = strtonum(optarg, 0, LLONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "seed is %s: %s", errstr, optarg);
+			break;
+		case 'u':
+			dedup = 1;
+			break;
+		case 'w':
+			/* LINTED conversion clearly works */
+			window = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr)
+				errx(1, "window size is %s: %s", errstr, optarg);
+			break;
+		case 'x':
+			external = 1;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		case OPT_INDEX:
+			use_index = 1;
+			break;
+		case OPT_SAMPLE:
+			output_add(optarg, LLONG_MAX, "--sample");
+			sampling = 1;
+			break;
+		case OPT_SPLIT:
+			output_add(optarg, OUTPUT_WEIGHT_MAX, "--split");
+			splitting = 1;
+			break;
+		case OPT_OUTPUT:
+			pattern = optarg;
+			break;
+		case OPT_SHARDS:
+			shards = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "number of shards is %s: %s", errstr, optarg);
+			break;
+		case OPT_PROGRESS:
+			progress = strtonum(optarg, 1, INT_MAX, &errstr);
+			if (errstr)
+				errx(1, "progress interval is %s: %s", errstr, optarg);
+			break;
+		case OPT_STATS:
+			if (stats_file != NULL && stats_file != stderr)
+				fclose(stats_file);
+			if (optarg == NULL)
+				stats_file = stderr;
+			else if ((stats_file = fopen(optarg, "w")) == NULL)
+				err(1, "Failed to open %s", optarg);
+			break;
 		default:
 			assert(ch == '?');
 			usage();
 			/* NOTREACHED */
 		}
 	}
+	if (delim == NULL)
+		delim = width != 0 ? "" : "\n";
+	if (width != 0 && re_str == NULL)
+		errx(1, "-a and -b cannot be combined");
+	if (width != 0 && regex)
+		errx(1, "-b and -e cannot be combined");
+	if (decompress && width != 0)
+		errx(1, "-b and -d cannot be combined");
+	if (seed != -1 && fast == 0)
+		errx(1, "-R system and -s cannot be combined");
+	if (fast == -1)
+		fast = seed != -1;
+	if ((shards == 0) != (pattern == NULL))
+		errx(1, "--shards and --output must be given together");
+	if (sampling + splitting + (shards != 0) > 1)
+		errx(1, "only one of --sample, --split and --shards can be given");
+	if (sampling && nrecords != UINT64_MAX)
+		errx(1, "-n and --sample cannot be combined");
+	if (window != 0 && (re_str == NULL || nrecords != UINT64_MAX || epochs > 1 || noutputs > 0 || shards != 0))
+		errx(1, "-w cannot be combined with -a, -n, -r, --sample, --split or --shards");
+	if (dedup && re_str == NULL)
+		errx(1, "-a and -u cannot be combined");
+	if ((sampling || splitting || shards != 0) && re_str == NULL)
+		errx(1, "-a cannot be combined with --sample, --split or --shards");
+	for (j = 0, weight = 0; splitting && j < noutputs; j++)
+		if ((weight += output[j].weight) > OUTPUT_WEIGHT_MAX)
+			errx(1, "--split weights add up to more than %" PRIu64, (uint64_t) OUTPUT_WEIGHT_MAX);
+	if (shards != 0)
+		output_shards(pattern, shards);
+	if (noutputs == 0)
+		output_open("-", 1);
+	/* Two outputs on stdout must be written in order */
+	for (j = 0, nstdout = 0; j < noutputs; j++)
+		nstdout += output[j].file == stdout;
+#ifdef HAVE_PTHREAD
+	if (!sampling && noutputs > 1 && nstdout <= 1)
+		write_threads = threads;
+#endif
+	memory_cache = stats_memory_cache = memory_cache_initial;
+	stats_phase(PHASE_PARSE);
+	if (progress != 0) {
+		interval.it_interval.tv_sec = interval.it_value.tv_sec = progress;
+		interval.it_interval.tv_usec = interval.it_value.tv_usec = 0;
+		if (setitimer(ITIMER_REAL, &interval, NULL) == -1)
+			err(1, "Failed to set progress interval");
+	}
+	if (fast)
+		/* LINTED seed is nonnegative if it is used */
+		prng_seed(seed != -1 ? (uint64_t) seed : prng_random64(NULL));
+	if (rec_set_memfd(memfd) == -1)
+		err(1, "Cannot keep temporary files in memory");
+	if (rec_set_compress(compress) == -1)
+		err(1, "Cannot compress temporary files");
+	if (rec_set_decompress(decompress) == -1)
+		err(1, "Cannot decompress input");
+	if ((ctx = rec_ctx_new()) == NULL)
+		err(1, "Failed to allocate memory");
+	if (dedup && (unique = rec_unique_new(&memory_cache)) == NULL)
+		err(1, "Failed to allocate memory");
+	/* -n, --sample and -w already limit the number of records we keep */
+	if (nrecords != UINT64_MAX || sampling || window != 0)
+		external = 0;
 	assert(optind > 0);
 	if (strcmp(argv[optind - 1], "--") == 0)
 		/* Stop option processing */
@@ -180,28 +2081,38 @@ main(int argc, char **argv)
 		 * Skip the usual regex-based stuff and randomize the arguments
 		 * (instead of treating them as file names).
 		 */
-		/* LINTED argc is nonnegative, so this works */
-		j = argc;
-		/* LINTED idem */
-		while (j > (nrecords > argc ? 0 : argc - nrecords)) {
-			r = random_uniform(j);
+		for (epoch = 0; epoch < epochs; epoch++) {
+			/* LINTED argc is nonnegative, so this works */
+			j = argc;
+			/* LINTED idem */
+			while (j > (nrecords > argc ? 0 : argc - nrecords)) {
+				r = prng_uniform(NULL, j);
 
-			if (printf("%s", argv[r]) == -1)
-				err(1, "Failed to print");
-			if ((errstr = rec_write_str(delim, stdout)) != NULL)
-				errx(1, "%s", errstr);
+				if (printf("%s", argv[r]) == -1)
+					err(1, "Failed to print");
+				if ((errstr = rec_write_str(ctx, delim, stdout)) != NULL)
+					errx(1, "%s", errstr);
 
-			argv[r] = argv[--j];
+				/* Keep all arguments around for the next permutation */
+				tmp_arg = argv[r];
+				argv[r] = argv[--j];
+				argv[j] = tmp_arg;
+			}
 		}
 
+		stats_done();
 		exit(0);
 	}
 
-	if ((rec = malloc((rec_size = 128) * sizeof(*rec))) == NULL)
-		err(1, "Failed to allocate memory for records");
-
-	rec_no = 0;
-	/* LINTED argc is still nonnegative */
+	/*
+	 * Collect the operands first, so that their number is known before
+	 * any of them is opened.
+	 */
+	/* LINTED argc is nonnegative, so this works */
+	if ((op = calloc(MAX(argc, 1), sizeof(*op))) == NULL)
+		err(1, "Failed to allocate memory for operands");
+	nops = 0;
+	/* LINTED idem */
 	for (i = 0; i < MAX(argc, 1); i++) {
 		/* Process -e, -o */
 		/* LINTED idem */
@@ -212,11 +2123,10 @@ main(int argc, char **argv)
 				/* LINTED idem */
 				if (i == MAX(argc, 1) - 1)
 					usage();
+				if (width != 0)
+					errx(1, "-b and -e cannot be combined");
 				re_str = argv[++i];
-				if (re != NULL && pcre_refcount(re, 0) == 0) {
-					pcre_free(re);
-					pcre_free(re_extra);
-				}
+				/* The old re, if any, is owned by the rec_* functions */
 				re = NULL;
 				break;
 			case 'o':
@@ -236,147 +2146,176 @@ main(int argc, char **argv)
 
 		if (re == NULL) {
 			/*
-			 * Reference-counted and freed by the rec_* functions.
+			 * Freed by the rec_* functions.
+			 */
+			/* XXX Do we need to call pcre2_maketables()? */
+			if ((re = pcre2_compile((PCRE2_SPTR) re_str, PCRE2_ZERO_TERMINATED, PCRE2_DOTALL | PCRE2_MULTILINE, &error_code, &error_offset, NULL)) == NULL) {
+				pcre2_get_error_message(error_code, re_errstr, sizeof(re_errstr));
+				errx(1, "Failed to parse regular expression %s: %s at %zu", re_str, (char *) re_errstr, error_offset);
+			}
+			/*
+			 * Literals don't need re at all; for everything else,
+			 * try to JIT-compile re (if this fails, the interpreter
+			 * is used instead), also for the partial matching done
+			 * by rec_next().
 			 */
-			/* XXX Do we need to call maketables()? */
-			if ((re = pcre_compile(re_str, PCRE_DOTALL | PCRE_EXTRA | PCRE_MULTILINE, &errstr, &error_offset, NULL)) == NULL)
-				errx(1, "Failed to parse regular expression %s: %s at %d", re_str, errstr, error_offset);
-			re_extra = pcre_study(re, 0, &errstr);
-			if (errstr != NULL)
-				errx(1, "Failed to study regular expression %s: %s", re_str, errstr);
+			if ((literal_len = regex_literal(re_str, literal)) == 0)
+				pcre2_jit_compile(re, PCRE2_JIT_COMPLETE | PCRE2_JIT_PARTIAL_HARD);
 		}
 
-		/* Open file */
-		if (argc == 0 || strcmp(argv[i], "-") == 0)
-			fd = 0;
-		else
-			if ((fd = open(argv[i], O_RDONLY, 0644)) == -1)
-				err(1, "Failed to open %s", argv[i]);
-
-		if ((rfd = rec_open(fd, re, re_extra, delim, &memory_cache)) == -1)
-			err(1, "Failed to rec_open %s", strcmp(argv[i], "-") == 0 ? "stdin" : argv[i]);
-
-		/*
-		 * The loop below is a Knuth/Fisher-Yates shuffle, i.e.
-		 *
-		 *	while (!eof) {
-		 *		r = random_uniform(rec_no + 1);
-		 *		rec[rec_no] = rec[r];
-		 *		rec[r] = rec_next();
-		 *		rec_no++;
-		 *	}
-		 *
-		 * but we never store more than nrecords records.
-		 *
-		 * Loop invariant: rec[0] to rec[MIN(rec_no, nrecords)] is a
-		 * uniformly random selection of distinct records.
-		 */
-		while (1) {
-			if (MIN(rec_no + 1, nrecords) > rec_size) {
-				if (rec_size > MIN(UINT32_MAX / 2, SIZE_MAX / 2 / sizeof(*rec)))
-					err(1, "Too many records");
-				if ((tmp = realloc(rec, 2 * rec_size * sizeof(*rec))) == NULL)
-					err(1, "Failed to allocate memory for more records");
-
-				rec = tmp;
-				rec_size *= 2;
-			}
+		if (argc == 0 || strcmp(argv[i], "-") == 0) {
+			op[nops].name = "stdin";
+			op[nops].path = NULL;
+			nstdin++;
+		} else
+			op[nops].name = op[nops].path = argv[i];
+		op[nops].re_str = re_str;
+		op[nops].re = re;
+		memcpy(op[nops].literal, literal, literal_len);
+		op[nops].literal_len = literal_len;
+		op[nops].delim = delim;
+		nops++;
+	}
 
-			r = random_uniform(rec_no + 1);
-			if (r < MIN(rec_no, nrecords)) {
-				/* Overwriting valid data */
-				if (rec_no < nrecords)
-					rec[rec_no] = rec[r];
-				else {
-					assert(to_free_valid == 0);
-					to_free = rec[r];
-#ifndef NDEBUG
-					to_free_valid = 1;
+	/*
+	 * Read several operands at once, if possible. The order of the buckets
+	 * determines the output of -x for a given seed, so -x reads them one
+	 * after the other; so must several operands on stdin. Several samples
+	 * are read together, one operand at a time, and -u needs a single set
+	 * of the records read so far.
+	 */
+	parallel = 0;
+#ifdef HAVE_PTHREAD
+	parallel = !external && !sampling && !dedup && window == 0 && threads > 1 && nops > 1 && nstdin <= 1;
 #endif
-				}
-			}
+	/* Use the threads that are not busy reading operands to split up files */
+	/* LINTED threads is between 1 and INT_MAX, nops is positive */
+	rec_set_threads(parallel ? MAX(1, threads / MIN((size_t) threads, nops)) : MIN(threads, INT_MAX));
 
-try_again:
-#ifdef HAVE_SIGINFO
-			if (got_siginfo) {
-				got_siginfo = 0;
-				fprintf(stderr, "Reading %s: read %" PRIuFAST32 " records (in total)\n",
-				    argc == 0 || strcmp(argv[i], "-") == 0 ? "stdin" : argv[i],
-				    rec_no);
-				fflush(stderr);
-			}
-#endif
-			if (rec_next(rfd, r < nrecords ? &rec[r] : NULL) != 0) {
-				if (errno == EAGAIN || errno == EINTR)
-					goto try_again;
-				else if (errno == 0) {
-					if (r < MIN(rec_no, nrecords) && rec_no >= nrecords) {
-						/*
-						 * We don't want to free
-						 * to_free = rec[r] after
-						 * all...
-						 */
-						assert(to_free_valid == 1);
-#ifndef NDEBUG
-						to_free_valid = 0;
-#endif
-					}
-					break;
-				} else
-					errx(1, "Failed to read from %s: %s%s",
-					    argc == 0 || strcmp(argv[i], "-") == 0 ? "stdin" : argv[i],
-					    strerror(errno),
-					    errno == EINVAL ? ", error in regular expression or zero-length match" : "");
-			}
+	for (i = 0; i < nops; i++) {
+		/* Open file */
+		if (op[i].path == NULL)
+			fd = 0;
+		else
+			if ((fd = open(op[i].path, O_RDONLY, 0644)) == -1)
+				err(1, "Failed to open %s", op[i].path);
 
-			if (r < MIN(rec_no, nrecords) && rec_no >= nrecords) {
-				assert(to_free_valid == 1);
-				rec_free(&to_free);
-#ifndef NDEBUG
-				to_free_valid = 0;
-#endif
-			}
+		if ((op[i].rfd = rec_open(ctx, fd, op[i].re, op[i].literal, op[i].literal_len, op[i].delim, &memory_cache)) == -1)
+			err(1, "Failed to rec_open %s", op[i].name);
+		if (window != 0)
+			rec_stream(op[i].rfd);
+		if (width != 0 && rec_fixed(op[i].rfd, width) == -1)
+			err(1, "Cannot use records of %zu bytes", width);
 
-			if (++rec_no == UINT32_MAX - 1)
-				errx(1, "Too many records");
+		/* Not being able to use the index only makes things slower */
+		if (use_index && width == 0 && op[i].path != NULL) {
+			if (asprintf(&index_path, "%s" INDEX_SUFFIX, op[i].path) == -1)
+				err(1, "Failed to allocate memory");
+			if (rec_index_open(op[i].rfd, index_path, op[i].re_str) == -1)
+				warn("Cannot use index %s", index_path);
+			free(index_path);
 		}
 	}
-	assert(to_free_valid == 0);
 
-	/* Write out data */
-	for (i = 0; i < MIN(rec_no, nrecords); i++) {
-try_again2:
-#ifdef HAVE_SIGINFO
-		if (got_siginfo) {
-			got_siginfo = 0;
-			fprintf(stderr, "Writing record %u/%" PRIuFAST32 "\n",
-			    i + 1,
-			    MIN(rec_no, nrecords));
-		}
+	/*
+	 * Read all records into sample (or, for --sample, into one sample per
+	 * output), to be shuffle()d afterwards
+	 */
+	nsamples = sampling ? noutputs : 1;
+	if ((sample = calloc(nsamples, sizeof(*sample))) == NULL)
+		err(1, "Failed to allocate memory for samples");
+	for (j = 0; j < nsamples; j++)
+		sample_init(&sample[j], sampling ? output[j].weight : window != 0 ? window : nrecords);
+	all = NULL;
+	if (external) {
+		buckets_open(&buckets);
+		/* For more permutations, the buckets are filled again from all */
+		if (epochs > 1 && (buckets.all = all = rec_tmpfile()) == NULL)
+			err(1, "Failed to create temporary file");
+	}
+	streamed = 0;
+	if (window != 0) {
+		/* Write out records while reading, see window_read() */
+		if ((batch = calloc(write_batch, sizeof(*batch))) == NULL)
+			err(1, "Failed to allocate memory for records");
+		output_set(output, noutputs, UINT64_MAX);
+		for (i = 0; i < nops; i++)
+			window_read(sample, &op[i], batch, window, &streamed);
+		free(batch);
+	}
+#ifdef HAVE_PTHREAD
+	else if (parallel)
+		ingest_run(sample, op, nops, threads);
 #endif
-
-		if ((errstr = rec_write(&rec[i], NULL, stdout)) != NULL) {
-			if (errno == EAGAIN || errno == EINTR)
-				goto try_again2;
+	else
+		for (i = 0; i < nops; i++)
+			if (nsamples > 1)
+				samples_read(sample, nsamples, &op[i]);
 			else
-				errx(1, "%s", errstr);
-		}
+				sample_read(sample, ctx, &op[i], NULL, external ? &buckets : NULL);
+	for (i = 0; use_index && i < nops; i++)
+		if (rec_index_save(op[i].rfd) == -1)
+			warn("Failed to save index for %s", op[i].name);
+	/* The records that were kept are in sample; give the memory back */
+	rec_unique_free(unique);
+	unique = NULL;
+
+	/*
+	 * Shuffle and write out the records of each sample, epochs times; only
+	 * the last permutation frees them.
+	 */
+	for (j = 0; j < nsamples; j++) {
+		len = MIN(sample[j].n, sample[j].k);
+		total = len > 0 && epochs > UINT64_MAX / len ? UINT64_MAX : len * epochs;
+		if (sampling)
+			output_set(&output[j], 1, len);
+		else if (window == 0)
+			output_set(output, noutputs, len);
+		/* With -w, the records streamed out come first */
+		r = streamed;
+		total += streamed;
+		for (epoch = 0; epoch < epochs; epoch++) {
+			stats_phase(PHASE_SHUFFLE);
+			if (external) {
+				if (epoch > 0)
+					buckets_reload(&buckets, all);
+				buckets_shuffle(&buckets, &memory_cache, &r, total);
+				continue;
+			}
 
-		rec_free(&rec[i]);
+			/* LINTED converting threads to int works */
+			shuffle(sample[j].rec, len, MIN(threads, INT_MAX));
+			stats_phase(PHASE_OUTPUT);
+			write_recs(sample[j].rec, len, &r, total, epoch < epochs - 1);
+		}
+		assert(r == total || total == UINT64_MAX);
 	}
+	if (all != NULL && fclose(all) != 0)
+		err(1, "Failed to close temporary file");
+	for (j = 0; j < noutputs; j++)
+		if (output[j].file != stdout && fclose(output[j].file) != 0)
+			err(1, "Failed to write %s", output[j].path);
+	stats_done();
 
 #ifndef NDEBUG
-	/*
-	 * Deallocate all rfds. Note that these are guaranteed to start at the
-	 * lowest descriptor.
-	 */
-	/* LINTED argc is nonnegative, so this works */
-	for (i = 0; i <= rfd; i++) {
-		/* LINTED converting i to signed int works */
-		while ((rv = rec_close(i)) != 0 && (errno == EINTR || errno == EAGAIN));
+	/* Deallocate all rfds */
+	for (i = 0; i < nops; i++) {
+		while ((rv = rec_close(ctx, op[i].rfd)) != 0 && (errno == EINTR || errno == EAGAIN));
 		if (rv != 0)
-			err(1, "Failed to rec_close %s", argc == 0 ? "stdin" : argv[i]);
+			err(1, "Failed to rec_close %s", op[i].name);
+	}
+	for (j = 0; j < nsamples; j++)
+		free(sample[j].rec);
+	free(sample);
+	for (j = 0; j < noutputs; j++) {
+#ifdef HAVE_PTHREAD
+		rec_ctx_free(output[j].ctx);
+#endif
+		free(output[j].path);
 	}
+	free(output);
+	free(op);
+	rec_ctx_free(ctx);
 
 	assert(memory_cache == memory_cache_initial);
 	rec_assert_released();
@@ -15,19 +15,40 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
 #include <sys/stat.h>
 
 #include <assert.h>
 #include <ctype.h>
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <pcre.h>
+#define PCRE2_CODE_UNIT_WIDTH 8
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#include <pcre2.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include "compat.h"
 #include "record.h" /* vis.h */
@@ -36,15 +57,298 @@
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #endif
 #ifndef MAX
-#define MAX(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
+#ifdef HAVE_PTHREAD
+/*
+ * Parallel splitting of mapped files with a literal delimiter.
+ *
+ * The file is divided into chunks of REC_SPLIT_CHUNK bytes, and worker threads
+ * find all occurrences of the literal that start in a chunk (looking past the
+ * end of the chunk to complete the last one); rec_next() then hands out the
+ * records in order. If two occurrences of the literal cannot overlap, this
+ * finds exactly the same records as rec_exec() would, regardless of where the
+ * chunk boundaries are.
+ *
+ * The worker threads only use struct rec_split, never f[], which may be
+ * moved by rec_open(). They stay less than nslots chunks ahead of
+ * rec_next(), which bounds memory use.
+ */
+#define REC_SPLIT_CHUNK (4 * 1024 * 1024)
+/* Number of chunks per thread that may be split ahead of rec_next() */
+#define REC_SPLIT_AHEAD 4
+struct rec_split {
+	pthread_mutex_t	 mutex;
+	pthread_cond_t	 cond;		/* Signals changes to the below */
+	pthread_t	*thread;
+	int		 nthreads;
+	int		 stop;		/* Set by rec_close() */
+	/* Copied from f[], see above */
+	const char	*p;
+	off_t		 size;
+	char		 literal[REC_LITERAL_MAX];
+	int		 literal_len;
+	/*
+	 * Chunk i is stored in slot[i % nslots]. Workers claim chunks in
+	 * order, i.e. claimed is the next chunk to be split, and rec_next()
+	 * uses chunk consumed; both are protected by mutex.
+	 */
+	size_t		 nchunks, claimed, consumed;
+	struct rec_split_chunk {
+		uint32_t	*end;	/* Offset of the end of each match,
+					 * relative to the chunk */
+		/* end[0] to end[n] is valid, end[size] is allocated */
+		size_t		 n, size;
+		int		 done;	/* Protected by mutex */
+		int		 error;	/* errno if splitting failed */
+	}		*slot;
+	size_t		 nslots;
+	/* Used by rec_next() only */
+	size_t		 pos;		/* Next match in chunk consumed */
+	int		 ready;		/* Is chunk consumed done? */
+};
+
+/* Maximum number of threads used for splitting; see rec_set_threads() */
+static int	 split_threads = 1;
+
+#endif
+
+/*
+ * Writing to the temporary file.
+ *
+ * rec_flush() copies data into buf[fill]; once that is full, it is written out
+ * by rec_spool_write() and rec_flush() continues with the other buffer. If
+ * threaded is set, this is done by a writer thread, so parsing only waits for
+ * the disk if the disk cannot keep up. Either way, all writes (except the very
+ * last one) are of REC_SPOOL_BLOCK bytes.
+ *
+ * If z is not NULL, the data is compressed; see struct rec_z.
+ *
+ * rec_spool_write() reports what it did in a struct rec_spool_stats, which is
+ * added to s->stats (under mutex, if threaded) for rec_get_stats().
+ */
+#define REC_SPOOL_BLOCK (1024 * 1024)
+struct rec_spool_stats {
+	uint64_t	 bytes;
+	double		 wall, cpu, wait;
+};
+struct rec_spool {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	 mutex;
+	pthread_cond_t	 cond;		/* Signals changes to the below */
+	pthread_t	 thread;
+	int		 threaded;
+#endif
+	int		 fd;		/* Copied from f[].tmp */
+	char		*buf[2];
+	size_t		 len[2];
+	int		 fill;		/* Buffer used by rec_flush() */
+	int		 busy;		/* Is buf[!fill] being written? */
+	int		 stop;		/* Set by rec_spool_finish() */
+	int		 error;		/* errno if a write failed */
+	struct rec_z	*z;		/* Copied from f[].z */
+	struct rec_spool_stats stats;
+	const struct rec_ctx *ctx;	/* Whose stats these are */
+};
+
+/*
+ * A compressed temporary file (see rec_set_compress()) is a sequence of
+ * blocks, each compressed on its own and holding REC_Z_BLOCK bytes of data
+ * (except for the last one). Records are still addressed by their offset in
+ * the uncompressed data, so a record at offset starts at offset % REC_Z_BLOCK
+ * in block offset / REC_Z_BLOCK. Blocks that do not compress are stored as is,
+ * which is recognizable since they are not any shorter.
+ *
+ * Blocks are small since records are read back in random order, and each
+ * read costs decompressing a block; 8k of text typically compresses to less
+ * than a page. Recently read blocks are kept, decompressed, in cache; see
+ * rec_z_block(). Only the writer touches block, nblocks, len and zbuf while
+ * the temporary file is being written.
+ */
+#define REC_Z_BLOCK (8 * 1024)
+#define REC_Z_CACHE 64
+struct rec_z {
+	off_t		*block;		/* Block i is block[i] to block[i + 1] */
+	size_t		 nblocks, block_size;
+	off_t		 len;		/* Uncompressed size of all blocks */
+	char		*zbuf;		/* REC_Z_BLOCK bytes, for compressing */
+	char		*rbuf;		/* Idem, for reading */
+	char		*cache;		/* REC_Z_CACHE blocks */
+	size_t		 cache_block[REC_Z_CACHE];
+};
+
+/*
+ * Reading compressed input (see rec_set_decompress()). If f[].decode is not
+ * NULL, fd holds gzip or zstd data and rec_read() returns the decompressed
+ * data instead; since that cannot be seek()ed, it is handled like a pipe.
+ * Several gzip members or zstd frames in a row are simply concatenated, as by
+ * gzip -d and zstd -d. end is set at the end of a member or frame, where the
+ * input may stop.
+ *
+ * If threaded is set, a decoder thread decompresses into buf[0] and buf[1] in
+ * turn, so parsing only waits for it if decompression cannot keep up. Once
+ * ready[b] is set, buf[b] holds len[b] bytes for rec_read(), which has used
+ * the first pos bytes of buf[cur]; an empty buffer marks the end of the data,
+ * or a failure if error is set. Otherwise, rec_read() decompresses straight
+ * into the buffer it is given.
+ */
+#define REC_DECODE_BLOCK (256 * 1024)
+#define REC_DECODE_GZIP 1
+#define REC_DECODE_ZSTD 2
+struct rec_decode {
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t	 mutex;
+	pthread_cond_t	 cond;		/* Signals changes to ready and stop */
+	pthread_t	 thread;
+	int		 threaded;
+	int		 stop;		/* Set by rec_decode_free() */
+	char		*buf[2];
+	size_t		 len[2], pos;
+	int		 ready[2], cur;
+	int		 error;		/* errno if decompressing failed */
 #endif
+	int		 fd;		/* Copied from f[].fd */
+	int		 type;		/* REC_DECODE_GZIP or REC_DECODE_ZSTD */
+	char		*in;		/* REC_DECODE_BLOCK bytes of input */
+	size_t		 in_first, in_last;
+	int		 in_eof, end;
+#ifdef HAVE_ZLIB
+	z_stream	 zs;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_DStream	*zd;
+#endif
+};
+
+/*
+ * A record index (see rec_index_open()) is a file holding a struct
+ * rec_index_header, the key_len bytes of the key padded with zeroes to a
+ * multiple of 8 bytes, and one uint64_t for every record. This holds the
+ * offset in the file of the end of the record in the low REC_INDEX_END_BITS
+ * bits, the length of the delimiter (as in struct rec) above that, and
+ * REC_INDEX_LAST if the record was marked REC_LAST; since records are
+ * contiguous, each starts where the previous one ends. Everything is in host
+ * byte order, so an index written on a different platform does not match
+ * REC_INDEX_MAGIC.
+ *
+ * If end is not NULL, a valid index was found, end points into a read-only
+ * mapping of it, and rec_next() simply hands out the records in there.
+ * Otherwise, rec_next() adds every record to file, which rec_index_save()
+ * renames to path.
+ */
+#define REC_INDEX_MAGIC UINT64_C(0x31786469646e6172)	/* "randidx1" */
+#define REC_INDEX_END_BITS 56
+#define REC_INDEX_END_MAX ((UINT64_C(1) << REC_INDEX_END_BITS) - 1)
+#define REC_INDEX_LAST (UINT64_C(1) << 63)
+struct rec_index_header {
+	uint64_t	 magic;
+	/* The file that was indexed */
+	uint64_t	 size, mtime_sec, mtime_nsec, ino, dev;
+	uint64_t	 key_len;
+	uint64_t	 nrecords;
+};
+struct rec_index {
+	struct rec_index_header hdr;
+	/* Reading */
+	const uint64_t	*end;
+	uint64_t	 next;		/* Next record handed out */
+	void		*map;
+	size_t		 map_len;
+	/* Writing */
+	FILE		*file;
+	char		*path, *tmp_path;
+	int		 error;		/* errno if writing failed */
+};
+
+/*
+ * A set of records, for rec_unique_add(). Copies of the records are kept in
+ * the order they were added, REC_UNIQUE_CHUNK to a chunk, and found through a
+ * hash table. That is split into REC_UNIQUE_PARTS parts by the top bits of
+ * the hash (see rec_hash()) of the record's key (see rec_unique_key()); each
+ * part is an open-addressing table with linear probing, of size slots (a power
+ * of 2, or 0 until the first record goes in), at most 3/4 of which are in use.
+ * A slot holds the low 32 bits of the hash above the index of the record plus
+ * 1, or 0 if it is empty; so n is below UINT32_MAX. Parts grow one at a time,
+ * so growing never takes much more memory than the table already does.
+ *
+ * In the copies, the length is that of the key, and the delimiter length is
+ * 0. Records that are not in memory are kept as they are. The keys of records
+ * in memory are copied into blocks, a list of which starts at block. Once
+ * those no longer fit, keys are appended to the temporary file spill instead,
+ * through wbuf; REC_UNIQUE_SPILLED is then set in the copy, whose offset is the
+ * key's offset in spill. The first spill_flushed bytes of spill have been
+ * written, the rest are in wbuf.
+ *
+ * The parts, chunks and blocks are charged to *memory_cache; the list of
+ * chunks, being much smaller, is not. The table and the chunks take
+ * precedence: if they do not fit, all blocks are spilled to make room, and if
+ * they still do not fit, they are mapped from the temporary file map instead,
+ * of which map_len bytes have been handed out; see rec_unique_alloc().
+ *
+ * buf holds the data of the record being added, if rec_data() put it in
+ * ctx->w_buf; cmp holds a key read back from spill.
+ */
+#define REC_UNIQUE_PART_BITS 8
+#define REC_UNIQUE_PARTS (1 << REC_UNIQUE_PART_BITS)
+/* Initial number of slots of a part */
+#define REC_UNIQUE_MIN 64
+/* Number of records in a chunk */
+#define REC_UNIQUE_CHUNK 4096
+/* Size of a block, and of wbuf */
+#define REC_UNIQUE_BLOCK (64 * 1024)
+/* The copies have no use for REC_LAST */
+#define REC_UNIQUE_SPILLED REC_LAST
+#define REC_UNIQUE_REC(u, i) (&(u)->chunk[(i) / REC_UNIQUE_CHUNK].rec[(i) % REC_UNIQUE_CHUNK])
+struct rec_unique_part {
+	uint64_t	*slot;
+	size_t		 size, used;
+	int		 mapped;	/* Set if slot is in map */
+};
+struct rec_unique_chunk {
+	struct rec	*rec;
+	int		 mapped;	/* Idem */
+};
+struct rec_unique_block {
+	struct rec_unique_block *next;
+	size_t		 used, size;
+	char		 data[];
+};
+struct rec_unique {
+	struct rec_unique_part part[REC_UNIQUE_PARTS];
+	struct rec_unique_chunk *chunk;
+	size_t		 nchunks, chunks_size;
+	uint64_t	 n;
+	size_t		*memory_cache;
+	struct rec_unique_block *block;
+	int		 spill, map;
+	off_t		 spill_flushed, map_len;
+	char		*wbuf;
+	size_t		 wbuf_len;
+	char		*buf, *cmp;
+	size_t		 buf_size, cmp_size;
+};
 
 static struct {
 	off_t		 offset;	/* Current offset into tmp. If this is
 					 * -1, the struct is unused. */
-	pcre		*re;		/* The regex for this file */
-	pcre_extra	*re_extra;
-	const char	*default_delim;
+	pcre2_code	*re;		/* The regex for this file */
+	int		 jit;		/* Is re JIT-compiled? */
+	/*
+	 * If literal_len is not 0, re matches exactly the literal_len bytes
+	 * in literal, and rec_exec() uses memchr()/memmem() instead of re.
+	 */
+	char		 literal[REC_LITERAL_MAX];
+	int		 literal_len;
+	/*
+	 * If fixed is not 0, records are fixed bytes long instead (see
+	 * rec_fixed()); if fixed_direct is also set, this is a regular file of
+	 * st_size bytes, and rec_fixed_next() does not even read it.
+	 */
+	size_t		 fixed;
+	int		 fixed_direct;
+	uint32_t	 ovector_count;	/* Needed for re, see rec_ctx_match() */
+	struct rec_tmpl	*default_tmpl;	/* Compiled default_delim */
 	size_t		*memory_cache;	/* How much more memory can we use? */
 	/*
 	 * At any moment, for any i between 0 and f_last,
@@ -61,88 +365,414 @@ static struct {
 	 *
 	 * Note that buf_p may be NULL, e.g. after rec_fadvise(f[i].
 	 * REC_FADV_DONTNEED).
+	 *
+	 * If map_p is not NULL, buf_p is not allocated but points into a
+	 * read-only mapping of the file (see below), and
+	 * f[i].buf_p[f[i].buf_size] is the end of the mapped data that is
+	 * currently visible.
 	 */
 	char		*buf_p;
-	/* Limited to int instead of size_t by pcre_exec() */
-	int		 buf_first_write, buf_first_read, buf_last, buf_size;
+	/*
+	 * For regular files, map_p[0] to map_p[map_len] is a mapping of the
+	 * bytes starting at map_offset in fd, and buf_offset is the offset in
+	 * fd of buf_p[0]. If the whole file fits in the address space, it is
+	 * mapped at once; otherwise, rec_map() slides a smaller mapping over
+	 * the file. map_p is NULL if the file is not mapped at all.
+	 *
+	 * XXX We get SIGBUS if someone truncates the file under us.
+	 *
+	 * If map_free is not 0, map_p is not a mapping but a malloc()ed buffer
+	 * of map_free bytes holding all of the input (see rec_slurp()), which
+	 * is charged to memory_cache.
+	 */
+	char		*map_p;
+	size_t		 map_len, map_free;
+	/*
+	 * Should rec_prefetch() bother with records in the mapping? Not if
+	 * the file is small enough to have stayed in the page cache since
+	 * rec_next() read it, which it does not with a valid index or
+	 * fixed-width records.
+	 */
+	int		 map_prefetch;
+	off_t		 map_offset, buf_offset, st_size;
+	size_t		 buf_first_write, buf_first_read, buf_last, buf_size;
+	/*
+	 * No delimiter starts in the first buf_scan bytes of unprocessed data,
+	 * so rec_next() need not search those again after reading more data.
+	 */
+	size_t		 buf_scan;
 	/*
 	 * fd is the file descriptor passed to rec_open() and tmp is either
 	 * equal to fd (if fd is seekable) or a file descriptor pointing to a
-	 * temporary file.
+	 * temporary file; the temporary file is only created when needed, and
+	 * tmp is -1 until then.
+	 *
+	 * If slurp is set, rec_next() first tries to read all of fd into
+	 * memory. If stream is set, it never writes to tmp; see rec_stream().
+	 */
+	int		 fd, tmp, slurp, stream;
+#ifdef HAVE_PTHREAD
+	/*
+	 * If split is not NULL, the records are found by worker threads
+	 * instead, and buf_p and friends are not used.
 	 */
-	int		 fd, tmp;
+	struct rec_split *split;
+#endif
+	/*
+	 * If spool is not NULL, data is written to tmp through it; see
+	 * rec_flush(). If z is not NULL, tmp is compressed.
+	 */
+	struct rec_spool *spool;
+	struct rec_z	*z;
+	/* If decode is not NULL, see struct rec_decode */
+	struct rec_decode *decode;
+	/* If index is not NULL, see struct rec_index */
+	struct rec_index *index;
 }		*f = NULL;
 static int	 f_size = 0, f_last = 0;
 
 /*
  * Using struct rec.
  *
- * Note: if rec->internal_only.len <= 0, loc.p should be used; otherwise, use
- * loc.offset.
- *
- * Note: if rec->internal_only.f_idx < 0, this record is the last record in the
- * file; the actual f_idx is -rec->internal_only.f_idx if this is positive, or
- * 0 for INT_MIN. Note that the converse may not be true, i.e. the last record
- * in the file may not be last as determined by REC_IS_LAST(). This does not
- * cause problems for the current code, as it's used only to determine whether
- * or not to pass PCRE_NOTEOL to pcre_exec().
+ * internal_only.info packs, from the least significant bit up,
+ * - the length of the record (REC_LEN_BITS bits);
+ * - the length of the match (i.e. the delimiter) at the end of the record
+ *   (REC_DELIM_BITS bits), which is 0 if the record is unterminated, or
+ *   REC_DELIM_UNKNOWN if it is too long to store;
+ * - REC_MEM, which is set if loc.p should be used instead of loc.offset;
+ * - REC_LAST, which is set if this is the last record in the file. Note that
+ *   the converse may not be true, i.e. the last record in the file may not be
+ *   last as determined by REC_IS_LAST(). This does not cause problems for the
+ *   current code, as it's used only to determine whether or not to pass
+ *   PCRE2_NOTEOL to pcre2_match();
+ * - the rfd (the remaining REC_F_BITS bits).
  *
  * XXX Is there any regex that can abuse this?
  */
-#define REC_IS_OFFSET(rec) ((rec)->internal_only.len > 0)
-#define REC_IS_LAST(rec) ((rec)->internal_only.f_idx < 0)
-#define REC_LEN(rec) abs((rec)->internal_only.len)
+#define REC_LEN_BITS 40
+#define REC_DELIM_BITS 6
+#define REC_F_BITS 16
+#define REC_LEN_MAX ((UINT64_C(1) << REC_LEN_BITS) - 1)
+#define REC_DELIM_UNKNOWN ((1 << REC_DELIM_BITS) - 1)
 /*
- * Estimated memory use, i.e. memory we actually use plus malloc overhead. Note
- * that this cannot overflow since REC_LEN(rec) <= INT_MAX.
+ * Unprocessed data in f[].buf_p is not allowed to grow beyond this, so that
+ * every record fits and doubling a buffer cannot overflow.
  */
+#define REC_BUF_MAX MIN(REC_LEN_MAX, SIZE_MAX / 4)
+#define REC_MEM (UINT64_C(1) << (REC_LEN_BITS + REC_DELIM_BITS))
+#define REC_LAST (REC_MEM << 1)
+/* Maximum number of rfds */
+#define REC_F_MAX (1 << REC_F_BITS)
+#define REC_INFO(len, delim_len, rfd) \
+	((uint64_t) (len) | \
+	 (uint64_t) MIN((delim_len), REC_DELIM_UNKNOWN) << REC_LEN_BITS | \
+	 (uint64_t) (rfd) << (64 - REC_F_BITS))
+/*
+ * Every record is in a buffer at some point, so REC_LEN(rec) fits in a
+ * size_t.
+ */
+#define REC_IS_OFFSET(rec) (((rec)->internal_only.info & REC_MEM) == 0)
+#define REC_IS_LAST(rec) (((rec)->internal_only.info & REC_LAST) != 0)
+#define REC_LEN(rec) ((size_t) ((rec)->internal_only.info & REC_LEN_MAX))
+#define REC_DELIM_LEN(rec) ((int) ((rec)->internal_only.info >> REC_LEN_BITS) & REC_DELIM_UNKNOWN)
+/*
+ * In-memory records of at most REC_ARENA_MAX bytes are allocated from chunks
+ * of REC_ARENA_CHUNK bytes (see rec_alloc()).
+ *
+ * Estimated memory use of larger records, i.e. memory we actually use plus
+ * malloc overhead. Note that this cannot overflow since the record was
+ * allocated.
+ */
+#define REC_IS_ARENA(rec) (REC_LEN(rec) <= REC_ARENA_MAX)
 #define REC_ESTIMATED_MEMORY_USE(rec) (REC_LEN(rec) + 2 * sizeof(void *) + 2 * sizeof(size_t))
 #define REC_OFFSET(rec) (assert(REC_IS_OFFSET(rec)), (rec)->internal_only.loc.offset)
 #define REC_P(rec) (assert(!REC_IS_OFFSET(rec)), (rec)->internal_only.loc.p)
-#define REC_F(rec) f[(rec)->internal_only.f_idx == INT_MIN ? 0 : abs((rec)->internal_only.f_idx)]
+#define REC_F_IDX(rec) ((int) ((rec)->internal_only.info >> (64 - REC_F_BITS)))
+#define REC_F(rec) f[REC_F_IDX(rec)]
+
+
+/*
+ * rec_next() never reads less than this into buf_p if it can help it; small
+ * reads from a pipe are quite expensive. Larger records make buf_p grow
+ * geometrically, up to REC_BUF_MAX, so reads grow with them.
+ */
+#define REC_READ_MIN (64 * 1024)
+
+/*
+ * Output templates (the delim argument to rec_write()), compiled by
+ * rec_tmpl_compile() into a list of ops, each of which outputs either the
+ * len bytes starting at lit[off] or, if ref is not -1, the text matched by
+ * subpattern ref (0 for the whole match). Every distinct template is compiled
+ * only once per context, and kept in its tmpl_cache until rec_ctx_free(); the
+ * default_delim of an rfd is compiled by rec_open(), and kept until
+ * rec_close().
+ */
+struct rec_tmpl {
+	struct rec_tmpl	*next;
+	char		*delim;		/* The source */
+	char		*lit;
+	struct rec_op {
+		int		 ref;
+		size_t		 off, len;
+	}		*op;
+	size_t		 nops;
+	int		 refs;		/* Is any subpattern (\1 to \9) used? */
+	char		 error[128];	/* If not empty, delim is invalid */
+};
+
+/* How many records rec_write_batch() looks ahead; see rec_prefetch() */
+#define REC_PREFETCH 64
+
+/*
+ * Output is collected in a small buffer first, so that writing a short record
+ * takes a single fwrite(), which is much more expensive than memcpy() for a
+ * few bytes. See rec_out().
+ */
+#define REC_OUT_BUF 1024
+struct rec_out {
+	size_t		 len;
+	char		 buf[REC_OUT_BUF];
+};
+
+/*
+ * What is charged to any memory_cache, for rec_get_stats().
+ */
+static size_t	 memory_used = 0, memory_peak = 0;
+
+#ifdef HAVE_PTHREAD
+/*
+ * Protects every *memory_cache, memory_used and memory_peak (see rec_charge()),
+ * and changes to f[].spool (see rec_get_stats()), since threads with contexts
+ * of their own may share those.
+ */
+static pthread_mutex_t	 rec_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#ifdef HAVE_MEMFD_CREATE
+/* Are temporary files created by memfd_create()? See rec_set_memfd() */
+static int	 tmp_memfd = 0;
+#endif
+/* Are temporary files compressed? See rec_set_compress() */
+static int	 tmp_compress = 0;
+/* Is compressed input decompressed? See rec_set_decompress() */
+static int	 decompress_input = 0;
+
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+/*
+ * Records of at least REC_COPY_MIN bytes that are not in memory are copied to
+ * the output by the kernel, if possible; see rec_write_copy() and the copy_fd
+ * member of struct rec_ctx.
+ */
+#define REC_COPY_MIN (16 * 1024)
+enum rec_copy_method {
+	REC_COPY_FILE_RANGE,
+	REC_COPY_SENDFILE,
+	REC_COPY_NONE
+};
+#endif
+
+/*
+ * Arena for small in-memory records.
+ *
+ * Each chunk is REC_ARENA_CHUNK bytes, aligned to REC_ARENA_CHUNK bytes so that
+ * rec_free() can find the chunk header from a record pointer. Records are
+ * allocated from the arena of a context by bumping its arena_used. A chunk is
+ * charged to memory_cache as a whole and freed (and refunded) when the last
+ * record in it is freed, except that the current chunk of a context is kept
+ * until it is full (and started over if all of its records have been freed by
+ * then) or until rec_ctx_free().
+ *
+ * Note that evicting records, as with randomize -n, may leave chunks
+ * partially unused; this is harmless, as these are still charged to
+ * memory_cache.
+ */
+#define REC_ARENA_CHUNK (64 * 1024)
+#define REC_ARENA_MAX (REC_ARENA_CHUNK / 4)
+struct rec_chunk {
+	size_t		*memory_cache;	/* What this chunk is charged to */
+	size_t		 live;		/* Number of records in this chunk */
+	struct rec_ctx	*ctx;		/* Whose arena this is, or NULL */
+};
 
 /*
- * Some helper variables, automatically deallocated when all rfd's are closed.
+ * A context holds everything that the rec_* functions need besides f[], so
+ * that each thread can use its own; see rec_ctx_new().
  *
- * ovector* is used by pcre_exec(), and rec_open() makes sure it's long enough.
- * buf is used by rec_write(), which handles allocation/resizing.
+ * match_data and match_context are used by pcre2_match(), and
+ * rec_ctx_match() makes sure match_data is large enough for an rfd; ovector
+ * points into match_data. w_buf is used by rec_data(), which handles
+ * allocation/resizing. errstr holds the error messages returned by
+ * rec_write() and the like.
+ */
+struct rec_ctx {
+	pcre2_match_data *match_data;
+	pcre2_match_context *match_context;
+	PCRE2_SIZE	*ovector;
+	uint32_t	 ovector_count;
+	char		*w_buf;
+	size_t		 w_buf_size;
+	char		 errstr[128];
+	struct rec_tmpl	*tmpl_cache;
+	/* Arena, see above */
+	struct rec_chunk *arena;
+	size_t		 arena_used;
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+	/*
+	 * copy_method is the first method that may work for output file
+	 * descriptor copy_fd; see rec_copy().
+	 */
+	int		 copy_fd;
+	enum rec_copy_method copy_method;
+#endif
+	/*
+	 * See rec_get_stats(), except for memory_used and memory_peak. What
+	 * the writer threads do is kept in struct rec_spool until
+	 * rec_spool_finish() adds it in.
+	 */
+	struct rec_stats stats;
+};
+
+/*
+ * Size of the sliding window used by rec_map() for files that do not fit in
+ * the address space.
  */
-static int	*ovector = NULL, ovector_size = 0;
-static char	*w_buf = NULL;
-static size_t	 w_buf_size = 0;
+#define REC_MAP_CHUNK (64 * 1024 * 1024)
+
+/* Helper functions for rec_open() and rec_next() */
+static int rec_ctx_match(struct rec_ctx *ctx, int rfd) __attribute__((nonnull(1)));
+static int rec_next_one(struct rec_ctx *ctx, int rfd, struct rec *rec, int fill) __attribute__((nonnull(1)));
+static int rec_fixed_next(struct rec_ctx *ctx, int rfd, struct rec *rec) __attribute__((nonnull(1)));
+static int rec_fixed_find(struct rec_ctx *ctx, int rfd) __attribute__((nonnull(1)));
+/* Helper functions for rec_unique_add() */
+static size_t rec_unique_key(const struct rec *rec) __attribute__((nonnull(1)));
+static uint64_t rec_hash(const char *p, size_t len) __attribute__((nonnull(1)));
+static void *rec_unique_alloc(struct rec_unique *u, size_t size, int *mapped) __attribute__((nonnull(1, 3)));
+static void rec_unique_release(struct rec_unique *u, void *p, size_t size, int mapped) __attribute__((nonnull(1, 2)));
+static size_t rec_unique_map_len(size_t size);
+static int rec_unique_grow(struct rec_unique *u, struct rec_unique_part *part) __attribute__((nonnull(1, 2)));
+static int rec_unique_copy(struct rec_unique *u, const struct rec *rec, const char *p, struct rec *copy) __attribute__((nonnull(1, 2, 3, 4)));
+static int rec_unique_spill(struct rec_unique *u, const char *p, size_t len, off_t *offset) __attribute__((nonnull(1, 2, 4)));
+static int rec_unique_spill_all(struct rec_unique *u) __attribute__((nonnull(1)));
+static const char *rec_unique_data(struct rec_ctx *ctx, struct rec_unique *u, const struct rec *copy) __attribute__((nonnull(1, 2, 3)));
+static int rec_map(int rfd, int *eof) __attribute__((nonnull(2)));
+static int rec_slurp(int rfd);
+/* Helper functions for compressed input */
+static int rec_decode_type(const unsigned char *magic, size_t len) __attribute__((nonnull(1)));
+static int rec_decode_init(struct rec_decode *d, int type) __attribute__((nonnull(1)));
+static void rec_decode_end(struct rec_decode *d) __attribute__((nonnull(1)));
+static int rec_decode_check(int type, char *p, size_t len) __attribute__((nonnull(2)));
+static int rec_decode_start(int rfd, int type, const char *prefix, size_t len) __attribute__((nonnull(3)));
+static ssize_t rec_decode_run(struct rec_decode *d, char *p, size_t n) __attribute__((nonnull(1, 2)));
+#ifdef HAVE_PTHREAD
+static void *rec_decode_worker(void *arg) __attribute__((nonnull(1)));
+#endif
+static void rec_decode_free(struct rec_decode *d);
+static ssize_t rec_read(int rfd, char *p, size_t n) __attribute__((nonnull(2)));
+static int rec_spool_open(const struct rec_ctx *ctx, int rfd) __attribute__((nonnull(1)));
+static int rec_flush(struct rec_ctx *ctx, int rfd) __attribute__((nonnull(1)));
+/* Helper functions for writing the temporary file */
+static int rec_spool_start(const struct rec_ctx *ctx, int rfd) __attribute__((nonnull(1)));
+#ifdef HAVE_PTHREAD
+static void *rec_spool_worker(void *arg) __attribute__((nonnull(1)));
+#endif
+static int rec_spool_write(struct rec_spool *s, int b, struct rec_spool_stats *st) __attribute__((nonnull(1, 3)));
+static void rec_spool_count(struct rec_spool_stats *total, const struct rec_spool_stats *st) __attribute__((nonnull(1, 2)));
+#ifdef HAVE_PTHREAD
+static void rec_spool_idle(struct rec_spool *s) __attribute__((nonnull(1)));
+#endif
+static int rec_spool_submit(struct rec_spool *s) __attribute__((nonnull(1)));
+static int rec_spool_wait(struct rec_spool *s) __attribute__((nonnull(1)));
+static double rec_clock(clockid_t clock);
+static int rec_spool_sync(int rfd);
+static int rec_spool_finish(struct rec_ctx *ctx, int rfd) __attribute__((nonnull(1)));
+static int rec_write_all(int fd, const char *p, size_t len) __attribute__((nonnull(2)));
+/* Helper functions for compressed temporary files */
+static struct rec_z *rec_z_new(void);
+static void rec_z_free(struct rec_z *z);
+static const char *rec_z_block(struct rec_ctx *ctx, int rfd, size_t b) __attribute__((nonnull(1)));
+static const char *rec_z_data(struct rec_ctx *ctx, int rfd, off_t offset, size_t len) __attribute__((nonnull(1)));
+/* Helper function for rec_spool_open() and rec_tmpfile() */
+static int rec_mkstemp(void);
+/* Helper functions for record indexes */
+static int rec_index_load(int rfd, const char *path, const char *key, size_t key_len) __attribute__((nonnull(2, 3)));
+static int rec_index_next(struct rec_ctx *ctx, int rfd, struct rec *rec) __attribute__((nonnull(1)));
+static void rec_index_add(int rfd, size_t delim_len, int last);
+static void rec_index_free(struct rec_index *idx);
+/* Helper function for rec_next() and rec_write() */
+static int rec_exec(struct rec_ctx *ctx, int rfd, const char *p, size_t len, size_t start, uint32_t options) __attribute__((nonnull(1)));
+
+/* Helper functions for rec_write() and rec_save() */
+static const char *rec_write_one(struct rec_ctx *ctx, const struct rec *rec, const struct rec_tmpl *tmpl, FILE *file) __attribute__((nonnull(1, 2, 3, 4)));
+static const char *rec_data(struct rec_ctx *ctx, const struct rec *rec) __attribute__((nonnull(1, 2)));
+static int rec_w_buf(struct rec_ctx *ctx, size_t len) __attribute__((nonnull(1)));
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+/* Helper functions for rec_write() */
+static int rec_write_copy(struct rec_ctx *ctx, const struct rec *rec, const struct rec_tmpl *t, FILE *file) __attribute__((nonnull(1, 2, 3, 4)));
+static int rec_copy(struct rec_ctx *ctx, int fd, off_t offset, size_t len, int out) __attribute__((nonnull(1)));
+#endif
 
-/* Used by rec_write() */
-static char	 errstr[128];
+/* Helper functions for rec_next() and rec_free() */
+static void *rec_alloc(struct rec_ctx *ctx, int rfd, size_t len) __attribute__((nonnull(1)));
+static int rec_charge(size_t *memory_cache, size_t len) __attribute__((nonnull(1)));
+static void rec_refund(size_t *memory_cache, size_t len) __attribute__((nonnull(1)));
+static size_t rec_available(size_t *memory_cache) __attribute__((nonnull(1)));
+static void rec_lock(void);
+static void rec_unlock(void);
+static void rec_chunk_release(struct rec_chunk *chunk) __attribute__((nonnull(1)));
 
-/* Helper function for the rec_write*() functions */
-static const char *rec_write_raw(const char *delim, const char *p, int ovector_valid, FILE *file) __attribute__((nonnull(4)));
+#ifdef HAVE_PTHREAD
+/* Helper functions for parallel splitting */
+static void rec_split_start(int rfd);
+static void *rec_split_worker(void *arg) __attribute__((nonnull(1)));
+static int rec_split_next(struct rec_ctx *ctx, int rfd, struct rec *rec) __attribute__((nonnull(1)));
+static void rec_split_stop(struct rec_split *s) __attribute__((nonnull(1)));
+#endif
+
+/* Helper functions for output templates */
+static const struct rec_tmpl *rec_tmpl_get(struct rec_ctx *ctx, const char *delim) __attribute__((nonnull(1, 2)));
+static struct rec_tmpl *rec_tmpl_new(const char *delim) __attribute__((nonnull(1)));
+static void rec_tmpl_free(struct rec_tmpl *t);
+static void rec_tmpl_compile(struct rec_tmpl *t) __attribute__((nonnull(1)));
+static void rec_tmpl_char(struct rec_tmpl *t, int c, size_t *lit_len) __attribute__((nonnull(1, 3)));
+static void rec_tmpl_ref(struct rec_tmpl *t, int ref) __attribute__((nonnull(1)));
+static const char *rec_tmpl_write(struct rec_ctx *ctx, const struct rec_tmpl *t, size_t first, const char *p, size_t prefix_len, int ovector_valid, FILE *file) __attribute__((nonnull(1, 2, 7)));
+static int rec_out(struct rec_out *o, const char *p, size_t len, FILE *file) __attribute__((nonnull(1, 4)));
+static int rec_out_flush(struct rec_out *o, FILE *file) __attribute__((nonnull(1, 2)));
 
 int
-rec_open(int fd, pcre *re, pcre_extra *re_extra, const char *default_delim, size_t *memory_cache)
+rec_open(struct rec_ctx *ctx, int fd, pcre2_code *re, const char *literal, size_t literal_len, const char *default_delim, size_t *memory_cache)
 {
-	sigset_t	 set, oset;
 	struct stat	 sb;
-	char		*template;
-	const char	*prefix;
 	void		*tmp;
-	int		 capturecount, prefix_len, rfd, new_files_size;
+	size_t		 jit_size, nmagic, nfirst;
+	ssize_t		 nbytes;
+	uint32_t	 capturecount;
+	long		 pages;
+	int		 rfd, new_files_size, eof, type;
+	unsigned char	 magic[4];
+	char		*first;
 #ifndef NDEBUG
 	int		 rv;
 #endif
 
-	template = NULL;
+	eof = 0;
+	first = NULL;
 
 	/* Find free entry in f[] */
 	for (rfd = 0; rfd < f_last && f[rfd].offset != -1; rfd++);
 	if (rfd == f_last) {
+		if (f_last == REC_F_MAX) {
+			/* Limited by the rfd in struct rec */
+			errno = EMFILE;
+			rfd = -1;
+			goto err;
+		}
 		if (f_last == f_size) {
 			if (f_size < 4)
 				new_files_size = 4;
-			else if (f_size <= INT_MAX / 2)
-				for (new_files_size = 1; new_files_size <= f_size; new_files_size *= 2);
 			else
-				new_files_size = INT_MAX;
-			assert(new_files_size > f_size);
+				for (new_files_size = 1; new_files_size <= f_size; new_files_size *= 2);
+			assert(new_files_size > f_size && new_files_size <= REC_F_MAX);
 			/* LINTED converting new_files_size to size_t works */
 			if ((tmp = realloc(f, new_files_size * sizeof(*f))) == NULL) {
 				rfd = -1;
@@ -155,433 +785,3595 @@ rec_open(int fd, pcre *re, pcre_extra *re_extra, const char *default_delim, size
 		rfd = f_last++;
 	}
 	
-	;; /* LINTED conversion of 4096 to size_t is fine */
-	if ((f[rfd].buf_p = malloc(f[rfd].buf_size = 4096)) == NULL)
-		goto err;
-
 	f[rfd].fd = f[rfd].tmp = fd;
-	f[rfd].buf_last = f[rfd].buf_first_read = f[rfd].buf_first_write = 0;
+	f[rfd].slurp = f[rfd].stream = 0;
+#ifdef HAVE_PTHREAD
+	f[rfd].split = NULL;
+#endif
+	f[rfd].spool = NULL;
+	f[rfd].z = NULL;
+	f[rfd].decode = NULL;
+	f[rfd].index = NULL;
+	f[rfd].re = NULL;
+	f[rfd].literal_len = 0;
+	f[rfd].fixed = 0;
+	f[rfd].fixed_direct = 0;
+	f[rfd].buf_p = f[rfd].map_p = NULL;
+	f[rfd].map_len = f[rfd].map_free = 0;
+	f[rfd].map_prefetch = 0;
+	f[rfd].map_offset = f[rfd].buf_offset = f[rfd].st_size = 0;
+	f[rfd].buf_last = f[rfd].buf_first_read = f[rfd].buf_first_write = f[rfd].buf_size = 0;
+	f[rfd].buf_scan = 0;
 	f[rfd].offset = 0;
-	f[rfd].default_delim = default_delim;
+	f[rfd].default_tmpl = NULL;
 	f[rfd].memory_cache = memory_cache;
-	if (pcre_fullinfo(f[rfd].re = re, f[rfd].re_extra = re_extra, PCRE_INFO_CAPTURECOUNT, &capturecount) != 0)
+	if (default_delim != NULL && (f[rfd].default_tmpl = rec_tmpl_new(default_delim)) == NULL)
 		goto err;
-
-	assert(capturecount >= 0);
-	/* Make sure that ovector is usable */
-	/* LINTED converting capturecount to unsigned works */
-	if (capturecount > INT_MAX / sizeof(*ovector) / 3 - 1) {
-		errno = ENOMEM;
+	if (pcre2_pattern_info(re, PCRE2_INFO_CAPTURECOUNT, &capturecount) != 0) {
+		errno = EINVAL;
 		goto err;
 	}
-	if ((capturecount + 1) * 3 > ovector_size) {
-		/* LINTED converting capturecount to unsigned works, again */
-		if ((tmp = realloc(ovector, (capturecount + 1) * 3 * sizeof(*ovector))) == NULL)
-			goto err;
+	f[rfd].ovector_count = capturecount + 1;
+	/* If JIT compilation failed or is not supported, use the interpreter */
+	f[rfd].jit = pcre2_pattern_info(re, PCRE2_INFO_JITSIZE, &jit_size) == 0 && jit_size > 0;
+	assert(literal_len <= sizeof(f[rfd].literal));
+	assert(literal != NULL || literal_len == 0);
+	;; /* LINTED literal_len <= REC_LITERAL_MAX, so this works */
+	if ((f[rfd].literal_len = literal_len) != 0)
+		memcpy(f[rfd].literal, literal, literal_len);
 
-		ovector = tmp;
-		ovector_size = (capturecount + 1) * 3;
-	}
+	if (rec_ctx_match(ctx, rfd) == -1)
+		goto err;
 
-	/* If the file is not seek()able, open a temporary file */
+	/*
+	 * If the file is not seek()able, we'll need a temporary file unless
+	 * the input fits in memory.
+	 */
 #ifndef NDEBUG
 	rv =
 #endif
 		fstat(f[rfd].fd, &sb);
 	assert(rv == 0);
-	/* XXX Is there a way to check for "seek works in a sane fashion"? */
-	if (!S_ISREG(sb.st_mode)) {
-		if ((prefix = getenv("TMPDIR")) == NULL || prefix[0] == '\0')
-			prefix = "/tmp";
-		;; /* LINTED conversion from strlen(prefix) to int is ok */
-		for (prefix_len = MIN(strlen(prefix), INT_MAX); prefix_len > 0 && prefix[prefix_len - 1] == '/'; prefix_len--);
-		if (asprintf(&template, "%.*s/randomize.XXXXXX", prefix_len, prefix) == -1)
+
+	/*
+	 * Look for compressed data. Regular files are peeked at, but whatever
+	 * is read from anything else is either handed to the decoder or put in
+	 * buf_p (see below); so read no more than is needed to tell, unless
+	 * the magic matches.
+	 */
+	nmagic = 0;
+	if (decompress_input && S_ISREG(sb.st_mode)) {
+		if ((nbytes = pread(f[rfd].fd, magic, sizeof(magic), 0)) == -1)
+			goto err;
+		nmagic = nbytes;
+	} else if (decompress_input)
+		while (nmagic < sizeof(magic) && rec_decode_type(magic, nmagic) == -1) {
+			if ((nbytes = read(f[rfd].fd, &magic[nmagic], sizeof(magic) - nmagic)) == -1) {
+				if (errno == EINTR)
+					continue;
+				goto err;
+			}
+			if (nbytes == 0)
+				break;
+			nmagic += nbytes;
+		}
+	if ((type = rec_decode_type(magic, nmagic)) > 0) {
+		/*
+		 * Plenty of other data starts with the same bytes, so unless
+		 * the first block of input decompresses as far as it goes,
+		 * read the input as it is.
+		 */
+		if ((first = malloc(REC_DECODE_BLOCK)) == NULL)
+			goto err;
+		if (S_ISREG(sb.st_mode)) {
+			if ((nbytes = pread(f[rfd].fd, first, REC_DECODE_BLOCK, 0)) == -1)
+				goto err;
+			nfirst = nbytes;
+		} else {
+			memcpy(first, magic, nmagic);
+			for (nfirst = nmagic; nfirst < REC_DECODE_BLOCK; nfirst += nbytes) {
+				if ((nbytes = read(f[rfd].fd, &first[nfirst], REC_DECODE_BLOCK - nfirst)) == -1) {
+					if (errno == EINTR) {
+						nbytes = 0;
+						continue;
+					}
+					goto err;
+				}
+				if (nbytes == 0)
+					break;
+			}
+		}
+		switch (rec_decode_check(type, first, nfirst)) {
+		case -1:
 			goto err;
+		case 0:
+			break;
+		default:
+			if (rec_decode_start(rfd, type, first, S_ISREG(sb.st_mode) ? 0 : nfirst) == -1)
+				goto err;
+			free(first);
+			first = NULL;
+			break;
+		}
+	}
 
+	/* XXX Is there a way to check for "seek works in a sane fashion"? */
+	if (!S_ISREG(sb.st_mode) || f[rfd].decode != NULL) {
+		f[rfd].tmp = -1;
+		f[rfd].slurp = 1;
+	} else if (sb.st_size > 0) {
 		/*
-		 * Create temporary file; block signals to make it more likely
-		 * that unlink() succeeds.
+		 * Map the file, if possible all of it; if that fails, fall
+		 * back to read(2).
 		 */
-		sigfillset(&set);
-		sigprocmask(SIG_BLOCK, &set, &oset);
-		f[rfd].tmp = mkstemp(template);
-		if (f[rfd].tmp != -1)
-			unlink(template);
-		sigprocmask(SIG_SETMASK, &oset, NULL);
-
-		if (f[rfd].tmp == -1)
+		f[rfd].st_size = sb.st_size;
+#ifdef _SC_PHYS_PAGES
+		pages = sysconf(_SC_PHYS_PAGES);
+#else
+		pages = -1;
+#endif
+		/* LINTED pages is positive if it is used */
+		f[rfd].map_prefetch = pages == -1 || (uintmax_t) sb.st_size > (uintmax_t) pages * sysconf(_SC_PAGESIZE) / 2;
+		if ((uintmax_t) sb.st_size <= SIZE_MAX &&
+		    (tmp = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, f[rfd].fd, 0)) != MAP_FAILED) {
+			f[rfd].map_p = tmp;
+			f[rfd].map_len = sb.st_size;
+			posix_madvise(f[rfd].map_p, f[rfd].map_len, POSIX_MADV_SEQUENTIAL);
+			f[rfd].buf_p = f[rfd].map_p;
+			f[rfd].buf_size = f[rfd].buf_last = f[rfd].map_len;
+		} else
+			rec_map(rfd, &eof);
+	}
+
+	if (first != NULL && !S_ISREG(sb.st_mode)) {
+		/* Read while looking for compressed data, see above */
+		f[rfd].buf_p = first;
+		f[rfd].buf_size = REC_DECODE_BLOCK;
+		f[rfd].buf_last = nfirst;
+		first = NULL;
+	} else {
+		;; /* LINTED conversion of REC_READ_MIN to size_t is fine */
+		if (f[rfd].map_p == NULL && (f[rfd].buf_p = malloc(f[rfd].buf_size = REC_READ_MIN)) == NULL)
 			goto err;
+		if (f[rfd].decode == NULL && !S_ISREG(sb.st_mode)) {
+			/* Idem */
+			memcpy(f[rfd].buf_p, magic, nmagic);
+			f[rfd].buf_last = nmagic;
+		}
 	}
+	free(first);
 
-	free(template);
+#ifdef HAVE_PTHREAD
+	rec_split_start(rfd);
+#endif
 
-	if (pcre_refcount(f[rfd].re, 0) < UINT16_MAX)
-		pcre_refcount(f[rfd].re, +1);
+	/* We own re from now on */
+	f[rfd].re = re;
 
 	return rfd;
 
 err:
+	free(first);
 	if (rfd != -1)
-		rec_close(rfd);
-	free(template);
+		rec_close(ctx, rfd);
 
 	return -1;
 }
 
-int
-rec_close(int rfd)
+struct rec_ctx *
+rec_ctx_new(void)
 {
-	int		 rv, rv2, rv_errno;
-	void		*tmp;
-
-	rv = 0;
-	rv_errno = 0;
+	struct rec_ctx	*ctx;
 
-	if (f[rfd].tmp != -1 && f[rfd].tmp != f[rfd].fd)
-		if ((rv = close(f[rfd].tmp)) != 0)
-			rv_errno = errno;
+	if ((ctx = malloc(sizeof(*ctx))) == NULL)
+		return NULL;
 
-	if ((rv2 = close(f[rfd].fd)) != 0 && rv == 0) {
-		rv = rv2;
-		rv_errno = errno;
+	ctx->match_data = NULL;
+	ctx->ovector = NULL;
+	ctx->ovector_count = 0;
+	ctx->w_buf = NULL;
+	ctx->w_buf_size = 0;
+	ctx->errstr[0] = '\0';
+	ctx->tmpl_cache = NULL;
+	ctx->arena = NULL;
+	ctx->arena_used = 0;
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+	ctx->copy_fd = -1;
+	ctx->copy_method = REC_COPY_NONE;
+#endif
+	memset(&ctx->stats, 0, sizeof(ctx->stats));
+	if ((ctx->match_context = pcre2_match_context_create(NULL)) == NULL) {
+		free(ctx);
+		errno = ENOMEM;
+		return NULL;
 	}
 
-	free(f[rfd].buf_p);
-	f[rfd].offset = -1;
+	return ctx;
+}
 
-	if (pcre_refcount(f[rfd].re, 0) != UINT16_MAX) {
-		assert(pcre_refcount(f[rfd].re, 0) > 0);
-		if (pcre_refcount(f[rfd].re, -1) == 0) {
-			pcre_free(f[rfd].re);
-			pcre_free(f[rfd].re_extra);
-		}
-	}
+void
+rec_ctx_free(struct rec_ctx *ctx)
+{
+	struct rec_tmpl	*t;
 
-	assert(f_last > 0);
-	if (rfd == f_last - 1) {
-		for ( ; rfd >= 0 && f[rfd].offset == -1; rfd--);
-		/* Note that rfd points one *past* the last valid rfd */
-		rfd++;
-		assert(rfd >= 0);
-		if (rfd < f_size / 4) {
-			/* Shrink f[] */
-			/* LINTED converting rfd to size_t works */
-			if (rfd == 0) {
-				free(f);
-				f = NULL;
-				f_last = f_size = rfd;
-			} else {
-				if ((tmp = realloc(f, rfd * sizeof(*f)))
-				    == NULL) {
-					f = tmp;
-					f_last = f_size = rfd;
-				}  /* else hold onto a bit more memory than needed */
-			}
-		}
+	if (ctx == NULL)
+		return;
+
+	while ((t = ctx->tmpl_cache) != NULL) {
+		ctx->tmpl_cache = t->next;
+		rec_tmpl_free(t);
 	}
+	/* Records still in the arena keep it alive, see rec_free() */
+	if (ctx->arena != NULL) {
+		if (ctx->arena->live == 0)
+			rec_chunk_release(ctx->arena);
+		else
+			ctx->arena->ctx = NULL;
+	}
+	pcre2_match_data_free(ctx->match_data);
+	pcre2_match_context_free(ctx->match_context);
+	free(ctx->w_buf);
+	free(ctx);
+}
 
-	if (f_size == 0) {
-		/* Clean up */
-		free(f);
-		f = NULL;
-		assert(f_last == 0);
-		free(ovector);
-		ovector = NULL;
-		ovector_size = 0;
-		free(w_buf);
-		w_buf = NULL;
-		w_buf_size = 0;
+/*
+ * Make sure that ctx->match_data is large enough for f[rfd].re. Returns 0 on
+ * success; otherwise, returns -1 and sets errno to ENOMEM.
+ */
+static int
+rec_ctx_match(struct rec_ctx *ctx, int rfd)
+{
+	pcre2_match_data *tmp;
+
+	if (ctx->ovector_count >= f[rfd].ovector_count)
+		return 0;
+
+	if ((tmp = pcre2_match_data_create(f[rfd].ovector_count, NULL)) == NULL) {
+		errno = ENOMEM;
+		return -1;
 	}
+	pcre2_match_data_free(ctx->match_data);
+	ctx->match_data = tmp;
+	ctx->ovector = pcre2_get_ovector_pointer(ctx->match_data);
+	ctx->ovector_count = pcre2_get_ovector_count(ctx->match_data);
+	assert(ctx->ovector_count >= f[rfd].ovector_count);
 
-	errno = rv_errno;
-	return rv;
+	return 0;
 }
 
-void
-rec_assert_released(void)
+/*
+ * Create the temporary file for f[rfd]. Returns 0 on success; otherwise,
+ * returns -1 and sets errno as for malloc(3) or mkstemp(3).
+ */
+static int
+rec_spool_open(const struct rec_ctx *ctx, int rfd)
 {
-	assert(f_size == 0);
-	assert(f_last == 0);
-	assert(ovector == NULL);
-	assert(ovector_size == 0);
-	assert(w_buf == NULL);
-	assert(w_buf_size == 0);
+	assert(f[rfd].tmp == -1);
+	assert(f[rfd].spool == NULL && f[rfd].z == NULL);
+
+	if ((f[rfd].tmp = rec_mkstemp()) == -1)
+		return -1;
+	if (rec_spool_start(ctx, rfd) == -1 && tmp_compress)
+		/* rec_flush() cannot compress by itself */
+		return -1;
+
+	return 0;
 }
 
-int
-rec_next(int rfd, struct rec *rec)
+/*
+ * Set up f[rfd].spool (and f[rfd].z, if the temporary file is to be
+ * compressed), and start the writer thread if possible. Returns 0 on success;
+ * otherwise, returns -1 and sets errno as for malloc(3), and rec_flush() has to
+ * write the data itself.
+ */
+static int
+rec_spool_start(const struct rec_ctx *ctx, int rfd)
 {
-	void		*tmp;
-	ssize_t		 nbytes;
-	int		 rv, eof, rec_len;
-#ifndef NDEBUG
-	int		 capturecount;
+	struct rec_spool *s;
 
-	assert(pcre_fullinfo(f[rfd].re, f[rfd].re_extra, PCRE_INFO_CAPTURECOUNT, &capturecount) == 0);
-	/* LINTED converting capturecount to unsigned works */
-	assert(capturecount <= SIZE_MAX / sizeof(*ovector) / 3 - 1);
-	assert((capturecount + 1) * 3 <= ovector_size);
-#endif
+	if ((s = malloc(sizeof(*s))) == NULL)
+		return -1;
+	s->buf[0] = s->buf[1] = NULL;
+	s->z = NULL;
+	if ((s->buf[0] = malloc(REC_SPOOL_BLOCK)) == NULL ||
+	    (s->buf[1] = malloc(REC_SPOOL_BLOCK)) == NULL ||
+	    (tmp_compress && (s->z = rec_z_new()) == NULL)) {
+		free(s->buf[1]);
+		free(s->buf[0]);
+		free(s);
+		return -1;
+	}
+	s->fd = f[rfd].tmp;
+	s->len[0] = s->len[1] = 0;
+	s->fill = 0;
+	s->busy = s->stop = s->error = 0;
+	memset(&s->stats, 0, sizeof(s->stats));
+	s->ctx = ctx;
 
-	/*
-	 * Look for regular expression.
-	 *
-	 * Read the documentation for f[rfd].buf_p before trying to understand
-	 * this code.
-	 */
-	eof = 0;
-	while ((rv = pcre_exec(f[rfd].re, f[rfd].re_extra, f[rfd].buf_p, f[rfd].buf_last, f[rfd].buf_first_read, eof ? 0 : PCRE_NOTEOL, ovector, ovector_size)) < 0) {
-		if (rv != PCRE_ERROR_NOMATCH) {
-			errno = EINVAL;
-			goto err;
+#ifdef HAVE_PTHREAD
+	s->threaded = 0;
+	if (pthread_mutex_init(&s->mutex, NULL) == 0) {
+		if (pthread_cond_init(&s->cond, NULL) == 0) {
+			if (pthread_create(&s->thread, NULL, rec_spool_worker, s) == 0)
+				s->threaded = 1;
+			else
+				pthread_cond_destroy(&s->cond);
 		}
+		if (!s->threaded)
+			pthread_mutex_destroy(&s->mutex);
+	}
+#endif
 
-		if (eof) {
-			if (f[rfd].buf_first_read < f[rfd].buf_last) {
-				/* Unterminated final record */
-				ovector[0] = f[rfd].buf_first_read;
-				ovector[1] = f[rfd].buf_last;
+	rec_lock();
+	f[rfd].spool = s;
+	rec_unlock();
+	f[rfd].z = s->z;
+
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+rec_spool_worker(void *arg)
+{
+	struct rec_spool *s;
+	struct rec_spool_stats st;
+	int		 b, error;
+
+	s = arg;
+	pthread_mutex_lock(&s->mutex);
+	for (;;) {
+		while (!s->busy && !s->stop)
+			pthread_cond_wait(&s->cond, &s->mutex);
+		if (!s->busy)
+			break;
+
+		b = !s->fill;
+		pthread_mutex_unlock(&s->mutex);
+		error = rec_spool_write(s, b, &st);
+		pthread_mutex_lock(&s->mutex);
+
+		rec_spool_count(&s->stats, &st);
+		if (s->error == 0)
+			s->error = error;
+		s->busy = 0;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->mutex);
+
+	return NULL;
+}
+#endif
+
+/*
+ * Write (and empty) s->buf[b], compressing it if s->z is not NULL, and set *st.
+ * Returns 0 on success, or an errno value.
+ */
+static int
+rec_spool_write(struct rec_spool *s, int b, struct rec_spool_stats *st)
+{
+	struct rec_z	*z;
+	const char	*p;
+	void		*tmp;
+	size_t		 i, n, len;
+	int		 error;
+#ifdef HAVE_LZ4
+	int		 rv;
+#endif
+
+	st->wall = rec_clock(CLOCK_MONOTONIC);
+	st->cpu = rec_clock(CLOCK_THREAD_CPUTIME_ID);
+	st->bytes = 0;
+	st->wait = 0;
+
+	if ((z = s->z) == NULL) {
+		if ((error = rec_write_all(s->fd, s->buf[b], s->len[b])) == 0)
+			st->bytes = s->len[b];
+		s->len[b] = 0;
+		goto done;
+	}
+
+	for (i = 0, error = 0; i < s->len[b] && error == 0; i += n) {
+		/* Only the last block may be short */
+		assert(z->len % REC_Z_BLOCK == 0);
+
+		n = MIN(s->len[b] - i, REC_Z_BLOCK);
+		p = &s->buf[b][i];
+		len = n;
+#ifdef HAVE_LZ4
+		/* LINTED n is at most REC_Z_BLOCK */
+		if ((rv = LZ4_compress_default(p, z->zbuf, (int) n, (int) n - 1)) > 0) {
+			p = z->zbuf;
+			len = rv;
+		}
+#endif
+		if ((error = rec_write_all(s->fd, p, len)) != 0)
+			break;
+		st->bytes += len;
+
+		if (z->nblocks + 2 > z->block_size) {
+			if ((tmp = realloc(z->block, 2 * z->block_size * sizeof(*z->block))) == NULL) {
+				error = errno;
 				break;
 			}
+			z->block = tmp;
+			z->block_size *= 2;
+		}
+		z->block[z->nblocks + 1] = z->block[z->nblocks] + len;
+		z->nblocks++;
+		z->len += n;
+	}
+	s->len[b] = 0;
 
-			/*
-			 * All data processed - everything should have been
-			 * flushed to disk. Notify the caller of EOF.
-			 */
-			assert(f[rfd].buf_first_read == 0);
-			assert(f[rfd].buf_last == 0);
+done:
+	st->wall = rec_clock(CLOCK_MONOTONIC) - st->wall;
+	st->cpu = rec_clock(CLOCK_THREAD_CPUTIME_ID) - st->cpu;
+	return error;
+}
 
-			errno = 0;
+/*
+ * Add st to total.
+ */
+static void
+rec_spool_count(struct rec_spool_stats *total, const struct rec_spool_stats *st)
+{
+	total->bytes += st->bytes;
+	total->wall += st->wall;
+	total->cpu += st->cpu;
+	total->wait += st->wait;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Wait, with s->mutex held, until the writer thread is done with buf[!fill].
+ */
+static void
+rec_spool_idle(struct rec_spool *s)
+{
+	double		 start;
+
+	if (!s->busy)
+		return;
+
+	start = rec_clock(CLOCK_MONOTONIC);
+	while (s->busy)
+		pthread_cond_wait(&s->cond, &s->mutex);
+	s->stats.wait += rec_clock(CLOCK_MONOTONIC) - start;
+}
+#endif
+
+/*
+ * Write buf[fill], after waiting for the other buffer to be written. Returns 0
+ * on success; otherwise, returns -1 and sets errno as for write(2) (possibly
+ * for an earlier write).
+ */
+static int
+rec_spool_submit(struct rec_spool *s)
+{
+	struct rec_spool_stats st;
+	int		 error;
+
+#ifdef HAVE_PTHREAD
+	if (s->threaded) {
+		pthread_mutex_lock(&s->mutex);
+		rec_spool_idle(s);
+		if ((error = s->error) == 0 && s->len[s->fill] != 0) {
+			assert(s->len[!s->fill] == 0);
+			s->fill = !s->fill;
+			s->busy = 1;
+			pthread_cond_broadcast(&s->cond);
+		}
+		pthread_mutex_unlock(&s->mutex);
+	} else
+#endif
+	if ((error = s->error) == 0 && s->len[s->fill] != 0) {
+		error = s->error = rec_spool_write(s, s->fill, &st);
+		/* All of this was spent waiting, as far as rec_next() is concerned */
+		st.wait = st.wall;
+		rec_spool_count(&s->stats, &st);
+	}
+
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Wait until nothing is being written. The return values are as for
+ * rec_spool_submit().
+ */
+static int
+rec_spool_wait(struct rec_spool *s)
+{
+	int		 error;
+
+#ifdef HAVE_PTHREAD
+	if (s->threaded) {
+		pthread_mutex_lock(&s->mutex);
+		rec_spool_idle(s);
+		error = s->error;
+		pthread_mutex_unlock(&s->mutex);
+	} else
+#endif
+		error = s->error;
+
+	if (error != 0) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Make sure that everything rec_flush() got for f[rfd] can be read back: from
+ * the temporary file or, if that is compressed, from the temporary file and
+ * buf[fill] (since only the last block may be short). The return values are as
+ * for rec_spool_submit().
+ */
+static int
+rec_spool_sync(int rfd)
+{
+	struct rec_spool *s;
+
+	if ((s = f[rfd].spool) == NULL)
+		return 0;
+
+	if (s->z == NULL && rec_spool_submit(s) == -1)
+		return -1;
+	return rec_spool_wait(s);
+}
+
+/*
+ * Write everything to the temporary file, stop the writer thread and free
+ * f[rfd].spool; rec_flush() writes any further data itself.
+ */
+static int
+rec_spool_finish(struct rec_ctx *ctx, int rfd)
+{
+	struct rec_spool *s;
+	int		 rv, saved_errno;
+
+	if ((s = f[rfd].spool) == NULL)
+		return 0;
+
+	rv = rec_spool_submit(s) == -1 || rec_spool_wait(s) == -1 ? -1 : 0;
+	saved_errno = errno;
+	/* Hide s from rec_get_stats(), which counts it in ctx from now on */
+	rec_lock();
+	f[rfd].spool = NULL;
+	rec_unlock();
+
+#ifdef HAVE_PTHREAD
+	if (s->threaded) {
+		pthread_mutex_lock(&s->mutex);
+		s->stop = 1;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->mutex);
+		pthread_join(s->thread, NULL);
+
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->mutex);
+	}
+#endif
+	ctx->stats.bytes_spooled += s->stats.bytes;
+	ctx->stats.spool_wall += s->stats.wall;
+	ctx->stats.spool_cpu += s->stats.cpu;
+	ctx->stats.spool_wait += s->stats.wait;
+	free(s->buf[1]);
+	free(s->buf[0]);
+	free(s);
+
+	errno = saved_errno;
+	return rv;
+}
+
+/*
+ * Write len bytes at p to fd. Returns 0 on success, or an errno value.
+ */
+static int
+rec_write_all(int fd, const char *p, size_t len)
+{
+	ssize_t		 nbytes;
+	size_t		 i;
+
+	for (i = 0; i < len; i += nbytes)
+		if ((nbytes = write(fd, &p[i], len - i)) == -1) {
+			if (errno != EINTR)
+				return errno;
+			nbytes = 0;
+		}
+
+	return 0;
+}
+
+static struct rec_z *
+rec_z_new(void)
+{
+	struct rec_z	*z;
+	int		 i;
+
+	if ((z = malloc(sizeof(*z))) == NULL)
+		return NULL;
+	if ((z->block = malloc((z->block_size = 64) * sizeof(*z->block))) == NULL ||
+	    (z->zbuf = malloc(REC_Z_BLOCK)) == NULL) {
+		free(z->block);
+		free(z);
+		return NULL;
+	}
+	z->block[0] = 0;
+	z->nblocks = 0;
+	z->len = 0;
+	z->rbuf = z->cache = NULL;
+	for (i = 0; i < REC_Z_CACHE; i++)
+		z->cache_block[i] = SIZE_MAX;
+
+	return z;
+}
+
+static void
+rec_z_free(struct rec_z *z)
+{
+	if (z == NULL)
+		return;
+
+	free(z->cache);
+	free(z->rbuf);
+	free(z->zbuf);
+	free(z->block);
+	free(z);
+}
+
+/*
+ * Return block b of the compressed temporary file of f[rfd], decompressed,
+ * which remains valid until the next call. Returns NULL and sets errno on
+ * failure.
+ */
+static const char *
+rec_z_block(struct rec_ctx *ctx, int rfd, size_t b)
+{
+	struct rec_z	*z;
+	char		*p;
+	ssize_t		 nbytes;
+	size_t		 i, len, zlen;
+
+	z = f[rfd].z;
+	assert(b < z->nblocks);
+
+	if ((z->cache == NULL && (z->cache = malloc(REC_Z_CACHE * REC_Z_BLOCK)) == NULL) ||
+	    (z->rbuf == NULL && (z->rbuf = malloc(REC_Z_BLOCK)) == NULL))
+		return NULL;
+	p = &z->cache[b % REC_Z_CACHE * REC_Z_BLOCK];
+	if (z->cache_block[b % REC_Z_CACHE] == b)
+		return p;
+	/* In case of errors */
+	z->cache_block[b % REC_Z_CACHE] = SIZE_MAX;
+
+	/* LINTED only the last block may be shorter than REC_Z_BLOCK */
+	len = b + 1 < z->nblocks ? REC_Z_BLOCK : (size_t) (z->len - (off_t) b * REC_Z_BLOCK);
+	/* LINTED blocks are never longer than REC_Z_BLOCK */
+	zlen = z->block[b + 1] - z->block[b];
+	assert(zlen <= len);
+
+	/* Read uncompressed blocks into place */
+	for (i = 0; i < zlen; i += nbytes) {
+		if ((nbytes = pread(f[rfd].tmp, zlen == len ? &p[i] : &z->rbuf[i], zlen - i, z->block[b] + i)) <= 0) {
+			if (nbytes == 0)
+				/* Truncated */
+				errno = EIO;
+			return NULL;
+		}
+		ctx->stats.preads++;
+		ctx->stats.pread_bytes += nbytes;
+	}
+
+	if (zlen < len) {
+#ifdef HAVE_LZ4
+		/* LINTED zlen and len are at most REC_Z_BLOCK */
+		if (LZ4_decompress_safe(z->rbuf, p, (int) zlen, (int) len) != (int) len) {
+			errno = EIO;
+			return NULL;
+		}
+#else
+		/* Compression is not supported, see rec_set_compress() */
+		errno = ENOSYS;
+		return NULL;
+#endif
+	}
+
+	z->cache_block[b % REC_Z_CACHE] = b;
+	return p;
+}
+
+/*
+ * rec_data() for a record of len bytes at offset in the compressed temporary
+ * file of f[rfd]. Returns NULL and sets ctx->errstr on failure.
+ *
+ * The block cache is shared by every context that writes records of f[rfd],
+ * so the record is always copied to ctx->w_buf, under rec_mutex.
+ */
+static const char *
+rec_z_data(struct rec_ctx *ctx, int rfd, off_t offset, size_t len)
+{
+	struct rec_spool *s;
+	struct rec_z	*z;
+	const char	*p;
+	size_t		 i, n, start;
+
+	s = f[rfd].spool;
+	z = f[rfd].z;
+	if (rec_spool_sync(rfd) == -1) {
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to write temporary file: %s", strerror(errno));
+		return NULL;
+	}
+
+	/* Anything beyond z->len is still in buf[fill]; see rec_spool_sync() */
+	assert(offset + (off_t) len <= z->len + (off_t) (s == NULL ? 0 : s->len[s->fill]));
+	if (offset >= z->len)
+		return &s->buf[s->fill][offset - z->len];
+
+	if (rec_w_buf(ctx, len) == -1)
+		return NULL;
+	rec_lock();
+	for (i = 0; i < len; i += n, offset += n) {
+		if (offset >= z->len) {
+			memcpy(&ctx->w_buf[i], &s->buf[s->fill][offset - z->len], len - i);
+			break;
+		}
+
+		/* LINTED offset is nonnegative */
+		start = offset % REC_Z_BLOCK;
+		n = MIN(len - i, REC_Z_BLOCK - start);
+		/* LINTED idem */
+		if ((p = rec_z_block(ctx, rfd, offset / REC_Z_BLOCK)) == NULL) {
+			rec_unlock();
 			goto err;
 		}
+		memcpy(&ctx->w_buf[i], &p[start], n);
+	}
+	rec_unlock();
 
-		/*
-		 * Get more data
-		 */
-		assert(f[rfd].buf_first_write >= 0);
-		assert(f[rfd].buf_first_read >= f[rfd].buf_first_write);
-		assert(f[rfd].buf_last >= f[rfd].buf_first_read);
-		assert(f[rfd].buf_size >= f[rfd].buf_last);
-		if (f[rfd].tmp != f[rfd].fd) {
-			/* Flush processed data to disk */
-			/* LINTED converting (f[rfd].buf_first_read - i) to unsigned works */
-			for (nbytes = 0;
-			     f[rfd].buf_first_write < f[rfd].buf_first_read;
-			     nbytes = write(f[rfd].tmp, &f[rfd].buf_p[f[rfd].buf_first_write], f[rfd].buf_first_read - f[rfd].buf_first_write)) {
-				if (nbytes == -1)
-					goto err;
+	return ctx->w_buf;
 
-				assert(nbytes >= 0);
-				/* LINTED truncating nbytes works, since nbytes <= f[rfd].buf_first_read <= INT_MAX */
-				f[rfd].buf_first_write += nbytes;
-			}
-			assert(f[rfd].buf_first_write == f[rfd].buf_first_read);
-		} else
-			assert(f[rfd].buf_first_write == 0);
+err:
+	snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to read record from file: %s", strerror(errno));
+	return NULL;
+}
 
-		if (f[rfd].buf_size - (f[rfd].buf_last - f[rfd].buf_first_read) >= MAX(f[rfd].buf_size / 4, BUFSIZ)) {
-			/* Just move unprocessed data to front */
-			/* LINTED f[rfd].buf_last - f[rfd].buf_first_read >= 0, so can be converted to size_t */
-			bcopy(&f[rfd].buf_p[f[rfd].buf_first_read], f[rfd].buf_p, f[rfd].buf_last - f[rfd].buf_first_read);
-		} else {
-			/* Enlarge buffer */
-			if (f[rfd].buf_size > INT_MAX / 2) {
-				errno = ENOMEM;
-				goto err;
-			}
+/*
+ * Create an unlinked temporary file in TMPDIR. Returns a file descriptor on
+ * success; otherwise, returns -1 and sets errno as for malloc(3) or
+ * mkstemp(3).
+ */
+static int
+rec_mkstemp(void)
+{
+	sigset_t	 set, oset;
+	char		*template;
+	const char	*prefix;
+	int		 prefix_len, fd;
 
-			;; /* LINTED f[rfd].buf_size * 2 fits in INT_MAX per above */
-			if ((tmp = malloc(f[rfd].buf_size * 2)) == NULL)
-				goto err;
+#ifdef HAVE_MEMFD_CREATE
+	if (tmp_memfd)
+		return memfd_create("randomize", MFD_CLOEXEC);
+#endif
+
+	if ((prefix = getenv("TMPDIR")) == NULL || prefix[0] == '\0')
+		prefix = "/tmp";
+	;; /* LINTED conversion from strlen(prefix) to int is ok */
+	for (prefix_len = MIN(strlen(prefix), INT_MAX); prefix_len > 0 && prefix[prefix_len - 1] == '/'; prefix_len--);
+	if (asprintf(&template, "%.*s/randomize.XXXXXX", prefix_len, prefix) == -1)
+		return -1;
+
+	/*
+	 * Create temporary file; block signals to make it more likely that
+	 * unlink() succeeds.
+	 */
+	sigfillset(&set);
+#ifdef HAVE_PTHREAD
+	pthread_sigmask(SIG_BLOCK, &set, &oset);
+#else
+	sigprocmask(SIG_BLOCK, &set, &oset);
+#endif
+	fd = mkstemp(template);
+	if (fd != -1)
+		unlink(template);
+#ifdef HAVE_PTHREAD
+	pthread_sigmask(SIG_SETMASK, &oset, NULL);
+#else
+	sigprocmask(SIG_SETMASK, &oset, NULL);
+#endif
+
+	free(template);
+
+	return fd;
+}
+
+FILE *
+rec_tmpfile(void)
+{
+	FILE		*file;
+	int		 fd, saved_errno;
+
+	if ((fd = rec_mkstemp()) == -1)
+		return NULL;
+
+	if ((file = fdopen(fd, "w+")) == NULL) {
+		saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+	}
+
+	return file;
+}
+
+int
+rec_index_open(int rfd, const char *path, const char *key)
+{
+	struct rec_index *idx;
+	struct stat	 sb;
+	size_t		 key_len;
+	int		 fd, rv;
+	static const char zero[8];
+
+	assert(f[rfd].index == NULL && f[rfd].offset == 0);
+	if (f[rfd].tmp != f[rfd].fd)
+		/* Not a regular file */
+		return 0;
+
+	if (fstat(f[rfd].fd, &sb) == -1)
+		return -1;
+	if ((idx = malloc(sizeof(*idx))) == NULL)
+		return -1;
+	key_len = strlen(key);
+	idx->hdr.magic = REC_INDEX_MAGIC;
+	idx->hdr.size = sb.st_size;
+	idx->hdr.mtime_sec = sb.st_mtim.tv_sec;
+	idx->hdr.mtime_nsec = sb.st_mtim.tv_nsec;
+	idx->hdr.ino = sb.st_ino;
+	idx->hdr.dev = sb.st_dev;
+	idx->hdr.key_len = key_len;
+	idx->hdr.nrecords = 0;
+	idx->end = NULL;
+	idx->next = 0;
+	idx->map = NULL;
+	idx->map_len = 0;
+	idx->file = NULL;
+	idx->path = idx->tmp_path = NULL;
+	idx->error = 0;
+	f[rfd].index = idx;
+
+	if ((rv = rec_index_load(rfd, path, key, key_len)) != 0) {
+		if (rv == -1) {
+			rec_index_free(idx);
+			f[rfd].index = NULL;
+			return -1;
+		}
+#ifdef HAVE_PTHREAD
+		if (f[rfd].split != NULL) {
+			/* Keep the workers from splitting the file again */
+			rec_split_stop(f[rfd].split);
+			f[rfd].split = NULL;
+		}
+#endif
+		if (f[rfd].map_p != NULL && f[rfd].map_offset == 0 &&
+		    f[rfd].map_len == f[rfd].st_size)
+			/* rec_write() will access the mapping randomly */
+			posix_madvise(f[rfd].map_p, f[rfd].map_len, POSIX_MADV_RANDOM);
+		/* The records are never read before they are written */
+		f[rfd].map_prefetch = 1;
+		return 1;
+	}
+
+	/* Write a new index next to path, and move it there in rec_index_save() */
+	if ((idx->path = strdup(path)) == NULL ||
+	    asprintf(&idx->tmp_path, "%s.XXXXXX", path) == -1) {
+		idx->tmp_path = NULL;
+		goto err;
+	}
+	if ((fd = mkstemp(idx->tmp_path)) == -1) {
+		free(idx->tmp_path);
+		idx->tmp_path = NULL;
+		goto err;
+	}
+	/* As readable as the file itself; mkstemp() makes it private */
+	fchmod(fd, sb.st_mode & 0644);
+	if ((idx->file = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		goto err;
+	}
+	/* The header is written again, with nrecords, by rec_index_save() */
+	if (fwrite(&idx->hdr, sizeof(idx->hdr), 1, idx->file) != 1 ||
+	    fwrite(key, 1, key_len, idx->file) != key_len ||
+	    fwrite(zero, 1, (8 - key_len % 8) % 8, idx->file) != (8 - key_len % 8) % 8)
+		goto err;
+
+	return 0;
+
+err:
+	rec_index_free(idx);
+	f[rfd].index = NULL;
+	return -1;
+}
+
+/*
+ * Map the index in path, and check that it is for f[rfd] (as described by
+ * f[rfd].index->hdr) and key. Returns 1 if so; returns 0 if there is no such
+ * file, or it is an index for something else; otherwise, returns -1 and sets
+ * errno as for open(2) or mmap(2), or to EEXIST if path is not an index at
+ * all (so that it is not overwritten).
+ */
+static int
+rec_index_load(int rfd, const char *path, const char *key, size_t key_len)
+{
+	struct rec_index *idx;
+	const struct rec_index_header *hdr;
+	struct stat	 sb;
+	size_t		 first;
+	void		*p;
+	int		 fd, saved_errno;
+
+	idx = f[rfd].index;
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return errno == ENOENT ? 0 : -1;
+	if (fstat(fd, &sb) == -1)
+		goto err;
+	if ((uintmax_t) sb.st_size < sizeof(*hdr) || (uintmax_t) sb.st_size > SIZE_MAX) {
+		errno = EEXIST;
+		goto err;
+	}
+	if ((p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		goto err;
+	close(fd);
+
+	hdr = p;
+	if (hdr->magic != REC_INDEX_MAGIC) {
+		munmap(p, sb.st_size);
+		errno = EEXIST;
+		return -1;
+	}
+	first = sizeof(*hdr) + key_len + (8 - key_len % 8) % 8;
+	if (hdr->size != idx->hdr.size || hdr->mtime_sec != idx->hdr.mtime_sec ||
+	    hdr->mtime_nsec != idx->hdr.mtime_nsec || hdr->ino != idx->hdr.ino ||
+	    hdr->dev != idx->hdr.dev || hdr->key_len != key_len ||
+	    (size_t) sb.st_size < first ||
+	    memcmp((const char *) p + sizeof(*hdr), key, key_len) != 0 ||
+	    ((size_t) sb.st_size - first) % sizeof(*idx->end) != 0 ||
+	    hdr->nrecords != ((size_t) sb.st_size - first) / sizeof(*idx->end)) {
+		/* Stale, so make a new one */
+		munmap(p, sb.st_size);
+		return 0;
+	}
+
+	idx->hdr.nrecords = hdr->nrecords;
+	idx->map = p;
+	idx->map_len = sb.st_size;
+	/* LINTED first is a multiple of 8, and p is page-aligned */
+	idx->end = (const uint64_t *) ((const char *) p + first);
+	posix_madvise(p, sb.st_size, POSIX_MADV_SEQUENTIAL);
+
+	return 1;
+
+err:
+	saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return -1;
+}
+
+/*
+ * rec_next() for an rfd with a valid index.
+ */
+static int
+rec_index_next(struct rec_ctx *ctx, int rfd, struct rec *rec)
+{
+	struct rec_index *idx;
+	uint64_t	 end, len;
+
+	idx = f[rfd].index;
+	if (idx->next == idx->hdr.nrecords) {
+		/* Corrupt index if records are missing at the end */
+		errno = (uint64_t) f[rfd].offset == idx->hdr.size ? 0 : EIO;
+		return -1;
+	}
+
+	end = idx->end[idx->next] & REC_INDEX_END_MAX;
+	if (end <= (uint64_t) f[rfd].offset || end > idx->hdr.size ||
+	    (len = end - f[rfd].offset) > REC_LEN_MAX) {
+		/* Corrupt index */
+		errno = EIO;
+		return -1;
+	}
+
+	if (rec != NULL) {
+		rec->internal_only.info = REC_INFO(len, (int) (idx->end[idx->next] >> REC_INDEX_END_BITS) & REC_DELIM_UNKNOWN, rfd);
+		if ((idx->end[idx->next] & REC_INDEX_LAST) != 0)
+			rec->internal_only.info |= REC_LAST;
+		rec->internal_only.loc.offset = f[rfd].offset;
+		assert(REC_IS_OFFSET(rec));
+		ctx->stats.records_disk++;
+	}
+	ctx->stats.records++;
+	ctx->stats.bytes_read += len;
+	f[rfd].offset = end;
+	idx->next++;
+
+	return 0;
+}
+
+/*
+ * Add the record that rec_next() just found, which ends at f[rfd].offset, to
+ * the index of rfd. If that fails, the index is abandoned, and
+ * rec_index_save() reports the error.
+ */
+static void
+rec_index_add(int rfd, size_t delim_len, int last)
+{
+	struct rec_index *idx;
+	uint64_t	 entry;
+
+	idx = f[rfd].index;
+	if (idx->end != NULL || idx->file == NULL)
+		return;
+
+	if ((uint64_t) f[rfd].offset > REC_INDEX_END_MAX) {
+		errno = EFBIG;
+		goto err;
+	}
+	entry = (uint64_t) f[rfd].offset |
+	    (uint64_t) MIN(delim_len, REC_DELIM_UNKNOWN) << REC_INDEX_END_BITS |
+	    (last ? REC_INDEX_LAST : 0);
+	if (fwrite(&entry, sizeof(entry), 1, idx->file) != 1)
+		goto err;
+	idx->hdr.nrecords++;
+	return;
+
+err:
+	idx->error = errno;
+	fclose(idx->file);
+	idx->file = NULL;
+	unlink(idx->tmp_path);
+}
+
+int
+rec_index_save(int rfd)
+{
+	struct rec_index *idx;
+	int		 saved_errno;
+
+	if ((idx = f[rfd].index) == NULL || idx->end != NULL)
+		return 0;
+	if (idx->file == NULL) {
+		errno = idx->error;
+		return -1;
+	}
+	if ((uint64_t) f[rfd].offset != idx->hdr.size) {
+		/* Not read completely, or the file changed */
+		idx->error = EAGAIN;
+		goto err;
+	}
+
+	if (fflush(idx->file) != 0 || fseeko(idx->file, 0, SEEK_SET) != 0 ||
+	    fwrite(&idx->hdr, sizeof(idx->hdr), 1, idx->file) != 1) {
+		idx->error = errno;
+		goto err;
+	}
+	if (fclose(idx->file) != 0) {
+		idx->file = NULL;
+		idx->error = errno;
+		goto err;
+	}
+	idx->file = NULL;
+	if (rename(idx->tmp_path, idx->path) == -1) {
+		idx->error = errno;
+		goto err;
+	}
+	free(idx->tmp_path);
+	idx->tmp_path = NULL;
+
+	return 0;
+
+err:
+	saved_errno = idx->error;
+	if (idx->file != NULL)
+		fclose(idx->file);
+	idx->file = NULL;
+	unlink(idx->tmp_path);
+	errno = saved_errno;
+	return -1;
+}
+
+void
+rec_stream(int rfd)
+{
+	f[rfd].slurp = 0;
+	f[rfd].stream = 1;
+}
+
+int
+rec_fixed(int rfd, size_t size)
+{
+	assert(f[rfd].index == NULL && f[rfd].offset == 0);
+	if (size == 0 || size > REC_LEN_MAX) {
+		errno = EINVAL;
+		return -1;
+	}
+	f[rfd].fixed = size;
+	if (f[rfd].tmp != f[rfd].fd)
+		/* Not a regular file, so rec_next() splits the data it reads */
+		return 0;
+
+	f[rfd].fixed_direct = 1;
+#ifdef HAVE_PTHREAD
+	if (f[rfd].split != NULL) {
+		/* There is nothing to search for */
+		rec_split_stop(f[rfd].split);
+		f[rfd].split = NULL;
+	}
+#endif
+	if (f[rfd].map_p != NULL && f[rfd].map_offset == 0 &&
+	    f[rfd].map_len == f[rfd].st_size)
+		/* rec_write() will access the mapping randomly */
+		posix_madvise(f[rfd].map_p, f[rfd].map_len, POSIX_MADV_RANDOM);
+	/* Nothing reads the records before rec_write() does */
+	f[rfd].map_prefetch = 1;
+	return 0;
+}
+
+/*
+ * rec_next() for a regular file with fixed-width records: the records are
+ * simply the next f[rfd].fixed bytes of the file.
+ */
+static int
+rec_fixed_next(struct rec_ctx *ctx, int rfd, struct rec *rec)
+{
+	size_t		 len;
+
+	if (f[rfd].offset >= f[rfd].st_size) {
+		errno = 0;
+		return -1;
+	}
+
+	/* LINTED the result is at most f[rfd].fixed */
+	len = MIN((off_t) f[rfd].fixed, f[rfd].st_size - f[rfd].offset);
+	if (rec != NULL) {
+		rec->internal_only.info = REC_INFO(len, 0, rfd);
+		if (f[rfd].offset + (off_t) len == f[rfd].st_size)
+			rec->internal_only.info |= REC_LAST;
+		rec->internal_only.loc.offset = f[rfd].offset;
+		assert(REC_IS_OFFSET(rec));
+		ctx->stats.records_disk++;
+	}
+	ctx->stats.records++;
+	ctx->stats.bytes_read += len;
+	f[rfd].offset += len;
+
+	return 0;
+}
+
+/*
+ * For rec_next_one(): rec_exec() for fixed-width records, which "match" an
+ * empty delimiter after f[rfd].fixed bytes of unprocessed data.
+ */
+static int
+rec_fixed_find(struct rec_ctx *ctx, int rfd)
+{
+	if (f[rfd].buf_last - f[rfd].buf_first_read < f[rfd].fixed)
+		return PCRE2_ERROR_NOMATCH;
+
+	ctx->ovector[0] = ctx->ovector[1] = f[rfd].buf_first_read + f[rfd].fixed;
+	return 1;
+}
+
+/*
+ * Free idx, removing the index it was writing, if any. Does nothing if idx is
+ * NULL.
+ */
+static void
+rec_index_free(struct rec_index *idx)
+{
+	if (idx == NULL)
+		return;
+
+	if (idx->map != NULL)
+		munmap(idx->map, idx->map_len);
+	if (idx->file != NULL) {
+		fclose(idx->file);
+		unlink(idx->tmp_path);
+	}
+	free(idx->tmp_path);
+	free(idx->path);
+	free(idx);
+}
+
+int
+rec_close(struct rec_ctx *ctx, int rfd)
+{
+	int		 i, rv, rv2, rv_errno;
+	void		*tmp;
+
+	rv = 0;
+	rv_errno = 0;
+
+	/* Errors don't matter, since the data is discarded anyway */
+	rec_spool_finish(ctx, rfd);
+	rec_z_free(f[rfd].z);
+	f[rfd].z = NULL;
+	rec_index_free(f[rfd].index);
+	f[rfd].index = NULL;
+
+	if (f[rfd].tmp != -1 && f[rfd].tmp != f[rfd].fd)
+		if ((rv = close(f[rfd].tmp)) != 0)
+			rv_errno = errno;
+
+	/* The decoder thread reads from fd */
+	rec_decode_free(f[rfd].decode);
+	f[rfd].decode = NULL;
+	if ((rv2 = close(f[rfd].fd)) != 0 && rv == 0) {
+		rv = rv2;
+		rv_errno = errno;
+	}
+
+#ifdef HAVE_PTHREAD
+	if (f[rfd].split != NULL) {
+		/* Note that the workers use the mapping */
+		rec_split_stop(f[rfd].split);
+		f[rfd].split = NULL;
+	}
+#endif
+
+	if (f[rfd].map_free != 0) {
+		free(f[rfd].map_p);
+		rec_refund(f[rfd].memory_cache, f[rfd].map_free);
+	} else if (f[rfd].map_p != NULL)
+		munmap(f[rfd].map_p, f[rfd].map_len);
+	else
+		free(f[rfd].buf_p);
+	rec_tmpl_free(f[rfd].default_tmpl);
+	f[rfd].default_tmpl = NULL;
+	f[rfd].offset = -1;
+
+	/* Free re unless another rfd still uses it */
+	for (i = 0; i < f_last && (f[i].offset == -1 || f[i].re != f[rfd].re); i++);
+	if (i == f_last)
+		pcre2_code_free(f[rfd].re);
+
+	assert(f_last > 0);
+	if (rfd == f_last - 1) {
+		for ( ; rfd >= 0 && f[rfd].offset == -1; rfd--);
+		/* Note that rfd points one *past* the last valid rfd */
+		rfd++;
+		assert(rfd >= 0);
+		if (rfd < f_size / 4) {
+			/* Shrink f[] */
+			/* LINTED converting rfd to size_t works */
+			if (rfd == 0) {
+				free(f);
+				f = NULL;
+				f_last = f_size = rfd;
+			} else {
+				if ((tmp = realloc(f, rfd * sizeof(*f)))
+				    != NULL) {
+					f = tmp;
+					f_last = f_size = rfd;
+				}  /* else hold onto a bit more memory than needed */
+			}
+		}
+	}
+
+	if (f_size == 0) {
+		/* Clean up */
+		free(f);
+		f = NULL;
+		assert(f_last == 0);
+	}
+
+	errno = rv_errno;
+	return rv;
+}
+
+void
+rec_assert_released(void)
+{
+	assert(f_size == 0);
+	assert(f_last == 0);
+	assert(memory_used == 0);
+}
+
+static int
+rec_map(int rfd, int *eof)
+{
+	off_t		 start, end, aligned;
+	void		*tmp;
+	size_t		 avail;
+
+	/*
+	 * Discard processed data. Note that buf_first_write is always 0,
+	 * since mapped files are never spooled.
+	 */
+	assert(f[rfd].buf_first_write == 0);
+	start = f[rfd].buf_offset + f[rfd].buf_first_read;
+	avail = f[rfd].buf_last - f[rfd].buf_first_read;
+	assert(start + (off_t) avail <= f[rfd].st_size);
+
+	if (start + (off_t) avail == f[rfd].st_size) {
+		*eof = 1;
+		end = f[rfd].st_size;
+
+		if (f[rfd].map_free == 0 && f[rfd].map_offset == 0 &&
+		    f[rfd].map_len == f[rfd].st_size)
+			/* rec_write() will access the mapping randomly */
+			posix_madvise(f[rfd].map_p, f[rfd].map_len, POSIX_MADV_RANDOM);
+	} else if (avail > REC_BUF_MAX) {
+		/* The record would be too long anyway */
+		errno = ENOMEM;
+		return -1;
+	} else
+		/* Make at least twice as much data visible */
+		end = MIN(f[rfd].st_size, start + MAX(2 * (off_t) avail, REC_MAP_CHUNK));
+
+	if (f[rfd].map_p == NULL || start < f[rfd].map_offset ||
+	    end > f[rfd].map_offset + (off_t) f[rfd].map_len) {
+		/* Slide the mapping */
+		if (f[rfd].map_p != NULL)
+			munmap(f[rfd].map_p, f[rfd].map_len);
+		f[rfd].buf_p = f[rfd].map_p = NULL;
+		f[rfd].buf_size = f[rfd].buf_last = f[rfd].buf_first_read = 0;
+
+		aligned = start - start % sysconf(_SC_PAGESIZE);
+		;; /* LINTED end - aligned is at most 2 * REC_BUF_MAX plus a page */
+		if ((tmp = mmap(NULL, end - aligned, PROT_READ, MAP_PRIVATE, f[rfd].fd, aligned)) == MAP_FAILED)
+			return -1;
+
+		f[rfd].map_p = tmp;
+		f[rfd].map_len = end - aligned;
+		f[rfd].map_offset = aligned;
+		posix_madvise(f[rfd].map_p, f[rfd].map_len, POSIX_MADV_SEQUENTIAL);
+	}
+
+	f[rfd].buf_offset = start;
+	f[rfd].buf_p = &f[rfd].map_p[start - f[rfd].map_offset];
+	f[rfd].buf_first_read = 0;
+	;; /* LINTED this is at most map_len */
+	f[rfd].buf_size = f[rfd].buf_last = f[rfd].map_offset + (off_t) f[rfd].map_len - start;
+	assert(*eof || f[rfd].buf_last > avail);
+
+	return 0;
+}
+
+/*
+ * Run f[rfd].re on p[start] to p[len], storing the result in ovector; returns
+ * as pcre2_match(). Literal delimiters are found with memchr()/memmem(), which
+ * are typically vectorized and much faster than any regex; these ignore
+ * options, and never return PCRE2_ERROR_PARTIAL.
+ */
+static int
+rec_exec(struct rec_ctx *ctx, int rfd, const char *p, size_t len, size_t start, uint32_t options)
+{
+	const char	*match;
+	int		 rv;
+
+	assert(start <= len);
+	if (f[rfd].literal_len == 0) {
+		if (f[rfd].jit) {
+			if ((rv = pcre2_jit_match(f[rfd].re, (PCRE2_SPTR) p, len, start, options, ctx->match_data, ctx->match_context)) != PCRE2_ERROR_JIT_STACKLIMIT &&
+			    rv != PCRE2_ERROR_JIT_BADOPTION)
+				return rv;
+
+			/*
+			 * Out of JIT stack, or not compiled for partial
+			 * matching; the interpreter may do better
+			 */
+			options |= PCRE2_NO_JIT;
+		}
+
+		return pcre2_match(f[rfd].re, (PCRE2_SPTR) p, len, start, options, ctx->match_data, ctx->match_context);
+	}
+
+	if (f[rfd].literal_len == 1)
+		match = memchr(&p[start], f[rfd].literal[0], len - start);
+	else
+		match = memmem(&p[start], len - start, f[rfd].literal, f[rfd].literal_len);
+	if (match == NULL)
+		return PCRE2_ERROR_NOMATCH;
+
+	;; /* LINTED match - p is between start and len */
+	ctx->ovector[0] = match - p;
+	ctx->ovector[1] = ctx->ovector[0] + f[rfd].literal_len;
+	return 1;
+}
+
+/*
+ * Read all of f[rfd].fd into f[rfd].buf_p, unless that would take more than
+ * *f[rfd].memory_cache bytes. If everything fits, the buffer is used as
+ * if it were a mapped file (and no temporary file is needed); otherwise,
+ * the data read so far is processed as usual.
+ *
+ * Returns 0 on success, including if the data does not fit; otherwise,
+ * returns -1 and sets errno as for read(2) or realloc(3). May be called
+ * again after an error.
+ */
+static int
+rec_slurp(int rfd)
+{
+	ssize_t		 nbytes;
+	void		*tmp;
+
+	assert(f[rfd].slurp);
+	assert(f[rfd].buf_first_read == 0 && f[rfd].buf_first_write == 0);
+	for (;;) {
+		if (f[rfd].buf_last == f[rfd].buf_size) {
+			if (f[rfd].buf_size > REC_BUF_MAX ||
+			    2 * f[rfd].buf_size > rec_available(f[rfd].memory_cache)) {
+				/* Does not fit */
+				f[rfd].slurp = 0;
+				return 0;
+			}
+
+			if ((tmp = realloc(f[rfd].buf_p, 2 * f[rfd].buf_size)) == NULL)
+				return -1;
+			f[rfd].buf_p = tmp;
+			f[rfd].buf_size *= 2;
+		}
+
+		if ((nbytes = rec_read(rfd, &f[rfd].buf_p[f[rfd].buf_last], f[rfd].buf_size - f[rfd].buf_last)) == -1)
+			return -1;
+		if (nbytes == 0)
+			break;
+		f[rfd].buf_last += nbytes;
+	}
+
+	/* Everything fits */
+	f[rfd].slurp = 0;
+	if (rec_charge(f[rfd].memory_cache, f[rfd].buf_size) == -1)
+		/* The initial buffer is already too large, or others took it */
+		return 0;
+
+	assert(f[rfd].tmp == -1);
+	f[rfd].tmp = f[rfd].fd;
+	f[rfd].map_p = f[rfd].buf_p;
+	f[rfd].map_free = f[rfd].buf_size;
+	f[rfd].map_len = f[rfd].buf_last;
+	f[rfd].map_offset = f[rfd].buf_offset = 0;
+	;; /* LINTED f[rfd].buf_last fits, since it was read */
+	f[rfd].st_size = f[rfd].buf_last;
+	f[rfd].buf_size = f[rfd].buf_last;
+
+	return 0;
+}
+
+/*
+ * Return REC_DECODE_GZIP or REC_DECODE_ZSTD if the len bytes at magic start
+ * data compressed in that format (and it is supported), -1 if they could, but
+ * more bytes are needed to tell, and 0 otherwise.
+ */
+static int
+rec_decode_type(const unsigned char *magic, size_t len)
+{
+	static const struct {
+		unsigned char	 magic[4];
+		size_t		 len;
+		int		 type;
+	} formats[] = {
+#ifdef HAVE_ZLIB
+		{ { 0x1f, 0x8b }, 2, REC_DECODE_GZIP },
+#endif
+#ifdef HAVE_ZSTD
+		{ { 0x28, 0xb5, 0x2f, 0xfd }, 4, REC_DECODE_ZSTD },
+#endif
+		{ { 0 }, 0, 0 }
+	};
+	size_t		 i;
+	int		 type;
+
+	for (i = 0, type = 0; formats[i].len != 0; i++) {
+		if (memcmp(magic, formats[i].magic, MIN(len, formats[i].len)) != 0)
+			continue;
+		if (len >= formats[i].len)
+			return formats[i].type;
+		type = -1;
+	}
+
+	return type;
+}
+
+/*
+ * Set up the decompressor in d for data of the given type. Returns 0 on
+ * success; otherwise, returns -1 and sets errno to ENOMEM.
+ */
+static int
+rec_decode_init(struct rec_decode *d, int type)
+{
+	d->type = type;
+	switch (type) {
+#ifdef HAVE_ZLIB
+	case REC_DECODE_GZIP:
+		d->zs.zalloc = Z_NULL;
+		d->zs.zfree = Z_NULL;
+		d->zs.opaque = Z_NULL;
+		d->zs.next_in = Z_NULL;
+		d->zs.avail_in = 0;
+		/* Only accept gzip, not zlib, headers */
+		if (inflateInit2(&d->zs, 16 + MAX_WBITS) == Z_OK)
+			return 0;
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case REC_DECODE_ZSTD:
+		if ((d->zd = ZSTD_createDStream()) == NULL)
+			break;
+		if (!ZSTD_isError(ZSTD_initDStream(d->zd)))
+			return 0;
+		ZSTD_freeDStream(d->zd);
+		break;
+#endif
+	default:
+		assert(0);
+		break;
+	}
+
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+ * Free the decompressor set up by rec_decode_init().
+ */
+static void
+rec_decode_end(struct rec_decode *d)
+{
+	switch (d->type) {
+#ifdef HAVE_ZLIB
+	case REC_DECODE_GZIP:
+		inflateEnd(&d->zs);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case REC_DECODE_ZSTD:
+		ZSTD_freeDStream(d->zd);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+
+/*
+ * Check whether the len bytes at p, the start of the input, are data of the
+ * given type; running out of input is fine, since there may be more. Returns
+ * 1 if they are and 0 if they are not; otherwise, returns -1 and sets errno
+ * to ENOMEM.
+ */
+static int
+rec_decode_check(int type, char *p, size_t len)
+{
+	struct rec_decode d;
+	char		*out;
+	ssize_t		 nbytes;
+
+	if ((out = malloc(REC_DECODE_BLOCK)) == NULL)
+		return -1;
+	if (rec_decode_init(&d, type) == -1) {
+		free(out);
+		return -1;
+	}
+	/* rec_decode_run() never read()s, since in_eof is set */
+	d.fd = -1;
+	d.in = p;
+	d.in_first = 0;
+	d.in_last = len;
+	d.in_eof = 1;
+	d.end = 0;
+	while ((nbytes = rec_decode_run(&d, out, REC_DECODE_BLOCK)) > 0);
+	rec_decode_end(&d);
+	free(out);
+
+	/* A truncated stream fails only once all of it was used */
+	return nbytes == 0 || d.in_first == d.in_last;
+}
+
+/*
+ * Set up f[rfd].decode to decompress data of the given type from f[rfd].fd,
+ * which starts with the len bytes at prefix that were already read from it.
+ * Returns 0 on success; otherwise, returns -1 and sets errno to ENOMEM.
+ */
+static int
+rec_decode_start(int rfd, int type, const char *prefix, size_t len)
+{
+	struct rec_decode *d;
+
+	assert(len <= REC_DECODE_BLOCK);
+	if ((d = malloc(sizeof(*d))) == NULL)
+		return -1;
+	if ((d->in = malloc(REC_DECODE_BLOCK)) == NULL) {
+		free(d);
+		return -1;
+	}
+	memcpy(d->in, prefix, len);
+	d->in_first = 0;
+	d->in_last = len;
+	d->in_eof = d->end = 0;
+	d->fd = f[rfd].fd;
+	if (rec_decode_init(d, type) == -1)
+		goto err;
+
+#ifdef HAVE_PTHREAD
+	d->threaded = d->stop = 0;
+	d->len[0] = d->len[1] = d->pos = 0;
+	d->ready[0] = d->ready[1] = d->cur = 0;
+	d->error = 0;
+	d->buf[0] = d->buf[1] = NULL;
+	if ((d->buf[0] = malloc(REC_DECODE_BLOCK)) != NULL &&
+	    (d->buf[1] = malloc(REC_DECODE_BLOCK)) != NULL &&
+	    pthread_mutex_init(&d->mutex, NULL) == 0) {
+		if (pthread_cond_init(&d->cond, NULL) == 0) {
+			if (pthread_create(&d->thread, NULL, rec_decode_worker, d) == 0)
+				d->threaded = 1;
+			else
+				pthread_cond_destroy(&d->cond);
+		}
+		if (!d->threaded)
+			pthread_mutex_destroy(&d->mutex);
+	}
+	if (!d->threaded) {
+		/* Decompress in rec_read() instead */
+		free(d->buf[0]);
+		free(d->buf[1]);
+	}
+#endif
+
+	f[rfd].decode = d;
+	return 0;
+
+err:
+	free(d->in);
+	free(d);
+	errno = ENOMEM;
+	return -1;
+}
+
+/*
+ * Decompress up to n bytes into p. Returns the number of bytes, or 0 at the
+ * end of the input; otherwise, returns -1 and sets errno as for read(2), or to
+ * EIO if the data is corrupt or truncated. May be called again after EINTR or
+ * EAGAIN.
+ */
+static ssize_t
+rec_decode_run(struct rec_decode *d, char *p, size_t n)
+{
+	ssize_t		 nbytes;
+	size_t		 len;
+#ifdef HAVE_ZLIB
+	int		 rv;
+#endif
+#ifdef HAVE_ZSTD
+	ZSTD_inBuffer	 zin;
+	ZSTD_outBuffer	 zout;
+	size_t		 zrv;
+#endif
+
+	assert(n > 0);
+	for (;;) {
+		if (d->in_first == d->in_last && !d->in_eof) {
+			if ((nbytes = read(d->fd, d->in, REC_DECODE_BLOCK)) == -1)
+				return -1;
+			d->in_first = 0;
+			d->in_last = nbytes;
+			d->in_eof = nbytes == 0;
+		}
+		if (d->in_first == d->in_last && d->in_eof && d->end)
+			return 0;
+
+		switch (d->type) {
+#ifdef HAVE_ZLIB
+		case REC_DECODE_GZIP:
+			if (d->end) {
+				/* Another member follows */
+				if (inflateReset(&d->zs) != Z_OK)
+					goto corrupt;
+				d->end = 0;
+			}
+			d->zs.next_in = (Bytef *) &d->in[d->in_first];
+			/* LINTED in holds at most REC_DECODE_BLOCK bytes */
+			d->zs.avail_in = (uInt) (d->in_last - d->in_first);
+			d->zs.next_out = (Bytef *) p;
+			/* LINTED idem */
+			d->zs.avail_out = (uInt) MIN(n, REC_DECODE_BLOCK);
+			len = d->zs.avail_out;
+			rv = inflate(&d->zs, Z_NO_FLUSH);
+			if (rv != Z_OK && rv != Z_STREAM_END && rv != Z_BUF_ERROR)
+				goto corrupt;
+			d->in_first = d->in_last - d->zs.avail_in;
+			len -= d->zs.avail_out;
+			d->end = rv == Z_STREAM_END;
+			break;
+#endif
+#ifdef HAVE_ZSTD
+		case REC_DECODE_ZSTD:
+			zin.src = &d->in[d->in_first];
+			zin.size = d->in_last - d->in_first;
+			zin.pos = 0;
+			zout.dst = p;
+			zout.size = n;
+			zout.pos = 0;
+			if (ZSTD_isError(zrv = ZSTD_decompressStream(d->zd, &zout, &zin)))
+				goto corrupt;
+			d->in_first += zin.pos;
+			len = zout.pos;
+			d->end = zrv == 0;
+			break;
+#endif
+		default:
+			assert(0);
+			goto corrupt;
+		}
+
+		if (len > 0)
+			/* LINTED len is at most n, which fits */
+			return (ssize_t) len;
+		if (d->in_first == d->in_last && d->in_eof)
+			/* Truncated */
+			goto corrupt;
+	}
+
+corrupt:
+	errno = EIO;
+	return -1;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+rec_decode_worker(void *arg)
+{
+	struct rec_decode *d;
+	ssize_t		 nbytes;
+	int		 b, stop;
+
+	d = arg;
+	for (b = 0;; b = !b) {
+		pthread_mutex_lock(&d->mutex);
+		while (d->ready[b] && !d->stop)
+			pthread_cond_wait(&d->cond, &d->mutex);
+		stop = d->stop;
+		pthread_mutex_unlock(&d->mutex);
+		if (stop)
+			break;
+
+		while ((nbytes = rec_decode_run(d, d->buf[b], REC_DECODE_BLOCK)) == -1 &&
+		    (errno == EINTR || errno == EAGAIN));
+
+		pthread_mutex_lock(&d->mutex);
+		if (nbytes == -1) {
+			d->error = errno;
+			nbytes = 0;
+		}
+		/* LINTED nbytes is nonnegative */
+		d->len[b] = (size_t) nbytes;
+		d->ready[b] = 1;
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->mutex);
+		if (nbytes == 0)
+			/* Done, or failed */
+			break;
+	}
+
+	return NULL;
+}
+#endif
+
+/*
+ * Stop the decoder thread, if any, and free d. Does nothing if d is NULL.
+ */
+static void
+rec_decode_free(struct rec_decode *d)
+{
+	if (d == NULL)
+		return;
+
+#ifdef HAVE_PTHREAD
+	if (d->threaded) {
+		pthread_mutex_lock(&d->mutex);
+		d->stop = 1;
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->mutex);
+		pthread_join(d->thread, NULL);
+		pthread_cond_destroy(&d->cond);
+		pthread_mutex_destroy(&d->mutex);
+		free(d->buf[0]);
+		free(d->buf[1]);
+	}
+#endif
+	rec_decode_end(d);
+	free(d->in);
+	free(d);
+}
+
+/*
+ * read(2) up to n bytes of the data of f[rfd] into p, decompressing it if
+ * f[rfd].decode is not NULL.
+ */
+static ssize_t
+rec_read(int rfd, char *p, size_t n)
+{
+	struct rec_decode *d;
+#ifdef HAVE_PTHREAD
+	size_t		 len;
+#endif
+
+	if ((d = f[rfd].decode) == NULL)
+		return read(f[rfd].fd, p, n);
+
+#ifdef HAVE_PTHREAD
+	if (d->threaded) {
+		pthread_mutex_lock(&d->mutex);
+		while (!d->ready[d->cur])
+			pthread_cond_wait(&d->cond, &d->mutex);
+		pthread_mutex_unlock(&d->mutex);
+
+		if (d->len[d->cur] == 0) {
+			if (d->error == 0)
+				return 0;
+			errno = d->error;
+			return -1;
+		}
+		len = MIN(n, d->len[d->cur] - d->pos);
+		memcpy(p, &d->buf[d->cur][d->pos], len);
+		if ((d->pos += len) == d->len[d->cur]) {
+			/* Hand the buffer back */
+			pthread_mutex_lock(&d->mutex);
+			d->ready[d->cur] = 0;
+			pthread_cond_broadcast(&d->cond);
+			pthread_mutex_unlock(&d->mutex);
+			d->cur = !d->cur;
+			d->pos = 0;
+		}
+		/* LINTED len is at most n, which fits */
+		return (ssize_t) len;
+	}
+#endif
+
+	return rec_decode_run(d, p, n);
+}
+
+/*
+ * Write f[rfd].buf_p[f[rfd].buf_first_write] to
+ * f[rfd].buf_p[f[rfd].buf_first_read] to the temporary file (creating it if
+ * needed). Returns 0 on success; otherwise, returns -1 and sets errno as for
+ * rec_spool_open() or write(2).
+ */
+static int
+rec_flush(struct rec_ctx *ctx, int rfd)
+{
+	struct rec_spool *s;
+	size_t		 len;
+	ssize_t		 nbytes;
+
+	assert(f[rfd].tmp != f[rfd].fd);
+	if (f[rfd].tmp == -1 &&
+	    f[rfd].buf_first_write < f[rfd].buf_first_read &&
+	    rec_spool_open(ctx, rfd) == -1)
+		return -1;
+	if ((s = f[rfd].spool) != NULL) {
+		/* Leave the writing to rec_spool_write() */
+		while (f[rfd].buf_first_write < f[rfd].buf_first_read) {
+			len = MIN(f[rfd].buf_first_read - f[rfd].buf_first_write, REC_SPOOL_BLOCK - s->len[s->fill]);
+			memcpy(&s->buf[s->fill][s->len[s->fill]], &f[rfd].buf_p[f[rfd].buf_first_write], len);
+			s->len[s->fill] += len;
+			f[rfd].buf_first_write += len;
+			if (s->len[s->fill] == REC_SPOOL_BLOCK && rec_spool_submit(s) == -1)
+				return -1;
+		}
+		return 0;
+	}
+	assert(f[rfd].z == NULL || f[rfd].buf_first_write == f[rfd].buf_first_read);
+	for (nbytes = 0;
+	     f[rfd].buf_first_write < f[rfd].buf_first_read;
+	     nbytes = write(f[rfd].tmp, &f[rfd].buf_p[f[rfd].buf_first_write], f[rfd].buf_first_read - f[rfd].buf_first_write)) {
+		if (nbytes == -1)
+			return -1;
+
+		assert(nbytes >= 0);
+		f[rfd].buf_first_write += nbytes;
+		ctx->stats.bytes_spooled += nbytes;
+	}
+	assert(f[rfd].buf_first_write == f[rfd].buf_first_read);
+
+	return 0;
+}
+
+int
+rec_next(struct rec_ctx *ctx, int rfd, struct rec *rec)
+{
+	if (rec_ctx_match(ctx, rfd) == -1)
+		return -1;
+
+	return rec_next_one(ctx, rfd, rec, 1);
+}
+
+ssize_t
+rec_next_batch(struct rec_ctx *ctx, int rfd, struct rec *recs, size_t max)
+{
+	size_t		 n;
+	int		 rv;
+
+	assert(max > 0);
+	if (rec_ctx_match(ctx, rfd) == -1)
+		return -1;
+
+#ifdef HAVE_PTHREAD
+	if (f[rfd].split != NULL) {
+		/* The workers have done the searching already */
+		for (n = 0; n < max; n++)
+			if (rec_split_next(ctx, rfd, &recs[n]) == -1)
+				break;
+		/* LINTED n is at most max, which is a valid array size */
+		return n > 0 ? (ssize_t) n : -1;
+	}
+#endif
+
+	/* Only the first record may need more data */
+	rv = 0;
+	for (n = 0; n < max && (rv = rec_next_one(ctx, rfd, &recs[n], n == 0)) == 0; n++);
+	assert(n > 0 || rv == -1);
+	/* Any error will happen again on the next call */
+	/* LINTED idem */
+	return n > 0 ? (ssize_t) n : -1;
+}
+
+ssize_t
+rec_skip(struct rec_ctx *ctx, int rfd, uint64_t n)
+{
+	struct rec_index *idx;
+	uint64_t	 i, end;
+	int		 rv;
+
+	assert(n > 0);
+	/* LINTED the result must fit */
+	n = MIN(n, SSIZE_MAX);
+	if ((idx = f[rfd].index) != NULL && idx->end != NULL) {
+		/* Just skip to the last one */
+		if (idx->next == idx->hdr.nrecords)
+			return rec_index_next(ctx, rfd, NULL);
+		n = MIN(n, idx->hdr.nrecords - idx->next);
+		end = idx->end[idx->next + n - 1] & REC_INDEX_END_MAX;
+		if (end <= (uint64_t) f[rfd].offset || end > idx->hdr.size) {
+			/* Corrupt index */
+			errno = EIO;
+			return -1;
+		}
+		ctx->stats.records += n;
+		ctx->stats.bytes_read += end - f[rfd].offset;
+		f[rfd].offset = end;
+		idx->next += n;
+		/* LINTED n fits, see above */
+		return (ssize_t) n;
+	}
+	if (f[rfd].fixed_direct) {
+		/* Skip to the last one, which may be short */
+		if (f[rfd].offset >= f[rfd].st_size) {
+			errno = 0;
+			return -1;
+		}
+		/* LINTED the number of records left fits */
+		n = MIN(n, (uint64_t) ((f[rfd].st_size - f[rfd].offset - 1) / f[rfd].fixed + 1));
+		end = MIN((uint64_t) f[rfd].offset + n * f[rfd].fixed, (uint64_t) f[rfd].st_size);
+		ctx->stats.records += n;
+		ctx->stats.bytes_read += end - f[rfd].offset;
+		f[rfd].offset = end;
+		/* LINTED idem */
+		return (ssize_t) n;
+	}
+
+	if (rec_ctx_match(ctx, rfd) == -1)
+		return -1;
+
+	/* As for rec_next_batch() */
+	rv = 0;
+	for (i = 0; i < n && (rv = rec_next_one(ctx, rfd, NULL, i == 0)) == 0; i++);
+	assert(i > 0 || rv == -1);
+	/* LINTED i fits, see above */
+	return i > 0 ? (ssize_t) i : -1;
+}
+
+/*
+ * rec_next(), assuming that ctx->match_data is large enough. If fill is 0,
+ * the record must be found in the data that is already available; if that
+ * would require reading (or mapping) more data, returns 1 instead, and
+ * rec_next_one() can simply be called again with fill set.
+ */
+static int
+rec_next_one(struct rec_ctx *ctx, int rfd, struct rec *rec, int fill)
+{
+	void		*tmp;
+	char		*p;
+	ssize_t		 nbytes;
+	size_t		 rec_len, delim_len;
+	uint64_t	 info;
+	int		 rv, eof;
+	PCRE2_SIZE	*ovector;
+
+	/*
+	 * Look for regular expression.
+	 *
+	 * Read the documentation for f[rfd].buf_p before trying to understand
+	 * this code.
+	 */
+	if (f[rfd].index != NULL && f[rfd].index->end != NULL)
+		return rec_index_next(ctx, rfd, rec);
+	if (f[rfd].fixed_direct)
+		return rec_fixed_next(ctx, rfd, rec);
+#ifdef HAVE_PTHREAD
+	if (f[rfd].split != NULL)
+		return rec_split_next(ctx, rfd, rec);
+#endif
+	if (f[rfd].slurp) {
+		if (!fill)
+			return 1;
+		if (rec_slurp(rfd) == -1)
+			goto err;
+	}
+	ovector = ctx->ovector;
+
+	/*
+	 * Until the end of the file, ask for partial matches: a delimiter at the
+	 * end of the data may continue in the data that has not been read yet,
+	 * and the search resumes at the start of the partial match (or, if
+	 * there was no match at all, at the end of the data) instead of
+	 * rescanning the whole record. At the end of the file, just search all
+	 * unprocessed data once more; lookbehind and the like never make that
+	 * wrong.
+	 */
+	eof = 0;
+	delim_len = SIZE_MAX;
+	while ((rv = f[rfd].fixed != 0 ? rec_fixed_find(ctx, rfd) :
+	    rec_exec(ctx, rfd, f[rfd].buf_p, f[rfd].buf_last, f[rfd].buf_first_read + (eof ? 0 : f[rfd].buf_scan), eof ? 0 : PCRE2_NOTEOL | PCRE2_PARTIAL_HARD)) < 0) {
+		if (rv == PCRE2_ERROR_PARTIAL) {
+			assert(!eof && ovector[0] >= f[rfd].buf_first_read);
+			f[rfd].buf_scan = ovector[0] - f[rfd].buf_first_read;
+		} else if (rv != PCRE2_ERROR_NOMATCH) {
+			errno = EINVAL;
+			goto err;
+		} else if (!eof) {
+			/* A literal may still start in its last few bytes */
+			f[rfd].buf_scan = f[rfd].buf_last - f[rfd].buf_first_read;
+			if (f[rfd].literal_len != 0)
+				f[rfd].buf_scan -= MIN(f[rfd].buf_scan, (size_t) f[rfd].literal_len - 1);
+		}
+
+		if (eof) {
+			if (f[rfd].buf_first_read < f[rfd].buf_last) {
+				/* Unterminated final record */
+				ovector[0] = f[rfd].buf_first_read;
+				ovector[1] = f[rfd].buf_last;
+				delim_len = 0;
+				break;
+			}
+
+			/*
+			 * All data processed - everything should have been
+			 * flushed to disk. Notify the caller of EOF.
+			 */
+			assert(f[rfd].buf_first_read == 0);
+			assert(f[rfd].buf_last == 0);
+			if (rec_spool_finish(ctx, rfd) == -1)
+				goto err;
+
+			errno = 0;
+			goto err;
+		}
+
+		/*
+		 * Get more data
+		 */
+		if (!fill)
+			return 1;
+		assert(f[rfd].buf_first_read >= f[rfd].buf_first_write);
+		assert(f[rfd].buf_last >= f[rfd].buf_first_read);
+		assert(f[rfd].buf_size >= f[rfd].buf_last);
+		if (f[rfd].map_p != NULL) {
+			/* Mapped file, so there is nothing to copy */
+			if (rec_map(rfd, &eof) == -1)
+				goto err;
+			continue;
+		}
+		if (f[rfd].tmp != f[rfd].fd) {
+			/* Flush processed data to disk */
+			if (rec_flush(ctx, rfd) == -1)
+				goto err;
+		} else
+			assert(f[rfd].buf_first_write == 0);
+
+		if (f[rfd].buf_size - (f[rfd].buf_last - f[rfd].buf_first_read) >= MAX(f[rfd].buf_size / 4, REC_READ_MIN)) {
+			/* Just move unprocessed data to front */
+			bcopy(&f[rfd].buf_p[f[rfd].buf_first_read], f[rfd].buf_p, f[rfd].buf_last - f[rfd].buf_first_read);
+		} else {
+			/* Enlarge buffer */
+			if (f[rfd].buf_size > REC_BUF_MAX) {
+				/* The record would be too long anyway */
+				errno = ENOMEM;
+				goto err;
+			}
+
+			if ((tmp = malloc(f[rfd].buf_size * 2)) == NULL)
+				goto err;
+
+			memcpy(tmp, &f[rfd].buf_p[f[rfd].buf_first_read], f[rfd].buf_last - f[rfd].buf_first_read);
+
+			free(f[rfd].buf_p);
+			f[rfd].buf_p = tmp;
+			f[rfd].buf_size *= 2;
+		}
+		f[rfd].buf_last -= f[rfd].buf_first_read;
+		f[rfd].buf_first_write = f[rfd].buf_first_read = 0;
+		assert(f[rfd].buf_size > f[rfd].buf_last);
+
+		/* Read additional data */
+		if ((nbytes = rec_read(rfd, &f[rfd].buf_p[f[rfd].buf_last], f[rfd].buf_size - f[rfd].buf_last)) == -1)
+			goto err;
+		if (nbytes == 0)
+			eof = 1;
+		f[rfd].buf_last += nbytes;
+	}
+
+	assert(ovector[0] >= f[rfd].buf_first_read);
+	assert(ovector[1] >= ovector[0]);
+	assert(f[rfd].buf_last >= ovector[1]);
+	
+	if (ovector[1] == ovector[0] && f[rfd].fixed == 0) {
+		/* Zero-length match! This would result in an endless loop */
+		errno = EINVAL;
+		goto err;
+	}
+
+	rec_len = ovector[1] - f[rfd].buf_first_read;
+	if (delim_len == SIZE_MAX)
+		delim_len = ovector[1] - ovector[0];
+	if (rec_len > REC_LEN_MAX) {
+		/* Limited by the length in struct rec */
+		errno = ENOMEM;
+		goto err;
+	}
+	if (rec != NULL) {
+		/* rec is only filled in once it is certain that we succeed */
+		info = REC_INFO(rec_len, delim_len, rfd);
+		if (eof)
+			info |= REC_LAST;
+
+		if (f[rfd].fd != f[rfd].tmp &&
+		    f[rfd].buf_first_read == f[rfd].buf_first_write &&
+		    (p = rec_alloc(ctx, rfd, rec_len)) != NULL) {
+			/* Keep record in memory */
+			memcpy(p, &f[rfd].buf_p[f[rfd].buf_first_read], rec_len);
+			/* Don't write it to disk */
+			f[rfd].buf_first_write += rec_len;
+			rec->internal_only.loc.p = p;
+			/* Mark as in-memory record */
+			rec->internal_only.info = info | REC_MEM;
+			assert(!REC_IS_OFFSET(rec));
+		} else if (f[rfd].stream && f[rfd].fd != f[rfd].tmp) {
+			/* Leave the record be until there is room for it */
+			errno = ENOBUFS;
+			goto err;
+		} else {
+			assert(f[rfd].map_p == NULL || f[rfd].offset == f[rfd].buf_offset + f[rfd].buf_first_read);
+			rec->internal_only.loc.offset = f[rfd].offset;
+			rec->internal_only.info = info;
+			assert(REC_IS_OFFSET(rec));
+			f[rfd].offset += rec_len;
+		}
+		assert(REC_LEN(rec) == rec_len);
+		assert(&REC_F(rec) == &f[rfd]);
+	} else if (f[rfd].fd != f[rfd].tmp) {
+		/*
+		 * Don't write it to disk; to make that possible, flush any
+		 * processed data before it first.
+		 */
+		if (f[rfd].buf_first_write < f[rfd].buf_first_read &&
+		    rec_flush(ctx, rfd) == -1)
+			goto err;
+		f[rfd].buf_first_write += rec_len;
+	} else
+		f[rfd].offset += rec_len;
+
+	assert(f[rfd].buf_first_read + rec_len == ovector[1]);
+	f[rfd].buf_first_read = ovector[1];
+	f[rfd].buf_scan = 0;
+	assert(f[rfd].buf_first_write <= f[rfd].buf_first_read);
+
+	ctx->stats.records++;
+	ctx->stats.bytes_read += rec_len;
+	if (f[rfd].index != NULL)
+		rec_index_add(rfd, delim_len, eof);
+	if (rec != NULL) {
+		/* Note that slurped input is in memory as a whole */
+		if (REC_IS_OFFSET(rec) && f[rfd].map_free == 0)
+			ctx->stats.records_disk++;
+		else
+			ctx->stats.records_mem++;
+	}
+
+	return 0;
+
+err:
+	return -1;
+}
+
+/*
+ * Returns a pointer to the REC_LEN(rec) bytes of data in rec, which is valid
+ * until the next call to this function with the same ctx. Otherwise, returns
+ * NULL and puts an error message in ctx->errstr.
+ */
+static const char *
+rec_data(struct rec_ctx *ctx, const struct rec *rec)
+{
+	const char	*p;
+	ssize_t		 nbytes;
+	size_t		 i;
+
+	if (!REC_IS_OFFSET(rec))
+		/* Already in memory */
+		p = REC_P(rec);
+	else if (REC_F(rec).map_p != NULL &&
+	    REC_OFFSET(rec) >= REC_F(rec).map_offset &&
+	    REC_OFFSET(rec) + REC_LEN(rec) <= REC_F(rec).map_offset + (off_t) REC_F(rec).map_len)
+		/* Mapped, so use the data in place */
+		p = &REC_F(rec).map_p[REC_OFFSET(rec) - REC_F(rec).map_offset];
+	else if (REC_F(rec).tmp != REC_F(rec).fd &&
+	    REC_OFFSET(rec) >= REC_F(rec).offset - (off_t) (REC_F(rec).buf_first_read - REC_F(rec).buf_first_write))
+		/*
+		 * Not flushed to the temporary file yet; buf_p[buf_first_read]
+		 * corresponds to offset.
+		 */
+		p = &REC_F(rec).buf_p[REC_F(rec).buf_first_read - (REC_F(rec).offset - REC_OFFSET(rec))];
+	else if (REC_F(rec).z != NULL)
+		/* Compressed temporary file */
+		p = rec_z_data(ctx, REC_F_IDX(rec), REC_OFFSET(rec), REC_LEN(rec));
+	else {
+		if (rec_spool_sync(REC_F_IDX(rec)) == -1) {
+			snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to write temporary file: %s", strerror(errno));
+			return NULL;
+		}
+
+		/* Read into w_buf */
+		if (rec_w_buf(ctx, REC_LEN(rec)) == -1)
+			return NULL;
+
+		for (i = 0; i < REC_LEN(rec); i += nbytes) {
+			if ((nbytes = pread(REC_F(rec).tmp, &ctx->w_buf[i], REC_LEN(rec) - i, REC_OFFSET(rec) + i)) == -1) {
+				snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to read record from file: %s", strerror(errno));
+				return NULL;
+			}
+
+			assert(nbytes >= 0);
+			ctx->stats.preads++;
+			ctx->stats.pread_bytes += nbytes;
+		}
+		assert(i == REC_LEN(rec));
+
+		p = ctx->w_buf;
+	}
+
+	return p;
+}
+
+/*
+ * Make sure that ctx->w_buf can hold len bytes. Returns 0 on success;
+ * otherwise, returns -1 and sets ctx->errstr.
+ */
+static int
+rec_w_buf(struct rec_ctx *ctx, size_t len)
+{
+	void		*tmp;
+	size_t		 new_len;
+
+	if (ctx->w_buf_size >= len)
+		return 0;
+
+	for (new_len = ctx->w_buf_size != 0 ? ctx->w_buf_size : BUFSIZ;
+	     new_len < len;
+	     new_len *= 2);
+	if ((tmp = realloc(ctx->w_buf, new_len)) == NULL) {
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to allocate buffer space: %s", strerror(errno));
+		return -1;
+	}
+
+	ctx->w_buf = tmp;
+	ctx->w_buf_size = new_len;
+
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * Start splitting f[rfd] in parallel, if that is possible and worthwhile.
+ * Otherwise, or if no threads can be created, f[rfd] is processed by
+ * rec_next() as usual.
+ */
+static void
+rec_split_start(int rfd)
+{
+	struct rec_split *s;
+	int		 i, len;
+
+	if (split_threads < 2 || f[rfd].split != NULL ||
+	    f[rfd].map_p == NULL || f[rfd].map_free != 0 ||
+	    f[rfd].map_offset != 0 || (off_t) f[rfd].map_len != f[rfd].st_size ||
+	    f[rfd].st_size < 2 * REC_SPLIT_CHUNK ||
+	    (len = f[rfd].literal_len) == 0)
+		return;
+
+	/* Check that occurrences of the literal cannot overlap */
+	for (i = 1; i < len; i++)
+		/* LINTED len - i is positive */
+		if (memcmp(f[rfd].literal, &f[rfd].literal[i], len - i) == 0)
+			return;
+
+	if ((s = malloc(sizeof(*s))) == NULL)
+		return;
+	s->p = f[rfd].map_p;
+	s->size = f[rfd].st_size;
+	/* LINTED len is at most REC_LITERAL_MAX */
+	memcpy(s->literal, f[rfd].literal, len);
+	s->literal_len = len;
+	s->stop = 0;
+	/* LINTED the number of chunks fits, since the file is mapped */
+	s->nchunks = (f[rfd].st_size + REC_SPLIT_CHUNK - 1) / REC_SPLIT_CHUNK;
+	s->claimed = s->consumed = s->pos = 0;
+	s->ready = 0;
+	/* LINTED split_threads is positive */
+	s->nthreads = MIN(split_threads, s->nchunks);
+	/* LINTED idem */
+	s->nslots = REC_SPLIT_AHEAD * s->nthreads;
+	if ((s->thread = malloc(s->nthreads * sizeof(*s->thread))) == NULL) {
+		free(s);
+		return;
+	}
+	if ((s->slot = calloc(s->nslots, sizeof(*s->slot))) == NULL) {
+		free(s->thread);
+		free(s);
+		return;
+	}
+	if (pthread_mutex_init(&s->mutex, NULL) != 0) {
+		free(s->slot);
+		free(s->thread);
+		free(s);
+		return;
+	}
+	if (pthread_cond_init(&s->cond, NULL) != 0) {
+		pthread_mutex_destroy(&s->mutex);
+		free(s->slot);
+		free(s->thread);
+		free(s);
+		return;
+	}
+
+	for (i = 0; i < s->nthreads; i++)
+		if (pthread_create(&s->thread[i], NULL, rec_split_worker, s) != 0)
+			break;
+	s->nthreads = i;
+	if (s->nthreads == 0) {
+		rec_split_stop(s);
+		return;
+	}
+
+	f[rfd].split = s;
+	/* Workers read different parts of the file at once */
+	posix_madvise(f[rfd].map_p, f[rfd].map_len, POSIX_MADV_NORMAL);
+}
+
+static void *
+rec_split_worker(void *arg)
+{
+	struct rec_split *s;
+	struct rec_split_chunk *chunk;
+	const char	*p, *q;
+	void		*tmp;
+	size_t		 i, len, avail, new_size;
+
+	s = arg;
+	pthread_mutex_lock(&s->mutex);
+	for (;;) {
+		while (!s->stop && s->claimed < s->nchunks &&
+		    s->claimed >= s->consumed + s->nslots)
+			pthread_cond_wait(&s->cond, &s->mutex);
+		if (s->stop || s->claimed == s->nchunks)
+			break;
+
+		i = s->claimed++;
+		chunk = &s->slot[i % s->nslots];
+		assert(!chunk->done);
+		pthread_mutex_unlock(&s->mutex);
+
+		/*
+		 * Find all matches starting in p[0] to p[len]; the last one
+		 * may extend up to p[avail].
+		 */
+		p = &s->p[(off_t) i * REC_SPLIT_CHUNK];
+		/* LINTED the result of MIN() fits in a size_t */
+		len = MIN(REC_SPLIT_CHUNK, s->size - (off_t) i * REC_SPLIT_CHUNK);
+		/* LINTED idem */
+		avail = MIN(len + s->literal_len - 1, s->size - (off_t) i * REC_SPLIT_CHUNK);
+		chunk->n = 0;
+		chunk->error = 0;
+		for (q = p; q < &p[len]; q += s->literal_len) {
+			/* LINTED &p[avail] - q is positive */
+			if (s->literal_len == 1)
+				q = memchr(q, s->literal[0], &p[avail] - q);
+			else
+				q = memmem(q, &p[avail] - q, s->literal, s->literal_len);
+			if (q == NULL || q >= &p[len])
+				break;
+
+			if (chunk->n == chunk->size) {
+				new_size = chunk->size != 0 ? 2 * chunk->size : 1024;
+				if ((tmp = realloc(chunk->end, new_size * sizeof(*chunk->end))) == NULL) {
+					chunk->error = errno;
+					break;
+				}
+				chunk->end = tmp;
+				chunk->size = new_size;
+			}
+			/* LINTED this is at most REC_SPLIT_CHUNK + REC_LITERAL_MAX */
+			chunk->end[chunk->n++] = q - p + s->literal_len;
+		}
+
+		pthread_mutex_lock(&s->mutex);
+		chunk->done = 1;
+		pthread_cond_broadcast(&s->cond);
+	}
+	pthread_mutex_unlock(&s->mutex);
+
+	return NULL;
+}
+
+/*
+ * rec_next() for f[rfd].split != NULL.
+ */
+static int
+rec_split_next(struct rec_ctx *ctx, int rfd, struct rec *rec)
+{
+	struct rec_split *s;
+	struct rec_split_chunk *chunk;
+	off_t		 end;
+	int		 last;
+
+	s = f[rfd].split;
+	for (;;) {
+		if (s->consumed == s->nchunks) {
+			/* Anything left is an unterminated final record */
+			if (f[rfd].offset == s->size) {
+				errno = 0;
+				return -1;
+			}
+			end = s->size;
+			last = 1;
+			/* rec_write() will access the mapping randomly */
+			posix_madvise(f[rfd].map_p, f[rfd].map_len, POSIX_MADV_RANDOM);
+			break;
+		}
+
+		chunk = &s->slot[s->consumed % s->nslots];
+		if (!s->ready) {
+			pthread_mutex_lock(&s->mutex);
+			while (!chunk->done)
+				pthread_cond_wait(&s->cond, &s->mutex);
+			pthread_mutex_unlock(&s->mutex);
+			if (chunk->error != 0) {
+				errno = chunk->error;
+				return -1;
+			}
+			s->ready = 1;
+		}
+
+		if (s->pos < chunk->n) {
+			end = (off_t) s->consumed * REC_SPLIT_CHUNK + chunk->end[s->pos++];
+			last = 0;
+			break;
+		}
+
+		/* On to the next chunk */
+		pthread_mutex_lock(&s->mutex);
+		chunk->done = 0;
+		s->consumed++;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->mutex);
+		s->ready = 0;
+		s->pos = 0;
+	}
+
+	assert(end > f[rfd].offset);
+	if ((uintmax_t) (end - f[rfd].offset) > REC_LEN_MAX) {
+		/* Limited by the length in struct rec */
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (rec != NULL) {
+		rec->internal_only.info = REC_INFO(end - f[rfd].offset, last ? 0 : s->literal_len, rfd);
+		if (last)
+			rec->internal_only.info |= REC_LAST;
+		rec->internal_only.loc.offset = f[rfd].offset;
+		assert(REC_IS_OFFSET(rec));
+		assert(&REC_F(rec) == &f[rfd]);
+		ctx->stats.records_disk++;
+	}
+	ctx->stats.records++;
+	ctx->stats.bytes_read += end - f[rfd].offset;
+	f[rfd].offset = end;
+	if (f[rfd].index != NULL)
+		rec_index_add(rfd, last ? 0 : s->literal_len, last);
+
+	return 0;
+}
+
+/*
+ * Stop all worker threads and free s.
+ */
+static void
+rec_split_stop(struct rec_split *s)
+{
+	size_t		 i;
+	int		 j;
+
+	pthread_mutex_lock(&s->mutex);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->mutex);
+	for (j = 0; j < s->nthreads; j++)
+		pthread_join(s->thread[j], NULL);
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->mutex);
+	for (i = 0; i < s->nslots; i++)
+		free(s->slot[i].end);
+	free(s->slot);
+	free(s->thread);
+	free(s);
+}
+#endif
+
+void
+rec_set_threads(int threads)
+{
+	assert(threads > 0);
+#ifdef HAVE_PTHREAD
+	split_threads = threads;
+#endif
+}
+
+int
+rec_set_compress(int compress)
+{
+#ifdef HAVE_LZ4
+	tmp_compress = compress;
+	return 0;
+#else
+	if (!compress)
+		return 0;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int
+rec_set_decompress(int decompress)
+{
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+	decompress_input = decompress;
+	return 0;
+#else
+	if (!decompress)
+		return 0;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int
+rec_set_memfd(int memfd)
+{
+#ifdef HAVE_MEMFD_CREATE
+	tmp_memfd = memfd;
+	return 0;
+#else
+	if (!memfd)
+		return 0;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+void
+rec_get_stats(const struct rec_ctx *ctx, struct rec_stats *st)
+{
+	struct rec_spool_stats spool;
+	int		 i;
+
+	*st = ctx->stats;
+	rec_lock();
+	st->memory_used = memory_used;
+	st->memory_peak = memory_peak;
+	/* Add the temporary files that ctx is still writing */
+	for (i = 0; i < f_last; i++) {
+		/* Note that closed rfds have no spool */
+		if (f[i].spool == NULL || f[i].spool->ctx != ctx)
+			continue;
+#ifdef HAVE_PTHREAD
+		if (f[i].spool->threaded) {
+			pthread_mutex_lock(&f[i].spool->mutex);
+			spool = f[i].spool->stats;
+			pthread_mutex_unlock(&f[i].spool->mutex);
+		} else
+#endif
+			spool = f[i].spool->stats;
+		st->bytes_spooled += spool.bytes;
+		st->spool_wall += spool.wall;
+		st->spool_cpu += spool.cpu;
+		st->spool_wait += spool.wait;
+	}
+	rec_unlock();
+}
+
+/*
+ * Return the time on clock, in seconds.
+ */
+static double
+rec_clock(clockid_t clock)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(clock, &ts) == -1)
+		return 0;
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char *
+rec_write(struct rec_ctx *ctx, const struct rec *rec, const char *delim, FILE *file)
+{
+	const struct rec_tmpl *tmpl;
+
+	if (rec_ctx_match(ctx, REC_F_IDX(rec)) == -1) {
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to allocate memory: %s", strerror(errno));
+		return ctx->errstr;
+	}
+	if (delim == NULL)
+		tmpl = REC_F(rec).default_tmpl;
+	else if ((tmpl = rec_tmpl_get(ctx, delim)) == NULL)
+		return ctx->errstr;
+
+	return rec_write_one(ctx, rec, tmpl, file);
+}
+
+const char *
+rec_write_batch(struct rec_ctx *ctx, const struct rec *recs, size_t n, const char *delim, FILE *file, size_t *written)
+{
+	const struct rec_tmpl *tmpl;
+	const char	*errstr;
+	size_t		 i;
+	int		 rfd;
+
+	*written = 0;
+	tmpl = NULL;
+	if (delim != NULL && (tmpl = rec_tmpl_get(ctx, delim)) == NULL)
+		return ctx->errstr;
+
+	/* Ask for records to be read in before we need them */
+	for (i = 0; i < MIN(n, REC_PREFETCH); i++)
+		rec_prefetch(&recs[i]);
+	for (i = 0, rfd = -1; i < n; i++) {
+		if (i + REC_PREFETCH < n)
+			rec_prefetch(&recs[i + REC_PREFETCH]);
+		if (REC_F_IDX(&recs[i]) != rfd) {
+			rfd = REC_F_IDX(&recs[i]);
+			if (rec_ctx_match(ctx, rfd) == -1) {
+				snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to allocate memory: %s", strerror(errno));
+				return ctx->errstr;
+			}
+		}
+		if ((errstr = rec_write_one(ctx, &recs[i], delim == NULL ? REC_F(&recs[i]).default_tmpl : tmpl, file)) != NULL)
+			return errstr;
+		*written = i + 1;
+	}
+
+	return NULL;
+}
+
+/*
+ * rec_write() with a compiled template, assuming that ctx->match_data is large
+ * enough.
+ */
+static const char *
+rec_write_one(struct rec_ctx *ctx, const struct rec *rec, const struct rec_tmpl *tmpl, FILE *file)
+{
+	const char	*p;
+	PCRE2_SIZE	*ovector;
+	int		 ovector_valid;
+
+	assert(tmpl != NULL);
+	assert(ctx->ovector_count >= REC_F(rec).ovector_count);
+	if (tmpl->error[0] != '\0') {
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "%s", tmpl->error);
+		goto err;
+	}
+
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+	switch (rec_write_copy(ctx, rec, tmpl, file)) {
+	case 0:
+		return NULL;
+	case 1:
+		/* Do it ourselves */
+		break;
+	default:
+		goto err;
+	}
+#endif
+
+	if ((p = rec_data(ctx, rec)) == NULL)
+		goto err;
+
+	/*
+	 * We have REC_LEN(rec) bytes of data starting at p.
+	 *
+	 * If delim refers to subpatterns, re-run the regular expression to get
+	 * them; otherwise, the match we found in rec_next() suffices (unless
+	 * it was too long to store).
+	 */
+	ovector = ctx->ovector;
+	if (REC_DELIM_LEN(rec) != REC_DELIM_UNKNOWN && (!tmpl->refs || REC_F(rec).fixed != 0)) {
+		/* Fixed-width records all end in an empty delimiter */
+		ovector[0] = REC_LEN(rec) - REC_DELIM_LEN(rec);
+		ovector[1] = REC_LEN(rec);
+		ovector_valid = REC_DELIM_LEN(rec) != 0 || REC_F(rec).fixed != 0 ? 1 : 0;
+		assert(ovector_valid || REC_IS_LAST(rec));
+	} else if ((ovector_valid = rec_exec(ctx, REC_F_IDX(rec), p, REC_LEN(rec), 0, REC_IS_LAST(rec) ? 0 : PCRE2_NOTEOL)) < 0) {
+		/* Unterminated final record */
+		assert(ovector_valid == PCRE2_ERROR_NOMATCH);
+		assert(REC_IS_LAST(rec));
+
+		ovector_valid = 0;
+		ovector[0] = ovector[1] = REC_LEN(rec);
+	} else {
+		assert(ovector_valid >= 1);
+		assert(ovector[1] == REC_LEN(rec));
+	}
+
+	/* Output anything prior to match, and the template */
+	return rec_tmpl_write(ctx, tmpl, 0, p, ovector[0], ovector_valid, file);
+
+err:
+	return ctx->errstr;
+}
+
+#if defined(HAVE_COPY_FILE_RANGE) || defined(HAVE_SENDFILE)
+/*
+ * If the kernel can copy rec from the input or temporary file to file
+ * (without the data passing through our buffers and stdio), do so. This is the
+ * case for large records that are not in memory, if the template only
+ * replaces the delimiter by a constant string (or outputs it unchanged).
+ *
+ * Returns 0 on success, 1 if this is not possible (and nothing was written),
+ * and -1 on error, with a message in ctx->errstr.
+ */
+static int
+rec_write_copy(struct rec_ctx *ctx, const struct rec *rec, const struct rec_tmpl *t, FILE *file)
+{
+	size_t		 i, len, first;
+
+	if (!REC_IS_OFFSET(rec) || REC_LEN(rec) < REC_COPY_MIN ||
+	    REC_F(rec).map_free != 0 || REC_F(rec).z != NULL ||
+	    REC_DELIM_LEN(rec) == REC_DELIM_UNKNOWN || t->refs)
+		return 1;
+	if (REC_F(rec).tmp != REC_F(rec).fd &&
+	    REC_OFFSET(rec) >= REC_F(rec).offset - (off_t) (REC_F(rec).buf_first_read - REC_F(rec).buf_first_write))
+		/* Not flushed to the temporary file yet; see rec_data() */
+		return 1;
+
+	/*
+	 * Copy everything but the delimiter, and the delimiter too if it is
+	 * output as is (by & or, for literals, by the same string); the rest of
+	 * the template must be constant.
+	 */
+	len = REC_LEN(rec) - REC_DELIM_LEN(rec);
+	first = 0;
+	if (REC_DELIM_LEN(rec) != 0 && t->nops > 0 &&
+	    (t->op[0].ref == 0 ||
+	     (t->nops == 1 && REC_DELIM_LEN(rec) == REC_F(rec).literal_len &&
+	      t->op[0].len == REC_F(rec).literal_len && t->op[0].ref == -1 &&
+	      memcmp(t->lit, REC_F(rec).literal, t->op[0].len) == 0))) {
+		len = REC_LEN(rec);
+		first = 1;
+	}
+	for (i = first; i < t->nops; i++)
+		if (t->op[i].ref != -1)
+			return 1;
+
+	if (fflush(file) != 0) {
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to write output: %s", strerror(errno));
+		return -1;
+	}
+	if (rec_spool_sync(REC_F_IDX(rec)) == -1) {
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to write temporary file: %s", strerror(errno));
+		return -1;
+	}
+	switch (rec_copy(ctx, REC_F(rec).tmp, REC_OFFSET(rec), len, fileno(file))) {
+	case 0:
+		break;
+	case 1:
+		return 1;
+	default:
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to copy record to output: %s", strerror(errno));
+		return -1;
+	}
+
+	return rec_tmpl_write(ctx, t, first, NULL, 0, 0, file) == NULL ? 0 : -1;
+}
+
+/*
+ * Copy len bytes starting at offset in fd to out, using the first method in
+ * ctx->copy_method that works. Returns 0 on success, 1 if no method works
+ * (and nothing was written), and -1 on error, with errno set as for
+ * sendfile(2).
+ */
+static int
+rec_copy(struct rec_ctx *ctx, int fd, off_t offset, size_t len, int out)
+{
+	struct stat	 sb;
+	struct pollfd	 pfd;
+	ssize_t		 nbytes;
+	size_t		 done;
+
+	if (out != ctx->copy_fd) {
+		/* copy_file_range(2) only works between regular files */
+		ctx->copy_fd = out;
+		ctx->copy_method = fstat(out, &sb) == 0 && S_ISREG(sb.st_mode) ? REC_COPY_FILE_RANGE : REC_COPY_SENDFILE;
+	}
+
+	for (done = 0; done < len; done += nbytes) {
+		switch (ctx->copy_method) {
+#ifdef HAVE_COPY_FILE_RANGE
+		case REC_COPY_FILE_RANGE:
+			nbytes = copy_file_range(fd, &offset, out, NULL, len - done, 0);
+			break;
+#endif
+#ifdef HAVE_SENDFILE
+		case REC_COPY_SENDFILE:
+			nbytes = sendfile(out, fd, &offset, len - done);
+			break;
+#endif
+		case REC_COPY_NONE:
+			assert(done == 0);
+			return 1;
+		default:
+			/* Not available */
+			ctx->copy_method++;
+			nbytes = 0;
+			continue;
+		}
+
+		if (nbytes == -1) {
+			nbytes = 0;
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN) {
+				/* Non-blocking output */
+				pfd.fd = out;
+				pfd.events = POLLOUT;
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			if (done == 0 && (errno == EINVAL || errno == ENOSYS ||
+			    errno == EXDEV || errno == EBADF || errno == EOPNOTSUPP)) {
+				/* Not supported for these files; try the next one */
+				ctx->copy_method++;
+				continue;
+			}
+			return -1;
+		} else if (nbytes == 0) {
+			/* Someone truncated the file under us */
+			errno = EIO;
+			return -1;
+		}
+		ctx->stats.preads++;
+		ctx->stats.pread_bytes += nbytes;
+	}
+
+	return 0;
+}
+#endif
+
+void
+rec_prefetch(const struct rec *rec)
+{
+	off_t		 offset, aligned;
+#ifdef HAVE_POSIX_FADVISE
+	size_t		 first, last;
+#endif
+
+	if (!REC_IS_OFFSET(rec))
+		/* Already in memory */
+		return;
+
+	if (REC_F(rec).map_p != NULL &&
+	    REC_OFFSET(rec) >= REC_F(rec).map_offset &&
+	    REC_OFFSET(rec) + REC_LEN(rec) <= REC_F(rec).map_offset + (off_t) REC_F(rec).map_len) {
+		if (!REC_F(rec).map_prefetch || REC_F(rec).map_free != 0)
+			/* Probably in memory, or not really a mapping */
+			return;
+
+		/* map_p is page-aligned, but the record need not be */
+		offset = REC_OFFSET(rec) - REC_F(rec).map_offset;
+		aligned = offset - offset % sysconf(_SC_PAGESIZE);
+		/* LINTED offset - aligned + REC_LEN(rec) is small and positive */
+		posix_madvise(&REC_F(rec).map_p[aligned], offset - aligned + REC_LEN(rec), POSIX_MADV_WILLNEED);
+	}
+#ifdef HAVE_POSIX_FADVISE
+	else if (REC_F(rec).z == NULL)
+		posix_fadvise(REC_F(rec).tmp, REC_OFFSET(rec), REC_LEN(rec), POSIX_FADV_WILLNEED);
+	else if (REC_F(rec).spool == NULL && REC_OFFSET(rec) < REC_F(rec).z->len) {
+		/* Compressed, and completely written; read the blocks of rec */
+		/* LINTED offsets are nonnegative */
+		first = REC_OFFSET(rec) / REC_Z_BLOCK;
+		/* LINTED idem */
+		last = (REC_OFFSET(rec) + REC_LEN(rec) - 1) / REC_Z_BLOCK;
+		assert(last < REC_F(rec).z->nblocks);
+		posix_fadvise(REC_F(rec).tmp, REC_F(rec).z->block[first], REC_F(rec).z->block[last + 1] - REC_F(rec).z->block[first], POSIX_FADV_WILLNEED);
+	}
+#endif
+}
+
+/*
+ * rec_save() writes internal_only.info, followed by REC_LEN(rec) bytes of
+ * data. This is only ever read back by the same process, so the native
+ * representation is fine.
+ */
+const char *
+rec_save(struct rec_ctx *ctx, const struct rec *rec, FILE *file)
+{
+	const char	*p;
+
+	if ((p = rec_data(ctx, rec)) == NULL)
+		return ctx->errstr;
+
+	if (fwrite(&rec->internal_only.info, sizeof(rec->internal_only.info), 1, file) != 1 ||
+	    fwrite(p, REC_LEN(rec), 1, file) != 1) {
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to save record: %s", strerror(errno));
+		return ctx->errstr;
+	}
+	ctx->stats.bytes_spooled += sizeof(rec->internal_only.info) + REC_LEN(rec);
+
+	return NULL;
+}
+
+int
+rec_load(struct rec_ctx *ctx, struct rec *rec, FILE *file)
+{
+	uint64_t	 info;
+	void		*p;
+	size_t		 nbytes;
+
+	if ((nbytes = fread(&info, 1, sizeof(info), file)) != sizeof(info)) {
+		if (nbytes == 0 && !ferror(file)) {
+			/* EOF */
+			errno = 0;
+			return -1;
+		}
+		goto err_read;
+	}
+
+	rec->internal_only.info = info | REC_MEM;
+	assert(REC_LEN(rec) > 0);
+	assert(REC_F_IDX(rec) < f_last && REC_F(rec).offset != -1);
+
+	if ((p = rec_alloc(ctx, REC_F_IDX(rec), REC_LEN(rec))) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	rec->internal_only.loc.p = p;
+	if (fread(p, REC_LEN(rec), 1, file) != 1) {
+		rec_free(rec);
+		goto err_read;
+	}
+	assert(!REC_IS_OFFSET(rec));
+
+	return 0;
+
+err_read:
+	if (!ferror(file))
+		/* A partial record means that someone messed with file */
+		errno = EIO;
+	return -1;
+}
+
+int
+rec_dup(struct rec_ctx *ctx, const struct rec *rec, struct rec *copy)
+{
+	void		*p;
+
+	*copy = *rec;
+	if (REC_IS_OFFSET(rec))
+		return 0;
+
+	if ((p = rec_alloc(ctx, REC_F_IDX(rec), REC_LEN(rec))) == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	memcpy(p, REC_P(rec), REC_LEN(rec));
+	copy->internal_only.loc.p = p;
+
+	return 0;
+}
+
+struct rec_unique *
+rec_unique_new(size_t *memory_cache)
+{
+	struct rec_unique *u;
+	size_t		 i;
+
+	if ((u = malloc(sizeof(*u))) == NULL)
+		return NULL;
+	for (i = 0; i < REC_UNIQUE_PARTS; i++) {
+		u->part[i].slot = NULL;
+		u->part[i].size = u->part[i].used = 0;
+		u->part[i].mapped = 0;
+	}
+	u->chunk = NULL;
+	u->nchunks = u->chunks_size = 0;
+	u->n = 0;
+	u->memory_cache = memory_cache;
+	u->block = NULL;
+	u->spill = u->map = -1;
+	u->spill_flushed = u->map_len = 0;
+	u->wbuf = NULL;
+	u->wbuf_len = 0;
+	u->buf = u->cmp = NULL;
+	u->buf_size = u->cmp_size = 0;
+
+	return u;
+}
+
+int
+rec_unique_add(struct rec_ctx *ctx, struct rec_unique *u, const struct rec *rec)
+{
+	struct rec_unique_part *part;
+	struct rec_unique_chunk *chunk;
+	const struct rec *copy;
+	const char	*p, *q;
+	void		*tmp;
+	uint64_t	 hash, index;
+	size_t		 len, i, chunks_size;
+
+	len = rec_unique_key(rec);
+	if ((p = rec_data(ctx, rec)) == NULL)
+		return -1;
+	if (p == ctx->w_buf) {
+		/* Comparing may need ctx->w_buf */
+		if (u->buf_size < len) {
+			if ((tmp = realloc(u->buf, len)) == NULL)
+				return -1;
+			u->buf = tmp;
+			u->buf_size = len;
+		}
+		memcpy(u->buf, p, len);
+		p = u->buf;
+	}
+	hash = rec_hash(p, len);
+	part = &u->part[hash >> (64 - REC_UNIQUE_PART_BITS)];
+	hash &= UINT32_MAX;
+
+	/* Look for it */
+	for (i = hash & (part->size - 1); part->size != 0 && part->slot[i] != 0; i = (i + 1) & (part->size - 1)) {
+		if (part->slot[i] >> 32 != hash)
+			continue;
+		copy = REC_UNIQUE_REC(u, (part->slot[i] & UINT32_MAX) - 1);
+		if (REC_LEN(copy) != len)
+			continue;
+		if ((q = rec_unique_data(ctx, u, copy)) == NULL)
+			return -1;
+		if (memcmp(p, q, len) == 0)
+			return 0;
+	}
+
+	/* Not found, so add it */
+	if (u->n == UINT32_MAX - 1) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	if (4 * (part->used + 1) > 3 * part->size) {
+		if (rec_unique_grow(u, part) == -1)
+			return -1;
+		for (i = hash & (part->size - 1); part->slot[i] != 0; i = (i + 1) & (part->size - 1));
+	}
+	if (u->n == (uint64_t) u->nchunks * REC_UNIQUE_CHUNK) {
+		if (u->nchunks == u->chunks_size) {
+			chunks_size = u->chunks_size != 0 ? 2 * u->chunks_size : 16;
+			if ((tmp = realloc(u->chunk, chunks_size * sizeof(*u->chunk))) == NULL)
+				return -1;
+			u->chunk = tmp;
+			u->chunks_size = chunks_size;
+		}
+		chunk = &u->chunk[u->nchunks];
+		if ((chunk->rec = rec_unique_alloc(u, REC_UNIQUE_CHUNK * sizeof(*chunk->rec), &chunk->mapped)) == NULL)
+			return -1;
+		u->nchunks++;
+	}
+	index = u->n;
+	if (rec_unique_copy(u, rec, p, REC_UNIQUE_REC(u, index)) == -1)
+		return -1;
+	part->slot[i] = hash << 32 | (index + 1);
+	part->used++;
+	u->n++;
+
+	return 1;
+}
+
+void
+rec_unique_free(struct rec_unique *u)
+{
+	struct rec_unique_block *b;
+	size_t		 i;
+
+	if (u == NULL)
+		return;
+
+	while ((b = u->block) != NULL) {
+		u->block = b->next;
+		rec_refund(u->memory_cache, sizeof(*b) + b->size);
+		free(b);
+	}
+	for (i = 0; i < REC_UNIQUE_PARTS; i++)
+		if (u->part[i].slot != NULL)
+			rec_unique_release(u, u->part[i].slot, u->part[i].size * sizeof(*u->part[i].slot), u->part[i].mapped);
+	for (i = 0; i < u->nchunks; i++)
+		rec_unique_release(u, u->chunk[i].rec, REC_UNIQUE_CHUNK * sizeof(*u->chunk[i].rec), u->chunk[i].mapped);
+	free(u->chunk);
+	if (u->spill != -1)
+		close(u->spill);
+	if (u->map != -1)
+		close(u->map);
+	free(u->wbuf);
+	free(u->buf);
+	free(u->cmp);
+	free(u);
+}
+
+/*
+ * Return the length of the data of rec that rec_unique_add() compares: all of
+ * it but the delimiter, if its length is known.
+ */
+static size_t
+rec_unique_key(const struct rec *rec)
+{
+	if (REC_DELIM_LEN(rec) == REC_DELIM_UNKNOWN)
+		return REC_LEN(rec);
+	/* LINTED the delimiter is part of the record */
+	return REC_LEN(rec) - REC_DELIM_LEN(rec);
+}
+
+/*
+ * Hash len bytes at p, eight at a time.
+ */
+static uint64_t
+rec_hash(const char *p, size_t len)
+{
+	uint64_t	 h, w;
+	size_t		 i;
+
+	h = UINT64_C(0x736f6d6570736575) ^ len;
+	for (i = 0; i + 8 <= len; i += 8) {
+		memcpy(&w, &p[i], 8);
+		h = (h ^ w) * UINT64_C(0x9e3779b97f4a7c15);
+		h ^= h >> 29;
+	}
+	if (i < len) {
+		w = 0;
+		memcpy(&w, &p[i], len - i);
+		h = (h ^ w) * UINT64_C(0x9e3779b97f4a7c15);
+	}
+	h ^= h >> 32;
+	h *= UINT64_C(0xd6e8feb86659fd93);
+	h ^= h >> 32;
+
+	return h;
+}
+
+/*
+ * Allocate size bytes, filled with zeroes, for the hash table or the chunks of
+ * u: charged to u->memory_cache if possible, if need be after spilling the
+ * keys in u->block, and otherwise mapped from u->map. *mapped is set in the
+ * latter case. Returns NULL and sets errno on failure.
+ */
+static void *
+rec_unique_alloc(struct rec_unique *u, size_t size, int *mapped)
+{
+	void		*p;
+	size_t		 len;
+	int		 charged;
+
+	charged = rec_charge(u->memory_cache, size) == 0;
+	if (!charged && u->block != NULL) {
+		if (rec_unique_spill_all(u) == -1)
+			return NULL;
+		charged = rec_charge(u->memory_cache, size) == 0;
+	}
+	if (charged) {
+		if ((p = calloc(1, size)) == NULL) {
+			rec_refund(u->memory_cache, size);
+			errno = ENOMEM;
+		}
+		*mapped = 0;
+		return p;
+	}
+
+	/*
+	 * Grow u->map, which reads as zeroes. Space that was released is not
+	 * reused, but the table and chunks grow geometrically, so that
+	 * wastes less than the size of the rest.
+	 */
+	len = rec_unique_map_len(size);
+	if (u->map == -1 && (u->map = rec_mkstemp()) == -1)
+		return NULL;
+	/* LINTED len fits, since it is about to be mapped */
+	if (ftruncate(u->map, u->map_len + (off_t) len) == -1)
+		return NULL;
+	if ((p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, u->map, u->map_len)) == MAP_FAILED)
+		return NULL;
+	/* LINTED idem */
+	u->map_len += (off_t) len;
+	*mapped = 1;
+
+	return p;
+}
+
+/*
+ * Free the size bytes at p, allocated by rec_unique_alloc().
+ */
+static void
+rec_unique_release(struct rec_unique *u, void *p, size_t size, int mapped)
+{
+	if (mapped)
+		munmap(p, rec_unique_map_len(size));
+	else {
+		free(p);
+		rec_refund(u->memory_cache, size);
+	}
+}
+
+/*
+ * Return size, rounded up to a multiple of the page size.
+ */
+static size_t
+rec_unique_map_len(size_t size)
+{
+	size_t		 page;
+
+	/* LINTED the page size is positive */
+	page = (size_t) sysconf(_SC_PAGESIZE);
+	return (size + page - 1) / page * page;
+}
+
+/*
+ * Double the number of slots of part of u (or allocate the first
+ * REC_UNIQUE_MIN). Returns 0 on success; otherwise, returns -1 and sets errno
+ * as for rec_unique_alloc().
+ */
+static int
+rec_unique_grow(struct rec_unique *u, struct rec_unique_part *part)
+{
+	uint64_t	*slot;
+	size_t		 size, i, j;
+	int		 mapped;
+
+	size = part->size != 0 ? 2 * part->size : REC_UNIQUE_MIN;
+	if (size > SIZE_MAX / 2 / sizeof(*slot)) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if ((slot = rec_unique_alloc(u, size * sizeof(*slot), &mapped)) == NULL)
+		return -1;
+
+	for (i = 0; i < part->size; i++) {
+		if (part->slot[i] == 0)
+			continue;
+		for (j = (part->slot[i] >> 32) & (size - 1); slot[j] != 0; j = (j + 1) & (size - 1));
+		slot[j] = part->slot[i];
+	}
+	if (part->slot != NULL)
+		rec_unique_release(u, part->slot, part->size * sizeof(*slot), part->mapped);
+	part->slot = slot;
+	part->size = size;
+	part->mapped = mapped;
+
+	return 0;
+}
+
+/*
+ * Move the keys in u->block to u->spill, and free the blocks. Returns 0 on
+ * success; otherwise, returns -1 and sets errno as for rec_unique_spill().
+ */
+static int
+rec_unique_spill_all(struct rec_unique *u)
+{
+	struct rec_unique_block *b;
+	struct rec	*copy;
+	uint64_t	 i;
+	off_t		 offset;
+
+	for (i = 0; i < u->n; i++) {
+		copy = REC_UNIQUE_REC(u, i);
+		/* Keys of records in memory are in a block, unless spilled */
+		if (REC_IS_OFFSET(copy))
+			continue;
+		if (rec_unique_spill(u, REC_P(copy), REC_LEN(copy), &offset) == -1)
+			return -1;
+		copy->internal_only.loc.offset = offset;
+		copy->internal_only.info = (copy->internal_only.info & ~REC_MEM) | REC_UNIQUE_SPILLED;
+	}
+
+	while ((b = u->block) != NULL) {
+		u->block = b->next;
+		rec_refund(u->memory_cache, sizeof(*b) + b->size);
+		free(b);
+	}
 
-			;; /* LINTED f[rfd].buf_last - f[rfd].buf_first_read >= 0 as above */
-			memcpy(tmp, &f[rfd].buf_p[f[rfd].buf_first_read], f[rfd].buf_last - f[rfd].buf_first_read);
+	return 0;
+}
 
-			free(f[rfd].buf_p);
-			f[rfd].buf_p = tmp;
-			f[rfd].buf_size *= 2;
-		}
-		f[rfd].buf_last -= f[rfd].buf_first_read;
-		f[rfd].buf_first_write = f[rfd].buf_first_read = 0;
-		assert(f[rfd].buf_size > f[rfd].buf_last);
+/*
+ * Store a copy of rec, whose data p was just read, in copy: offsets refer to
+ * their rfd as they are, and the keys of records in memory are copied into
+ * u->block or, if that does not fit in u->memory_cache, spilled. Returns 0 on
+ * success; otherwise, returns -1 and sets errno to ENOMEM, or as for
+ * mkstemp(3) or write(2).
+ */
+static int
+rec_unique_copy(struct rec_unique *u, const struct rec *rec, const char *p, struct rec *copy)
+{
+	struct rec_unique_block *b;
+	size_t		 len, size;
 
-		/* Read additional data */
-		/* LINTED f[rfd].buf_last - f[rfd].buf_first_read >= 0 as above */
-		if ((nbytes = read(f[rfd].fd, &f[rfd].buf_p[f[rfd].buf_last], f[rfd].buf_size - f[rfd].buf_last)) == -1)
-			goto err;
-		if (nbytes == 0)
-			eof = 1;
-		;; /* LINTED nbytes <= f[rfd].buf_size <= INT_MAX, and no overflow can happen here */
-		f[rfd].buf_last += nbytes;
+	/* Only the key is ever compared, so the delimiter need not be kept */
+	len = rec_unique_key(rec);
+	copy->internal_only.info = REC_INFO(len, 0, REC_F_IDX(rec));
+	if (REC_IS_OFFSET(rec)) {
+		copy->internal_only.loc.offset = REC_OFFSET(rec);
+		return 0;
 	}
 
-	assert(ovector[0] >= f[rfd].buf_first_read);
-	assert(ovector[1] >= ovector[0]);
-	assert(f[rfd].buf_last >= ovector[1]);
-	
-	if (ovector[1] == ovector[0]) {
-		/* Zero-length match! This would result in an endless loop */
-		errno = EINVAL;
-		goto err;
+	if ((b = u->block) == NULL || b->size - b->used < len) {
+		size = MAX(len, REC_UNIQUE_BLOCK);
+		if (rec_charge(u->memory_cache, sizeof(*b) + size) == -1) {
+			/* Out of memory, so keep the key on disk */
+			copy->internal_only.info |= REC_UNIQUE_SPILLED;
+			return rec_unique_spill(u, p, len, &copy->internal_only.loc.offset);
+		}
+		if ((b = malloc(sizeof(*b) + size)) == NULL) {
+			rec_refund(u->memory_cache, sizeof(*b) + size);
+			errno = ENOMEM;
+			return -1;
+		}
+		b->used = 0;
+		b->size = size;
+		b->next = u->block;
+		u->block = b;
 	}
+	memcpy(&b->data[b->used], p, len);
+	copy->internal_only.loc.p = &b->data[b->used];
+	copy->internal_only.info |= REC_MEM;
+	b->used += len;
 
-	rec_len = ovector[1] - f[rfd].buf_first_read;
-	if (rec != NULL) {
-		rec->internal_only.len = rec_len;
+	return 0;
+}
 
-		if (!eof)
-			rec->internal_only.f_idx = rfd;
-		else {
-			if (rfd == 0)
-				rec->internal_only.f_idx = INT_MIN;
-			else
-				rec->internal_only.f_idx = -rfd;
+/*
+ * Append the len bytes at p to u->spill, and store their offset in *offset.
+ * Returns 0 on success; otherwise, returns -1 and sets errno as for malloc(3),
+ * mkstemp(3) or write(2).
+ */
+static int
+rec_unique_spill(struct rec_unique *u, const char *p, size_t len, off_t *offset)
+{
+	int		 error;
 
-			assert(REC_IS_LAST(rec));
-		}
-		assert(&REC_F(rec) == &f[rfd]);
+	if (u->wbuf == NULL && (u->wbuf = malloc(REC_UNIQUE_BLOCK)) == NULL)
+		return -1;
+	if (u->spill == -1 && (u->spill = rec_mkstemp()) == -1)
+		return -1;
 
-		;; /* LINTED converting rec_len to unsigned works fine */
-		if (f[rfd].fd != f[rfd].tmp &&
-		    f[rfd].buf_first_read == f[rfd].buf_first_write &&
-		    (*f[rfd].memory_cache >= REC_ESTIMATED_MEMORY_USE(rec) &&
-		     (rec->internal_only.loc.p = malloc(rec_len)) != NULL)) {
-			/* Keep record in memory */
-			/* LINTED converting REC_LEN(rec) to size_t works */
-			memcpy(rec->internal_only.loc.p, &f[rfd].buf_p[f[rfd].buf_first_read], REC_LEN(rec));
-			/* Don't write it to disk */
-			f[rfd].buf_first_write += rec_len;
-			/* LINTED converting REC_LEN(rec) to unsigned still works fine */
-			/* Mark as in-memory record */
-			rec->internal_only.len = -rec->internal_only.len;
-			assert(!REC_IS_OFFSET(rec));
-			/* LINTED converting REC_EST... to size_t works */
-			*f[rfd].memory_cache -= REC_ESTIMATED_MEMORY_USE(rec);
-		} else {
-			rec->internal_only.loc.offset = f[rfd].offset;
-			assert(REC_IS_OFFSET(rec));
-			f[rfd].offset += rec_len;
+	if (REC_UNIQUE_BLOCK - u->wbuf_len < len) {
+		if ((error = rec_write_all(u->spill, u->wbuf, u->wbuf_len)) != 0) {
+			errno = error;
+			return -1;
 		}
+		/* LINTED wbuf_len is at most REC_UNIQUE_BLOCK */
+		u->spill_flushed += (off_t) u->wbuf_len;
+		u->wbuf_len = 0;
+	}
+	/* LINTED idem */
+	*offset = u->spill_flushed + (off_t) u->wbuf_len;
+	if (len > REC_UNIQUE_BLOCK) {
+		/* Too large to buffer, and wbuf is empty */
+		if ((error = rec_write_all(u->spill, p, len)) != 0) {
+			errno = error;
+			return -1;
+		}
+		/* LINTED len fits, since it was in memory */
+		u->spill_flushed += (off_t) len;
 	} else {
-		if (f[rfd].fd != f[rfd].tmp &&
-		    f[rfd].buf_first_read == f[rfd].buf_first_write) {
-			/* Don't write it to disk */
-			/* XXX We'd prefer *never* writing to disk */
-			f[rfd].buf_first_write += rec_len;
-		} else
-			f[rfd].offset += rec_len;
+		memcpy(&u->wbuf[u->wbuf_len], p, len);
+		u->wbuf_len += len;
 	}
 
-	assert(f[rfd].buf_first_read + rec_len == ovector[1]);
-	f[rfd].buf_first_read = ovector[1];
-	assert(f[rfd].buf_first_write <= f[rfd].buf_first_read);
-
 	return 0;
-
-err:
-	return -1;
 }
 
-const char *
-rec_write(const struct rec *rec, const char *delim, FILE *file)
+/*
+ * Return the key of copy, a record in u, as rec_data() does; this remains
+ * valid until the next call of either. Returns NULL and sets errno on failure.
+ */
+static const char *
+rec_unique_data(struct rec_ctx *ctx, struct rec_unique *u, const struct rec *copy)
 {
-	const char	*p;
 	void		*tmp;
-	int		 i, ovector_valid, nbytes;
-	size_t		 new_len;
-#ifndef NDEBUG
-	int		 capturecount;
+	ssize_t		 nbytes;
+	size_t		 i, len;
+	off_t		 offset;
 
-	assert(pcre_fullinfo(REC_F(rec).re, REC_F(rec).re_extra, PCRE_INFO_CAPTURECOUNT, &capturecount) == 0);
-	/* LINTED capturecount is nonnegative, so comparing with unsigned works */
-	assert(capturecount <= SIZE_MAX / sizeof(*ovector) / 3 - 1);
-	assert((capturecount + 1) * 3 <= ovector_size);
-#endif
+	if (!(copy->internal_only.info & REC_UNIQUE_SPILLED))
+		return rec_data(ctx, copy);
 
-	if (delim == NULL) {
-		assert(REC_F(rec).default_delim != NULL);
-		delim = REC_F(rec).default_delim;
-	}
+	len = REC_LEN(copy);
+	offset = REC_OFFSET(copy);
+	if (offset >= u->spill_flushed)
+		return &u->wbuf[offset - u->spill_flushed];
 
-	if (!REC_IS_OFFSET(rec))
-		/* Already in memory */
-		p = REC_P(rec);
-	else {
-		/* Read into w_buf */
-		/* LINTED converting REC_LEN(rec) to unsigned works fine */
-		if (w_buf_size < REC_LEN(rec)) {
-			/* Enlarge w_buf */
-			/* LINTED converting REC_LEN(rec) to unsigned still works fine */
-			for (new_len = w_buf_size != 0 ? w_buf_size : BUFSIZ;
-			     new_len < REC_LEN(rec);
-			     new_len *= 2);
-			if ((tmp = realloc(w_buf, new_len)) == NULL) {
-				snprintf(errstr, sizeof(errstr), "Failed to allocate buffer space: %s", strerror(errno));
-				goto err;
+	if (u->cmp_size < len) {
+		if ((tmp = realloc(u->cmp, len)) == NULL)
+			return NULL;
+		u->cmp = tmp;
+		u->cmp_size = len;
+	}
+	for (i = 0; i < len; i += nbytes)
+		/* LINTED i is at most len, which fits */
+		if ((nbytes = pread(u->spill, &u->cmp[i], len - i, offset + (off_t) i)) <= 0) {
+			if (nbytes == 0)
+				/* Truncated */
+				errno = EIO;
+			else if (errno == EINTR) {
+				nbytes = 0;
+				continue;
 			}
-
-			w_buf = tmp;
-			w_buf_size = new_len;
+			return NULL;
 		}
+	ctx->stats.preads++;
+	ctx->stats.pread_bytes += len;
 
-		nbytes = 0;
-		/* LINTED everything is limited to an int, so no problems here */
-		for (i = 0; i < REC_LEN(rec); nbytes = pread(REC_F(rec).tmp, &w_buf[i], REC_LEN(rec) - i, REC_OFFSET(rec) + i)) {
-			if (nbytes == -1) {
-				snprintf(errstr, sizeof(errstr), "Failed to read record from file: %s", strerror(errno));
-				goto err;
-			}
+	return u->cmp;
+}
 
-			assert(nbytes >= 0);
-			i += nbytes;
-		}
-		assert(i == REC_LEN(rec));
+const char *
+rec_write_str(struct rec_ctx *ctx, const char *str, FILE *file)
+{
+	const struct rec_tmpl *tmpl;
 
-		p = w_buf;
-	}
+	if ((tmpl = rec_tmpl_get(ctx, str)) == NULL)
+		return ctx->errstr;
 
-	/*
-	 * We have REC_LEN(rec) bytes of data starting at p.
-	 *
-	 * Re-run the regular expression to get matches etc.
-	 */
-	if ((ovector_valid = pcre_exec(REC_F(rec).re, REC_F(rec).re_extra, p, REC_LEN(rec), 0, REC_IS_LAST(rec) ? 0 : PCRE_NOTEOL, ovector, ovector_size)) < 0) {
-		/* Unterminated final record */
-		assert(ovector_valid == PCRE_ERROR_NOMATCH);
-		assert(REC_IS_LAST(rec));
+	return rec_tmpl_write(ctx, tmpl, 0, NULL, 0, 0, file);
+}
 
-		ovector_valid = 0;
-		ovector[0] = ovector[1] = REC_LEN(rec);
-	} else {
-		assert(ovector_valid >= 1);
-		assert(ovector[1] == REC_LEN(rec));
+/*
+ * Return the compiled version of delim, compiling it if it's not in
+ * ctx->tmpl_cache yet. Returns NULL and puts an error message in ctx->errstr
+ * if memory is not available; errors in delim itself are reported by
+ * rec_tmpl_write().
+ */
+static const struct rec_tmpl *
+rec_tmpl_get(struct rec_ctx *ctx, const char *delim)
+{
+	struct rec_tmpl	*t;
+
+	for (t = ctx->tmpl_cache; t != NULL; t = t->next)
+		if (strcmp(t->delim, delim) == 0)
+			return t;
+
+	if ((t = rec_tmpl_new(delim)) == NULL) {
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to allocate memory for output template: %s", strerror(errno));
+		return NULL;
 	}
 
-	/* Output anything prior to match */
-	;; /* LINTED ovector[0] is nonnegative */
-	nbytes = fwrite(p, 1, ovector[0], file);
-	/* LINTED as above */
-	if (nbytes != ovector[0]) {
-		snprintf(errstr, sizeof(errstr), "Failed to write output: %s", strerror(errno));
-		goto err;
+	t->next = ctx->tmpl_cache;
+	ctx->tmpl_cache = t;
+	return t;
+}
+
+/*
+ * Compile delim. Returns NULL and sets errno as for malloc(3) on failure.
+ */
+static struct rec_tmpl *
+rec_tmpl_new(const char *delim)
+{
+	struct rec_tmpl	*t;
+	size_t		 len;
+
+	/* Every op consumes at least one character of delim */
+	len = strlen(delim);
+	if ((t = malloc(sizeof(*t))) == NULL)
+		return NULL;
+	if ((t->delim = strdup(delim)) == NULL) {
+		free(t);
+		return NULL;
+	}
+	if ((t->lit = malloc(len + 1)) == NULL ||
+	    (t->op = calloc(len + 1, sizeof(*t->op))) == NULL) {
+		free(t->lit);
+		free(t->delim);
+		free(t);
+		return NULL;
 	}
+	rec_tmpl_compile(t);
+	t->next = NULL;
 
-	return rec_write_raw(delim, p, ovector_valid, file);
+	return t;
+}
 
-err:
-	return errstr;
+/*
+ * Free t, which is not in any tmpl_cache. Does nothing if t is NULL.
+ */
+static void
+rec_tmpl_free(struct rec_tmpl *t)
+{
+	if (t == NULL)
+		return;
+
+	free(t->op);
+	free(t->lit);
+	free(t->delim);
+	free(t);
 }
 
-const char *
-rec_write_str(const char *str, FILE *file)
+/*
+ * Append a literal character c to t, extending the last op if possible.
+ */
+static void
+rec_tmpl_char(struct rec_tmpl *t, int c, size_t *lit_len)
 {
-	return rec_write_raw(str, NULL, 0, file);
+	if (t->nops == 0 || t->op[t->nops - 1].ref != -1) {
+		t->op[t->nops].ref = -1;
+		t->op[t->nops].off = *lit_len;
+		t->op[t->nops].len = 0;
+		t->nops++;
+	}
+	/* LINTED truncation is intended, as for putc() */
+	t->lit[(*lit_len)++] = (char) c;
+	t->op[t->nops - 1].len++;
 }
 
-static const char *
-rec_write_raw(const char *delim, const char *p, int ovector_valid, FILE *file)
+/*
+ * Append a reference to subpattern ref (or the whole match, for 0) to t.
+ */
+static void
+rec_tmpl_ref(struct rec_tmpl *t, int ref)
+{
+	assert(ref >= 0 && ref <= 9);
+	t->op[t->nops].ref = ref;
+	t->op[t->nops].off = t->op[t->nops].len = 0;
+	t->nops++;
+	if (ref > 0)
+		t->refs = 1;
+}
+
+/*
+ * Compile t->delim into t->op[], which must have room for strlen(t->delim)
+ * + 1 ops, and t->lit[]. On error, the message is put in t->error and the ops
+ * are incomplete.
+ */
+static void
+rec_tmpl_compile(struct rec_tmpl *t)
 {
-	int		 i, value, nbytes;
+	const char	*delim;
+	size_t		 i, lit_len;
+	int		 value;
 	enum {
 		NORMAL,
 		SEEN_BACKSLASH,
@@ -592,120 +4384,70 @@ rec_write_raw(const char *delim, const char *p, int ovector_valid, FILE *file)
 	}		 state;
 	char		 vis_buf[5];
 
+	delim = t->delim;
+	t->nops = 0;
+	t->refs = 0;
+	t->error[0] = '\0';
+	lit_len = 0;
+
 	/*
-	 * Output delim, handling backreferences and the like.
+	 * Parse delim, handling backreferences and the like.
 	 *
-	 * This is mostly a finite state machine parsing delim.
+	 * This is mostly a finite state machine; every character is processed
+	 * exactly once, except that the first character after an escape
+	 * sequence of variable length is processed again.
 	 */
 	state = NORMAL;
 	value = 0;
-	if (strlen(delim) >= INT_MAX) {
-		snprintf(errstr, sizeof(errstr), "Delimiting string too long: %zu", strlen(delim));
-		goto err;
-	}
-	;; /* LINTED 0 <= i <= strlen(delim) < INT_MAX, so works */
-	for (i = 0; i <= strlen(delim); i++) {
+	for (i = 0; ; i++) {
 		switch (state) {
 		case NORMAL:
-			value = 0;
 			switch (delim[i]) {
 			case '\\':
 				state = SEEN_BACKSLASH;
 				break;
 			case '&':
-				/* Output match; note the label! */
-				assert(value == 0);
-output_match:
-				assert(value >= 0);
-				assert(value <= 9);
-				if (value >= ovector_valid) {
-					if (ovector_valid == 0) {
-						if (value == 0)
-							snprintf(errstr, sizeof(errstr), "The argument to -o contains &, but ");
-						else
-							snprintf(errstr, sizeof(errstr), "The argument to -o contains \\%d, but ", value);
-
-						if (p != NULL)
-							strlcat(errstr, "the last argument is not terminated", sizeof(errstr));
-						else
-							strlcat(errstr, "you passed -a", sizeof(errstr));
-
-						goto err;
-					} else {
-						assert(value > 0);
-						snprintf(errstr, sizeof(errstr), "Invalid backreference \\%d", value);
-						goto err;
-					}
-				}
-				;; /* LINTED the ovector[] - ovector[] expression is between 0 and INT_MAX, so ok */
-				nbytes = fwrite(&p[ovector[2 * value]], 1, ovector[2 * value + 1] - ovector[2 * value], file);
-				if (nbytes != ovector[2 * value + 1] - ovector[2 * value]) {
-					snprintf(errstr, sizeof(errstr), "Failed to write match: %s", strerror(errno));
-					goto err;
-				}
-
-				state = NORMAL;
+				rec_tmpl_ref(t, 0);
 				break;
 			case '\0':
-				/* Ignore */
-				break;
+				return;
 			default:
-				/* LINTED cast to unsigned somewhere in macro - should work */
-				if (putc(delim[i], file) == EOF)
-					goto err_char;
+				rec_tmpl_char(t, delim[i], &lit_len);
 				break;
 			}
 			break;
 		case SEEN_BACKSLASH:
 			value = 0;
+			state = NORMAL;
 			switch (delim[i]) {
 			case '&':
-				if (putc('&', file) == EOF)
-					goto err_char;
-				state = NORMAL;
+				rec_tmpl_char(t, '&', &lit_len);
 				break;
 			case '\\':
-				if (putc('\\', file) == EOF)
-					goto err_char;
-				state = NORMAL;
+				rec_tmpl_char(t, '\\', &lit_len);
 				break;
 			case 'a':
-				if (putc('\a', file) == EOF)
-					goto err_char;
-				state = NORMAL;
+				rec_tmpl_char(t, '\a', &lit_len);
 				break;
 			case 'b':
-				if (putc('\b', file) == EOF)
-					goto err_char;
-				state = NORMAL;
+				rec_tmpl_char(t, '\b', &lit_len);
 				break;
 			case 'f':
-				if (putc('\f', file) == EOF)
-					goto err_char;
-				state = NORMAL;
+				rec_tmpl_char(t, '\f', &lit_len);
 				break;
 			case 'n':
-				if (putc('\n', file) == EOF)
-					goto err_char;
-				state = NORMAL;
+				rec_tmpl_char(t, '\n', &lit_len);
 				break;
 			case 'r':
-				if (putc('\r', file) == EOF)
-					goto err_char;
-				state = NORMAL;
+				rec_tmpl_char(t, '\r', &lit_len);
 				break;
 			case 't':
-				if (putc('\t', file) == EOF)
-					goto err_char;
-				state = NORMAL;
+				rec_tmpl_char(t, '\t', &lit_len);
 				break;
 			case 'v':
-				if (putc('\v', file) == EOF)
-					goto err_char;
-				state = NORMAL;
+				rec_tmpl_char(t, '\v', &lit_len);
 				break;
 			case 'x':
-				value = 0;
 				state = SEEN_HEX0;
 				break;
 			case '0': /* FALLTHROUGH */
@@ -722,12 +4464,12 @@ output_match:
 				break;
 			case '8': /* FALLTHROUGH */
 			case '9':
-				value = delim[i] - '0';
-				goto output_match;
+				rec_tmpl_ref(t, delim[i] - '0');
+				break;
 			default:
 				vis(vis_buf, delim[i], VIS_CSTYLE | VIS_NOSLASH, ':');
-				snprintf(errstr, sizeof(errstr), "Invalid escape sequence \\%s: reserved for future use", vis_buf);
-				goto err;
+				snprintf(t->error, sizeof(t->error), "Invalid escape sequence \\%s: reserved for future use", vis_buf);
+				return;
 			}
 			break;
 		case SEEN_HEX0: /* FALLTHROUGH */
@@ -737,24 +4479,20 @@ output_match:
 								 isupper(delim[i]) ? 'A' : 'a');
 			else if (state == SEEN_HEX1) {
 				/*
-				 * Not a hex digit - print value and process
+				 * Not a hex digit - output value and process
 				 * delim[i] again
 				 */
 				i--;
 			} else {
 				vis(vis_buf, delim[i], VIS_CSTYLE, ':');
-				snprintf(errstr, sizeof(errstr), "Invalid escape sequence \\x%s: expected a hex digit", vis_buf);
-				goto err;
+				snprintf(t->error, sizeof(t->error), "Invalid escape sequence \\x%s: expected a hex digit", vis_buf);
+				return;
 			}
 
 			if (state == SEEN_HEX0)
 				state = SEEN_HEX1;
 			else {
-				/* LINTED cast to unsigned char somewhere in macro - should work */
-				if (putc(value, file) == EOF)
-					goto err_char;
-
-				value = 0;
+				rec_tmpl_char(t, value, &lit_len);
 				state = NORMAL;
 			}
 			break;
@@ -764,14 +4502,16 @@ output_match:
 				value = 8 * value + delim[i] - '0';
 			else if (state == SEEN_OCTAL1 && value != 0) {
 				/*
-				 * Not an octal digit - print *backreference*
+				 * Not an octal digit - output *backreference*
 				 * and process delim[i] again.
 				 */
 				i--;
-				goto output_match;
+				rec_tmpl_ref(t, value);
+				state = NORMAL;
+				break;
 			} else {
 				/*
-				 * Not an octal digit - print value and process
+				 * Not an octal digit - output value and process
 				 * delim[i] again.
 				 */
 				i--;
@@ -780,35 +4520,270 @@ output_match:
 			if (state == SEEN_OCTAL1)
 				state = SEEN_OCTAL2;
 			else {
-				/* LINTED cast to unsigned char somewhere in macro - should work */
-				if (putc(value, file) == EOF)
-					goto err_char;
-
-				value = 0;
+				rec_tmpl_char(t, value, &lit_len);
 				state = NORMAL;
 			}
 			break;
 		}
 	}
+}
 
-	/* LINTED works per check above loop */
-	assert(i == strlen(delim) + 1);
+/*
+ * Add len bytes starting at p to o, flushing it to file first if needed.
+ * Returns 0 on success; otherwise, returns -1 and sets errno as for
+ * fwrite(3).
+ */
+static int
+rec_out(struct rec_out *o, const char *p, size_t len, FILE *file)
+{
+	if (o->len + len > sizeof(o->buf)) {
+		if (rec_out_flush(o, file) == -1)
+			return -1;
+		if (len > sizeof(o->buf))
+			/* Not worth copying */
+			return fwrite(p, 1, len, file) == len ? 0 : -1;
+	}
 
-	return NULL;
+	memcpy(&o->buf[o->len], p, len);
+	o->len += len;
+	return 0;
+}
+
+/*
+ * Write out everything in o; the return values are as above.
+ */
+static int
+rec_out_flush(struct rec_out *o, FILE *file)
+{
+	if (o->len != 0 && fwrite(o->buf, 1, o->len, file) != o->len)
+		return -1;
+
+	o->len = 0;
+	return 0;
+}
+
+/*
+ * Output the prefix_len bytes starting at p, followed by t->op[first] and
+ * further ops, using the match in ovector[] against p (or no match at all, if
+ * p is NULL). The return values are as for rec_write().
+ */
+static const char *
+rec_tmpl_write(struct rec_ctx *ctx, const struct rec_tmpl *t, size_t first, const char *p, size_t prefix_len, int ovector_valid, FILE *file)
+{
+	struct rec_out	 o;
+	const struct rec_op *op;
+	PCRE2_SIZE	 start;
+
+	if (t->error[0] != '\0') {
+		snprintf(ctx->errstr, sizeof(ctx->errstr), "%s", t->error);
+		return ctx->errstr;
+	}
+
+	o.len = 0;
+	if (prefix_len != 0 && rec_out(&o, p, prefix_len, file) == -1)
+		goto err;
+	for (op = &t->op[first]; op < &t->op[t->nops]; op++) {
+		if (op->ref == -1) {
+			if (rec_out(&o, &t->lit[op->off], op->len, file) == -1)
+				goto err;
+			continue;
+		}
+
+		if (op->ref >= ovector_valid) {
+			if (ovector_valid == 0) {
+				if (op->ref == 0)
+					snprintf(ctx->errstr, sizeof(ctx->errstr), "The argument to -o contains &, but ");
+				else
+					snprintf(ctx->errstr, sizeof(ctx->errstr), "The argument to -o contains \\%d, but ", op->ref);
+
+				if (p != NULL)
+					strlcat(ctx->errstr, "the last argument is not terminated", sizeof(ctx->errstr));
+				else
+					strlcat(ctx->errstr, "you passed -a", sizeof(ctx->errstr));
+			} else {
+				assert(op->ref > 0);
+				snprintf(ctx->errstr, sizeof(ctx->errstr), "Invalid backreference \\%d", op->ref);
+			}
+			return ctx->errstr;
+		}
+
+		/* Unset subpatterns match the empty string */
+		if ((start = ctx->ovector[2 * op->ref]) != PCRE2_UNSET &&
+		    rec_out(&o, &p[start], ctx->ovector[2 * op->ref + 1] - start, file) == -1)
+			goto err;
+	}
+	if (rec_out_flush(&o, file) == -1)
+		goto err;
 
-err_char:
-	snprintf(errstr, sizeof(errstr), "Failed to write character: %s", strerror(errno));
+	return NULL;
 
 err:
-	return errstr;
+	snprintf(ctx->errstr, sizeof(ctx->errstr), "Failed to write output: %s", strerror(errno));
+	return ctx->errstr;
+}
+
+/*
+ * Allocate len bytes for an in-memory record from f[rfd], and charge them to
+ * f[rfd].memory_cache. Returns NULL if this would exceed *memory_cache or if
+ * memory is not available.
+ */
+static void *
+rec_alloc(struct rec_ctx *ctx, int rfd, size_t len)
+{
+	struct rec_chunk *old;
+	void		*p;
+	size_t		 estimate;
+
+	assert(len > 0);
+	if (len > REC_ARENA_MAX) {
+		/* Too large for the arena */
+		estimate = len + 2 * sizeof(void *) + 2 * sizeof(size_t);
+		if (estimate < len || rec_charge(f[rfd].memory_cache, estimate) == -1)
+			return NULL;
+		if ((p = malloc(len)) == NULL) {
+			rec_refund(f[rfd].memory_cache, estimate);
+			return NULL;
+		}
+
+		return p;
+	}
+
+	if (ctx->arena == NULL || ctx->arena->memory_cache != f[rfd].memory_cache ||
+	    ctx->arena_used + len > REC_ARENA_CHUNK) {
+		/* Start a new chunk */
+		if (rec_charge(f[rfd].memory_cache, REC_ARENA_CHUNK) == -1)
+			return NULL;
+		if (posix_memalign(&p, REC_ARENA_CHUNK, REC_ARENA_CHUNK) != 0) {
+			rec_refund(f[rfd].memory_cache, REC_ARENA_CHUNK);
+			return NULL;
+		}
+
+		old = ctx->arena;
+		ctx->arena = p;
+		ctx->arena->memory_cache = f[rfd].memory_cache;
+		ctx->arena->live = 0;
+		ctx->arena->ctx = ctx;
+		ctx->arena_used = sizeof(*ctx->arena);
+
+		/* Retire the old chunk; free it now if it is no longer used */
+		if (old != NULL) {
+			old->ctx = NULL;
+			if (old->live == 0)
+				rec_chunk_release(old);
+		}
+	}
+
+	p = (char *) ctx->arena + ctx->arena_used;
+	ctx->arena_used += len;
+	ctx->arena->live++;
+
+	return p;
+}
+
+/*
+ * Take len bytes from *memory_cache. Returns 0 on success, or -1 if
+ * *memory_cache does not have them.
+ */
+static int
+rec_charge(size_t *memory_cache, size_t len)
+{
+	rec_lock();
+	if (*memory_cache < len) {
+		rec_unlock();
+		return -1;
+	}
+
+	*memory_cache -= len;
+	memory_used += len;
+	memory_peak = MAX(memory_peak, memory_used);
+	rec_unlock();
+
+	return 0;
+}
+
+/*
+ * Give back len bytes taken by rec_charge().
+ */
+static void
+rec_refund(size_t *memory_cache, size_t len)
+{
+	rec_lock();
+	assert(memory_used >= len);
+
+	*memory_cache += len;
+	memory_used -= len;
+	rec_unlock();
+}
+
+/*
+ * Return what is left in *memory_cache right now.
+ */
+static size_t
+rec_available(size_t *memory_cache)
+{
+	size_t		 len;
+
+	rec_lock();
+	len = *memory_cache;
+	rec_unlock();
+
+	return len;
+}
+
+/*
+ * Lock and unlock rec_mutex, if threads are supported.
+ */
+static void
+rec_lock(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_lock(&rec_mutex);
+#endif
+}
+
+static void
+rec_unlock(void)
+{
+#ifdef HAVE_PTHREAD
+	pthread_mutex_unlock(&rec_mutex);
+#endif
+}
+
+/*
+ * Free chunk, which must not contain any records, and refund it.
+ */
+static void
+rec_chunk_release(struct rec_chunk *chunk)
+{
+	assert(chunk->live == 0);
+
+	rec_refund(chunk->memory_cache, REC_ARENA_CHUNK);
+	free(chunk);
 }
 
 void
 rec_free(struct rec *rec)
 {
-	if (rec != NULL && !REC_IS_OFFSET(rec)) {
-		/* LINTED converting REC_EST... to size_t works */
-		*REC_F(rec).memory_cache += REC_ESTIMATED_MEMORY_USE(rec);
+	struct rec_chunk *chunk;
+
+	if (rec == NULL || REC_IS_OFFSET(rec))
+		return;
+
+	if (!REC_IS_ARENA(rec)) {
+		rec_refund(REC_F(rec).memory_cache, REC_ESTIMATED_MEMORY_USE(rec));
 		free(rec->internal_only.loc.p);
+		return;
+	}
+
+	/* Find the chunk header; see the comment at struct rec_chunk */
+	chunk = (struct rec_chunk *) ((uintptr_t) REC_P(rec) & ~(uintptr_t) (REC_ARENA_CHUNK - 1));
+	assert(chunk->live > 0);
+	if (--chunk->live == 0) {
+		if (chunk->ctx == NULL)
+			rec_chunk_release(chunk);
+		else
+			/* Start over */
+			chunk->ctx->arena_used = sizeof(*chunk);
 	}
 }
+
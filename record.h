@@ -16,7 +16,7 @@
 
 /*
  * A simple API for treating a file descriptor as a stream of records. Requires
- * <stdio.h> and <pcre.h> (and -lpcre).
+ * <stdio.h>, <inttypes.h> and <pcre2.h> with PCRE2_CODE_UNIT_WIDTH 8 (and -lpcre2-8).
  */
 
 #ifndef __GNUC__
@@ -25,42 +25,229 @@
 #endif
 #endif
 
-/* A record. For internal use only! */
+/*
+ * A record. For internal use only! This is kept small (16 bytes on common
+ * platforms), since there may be billions of them; see record.c for the
+ * layout of info.
+ */
 struct rec {
 	struct {
 		union {
 			off_t	 offset;
 			void	*p;
 		} loc;
-		int		 len, f_idx;
+		uint64_t	 info;
 	} internal_only;
 };
 
+/*
+ * A context, which holds the buffers, compiled output templates, arena and
+ * statistics used by the rec_* functions. Every function that takes a context
+ * may be called by different threads at once as long as each uses its own
+ * context and its own rfds; records from any rfd can be written or saved with
+ * any context. Once an rfd has been read to the end, its records may also be
+ * written by several threads at once, each with its own context; they must
+ * still be freed by one thread at a time. Records in memory must not be freed
+ * while the context they came from is reading more records in another thread.
+ * Several rfds may share a memory_cache (see rec_open()). rec_open() and
+ * rec_close() must not be called while other threads use any rec_* function.
+ */
+struct rec_ctx;
+
+/*
+ * Allocate a new context. Returns NULL and sets errno as for malloc(3) on
+ * failure.
+ */
+struct rec_ctx *rec_ctx_new(void);
+
+/*
+ * Free ctx. Records that were read with ctx remain valid. Does nothing if ctx
+ * is NULL.
+ */
+void rec_ctx_free(struct rec_ctx *ctx);
+
+/* Maximum length of the literal argument to rec_open() */
+#define REC_LITERAL_MAX 64
+
 /*
  * Open a file for reading records.
  *
  * Up to *memory_cache bytes of records will be kept in memory (instead of
- * spooled to disk) by rec_next(); malloc overhead will be estimated, but any
- * buffers used by rec_fopen() will not be tracked.
+ * spooled to disk) by rec_next(). Small records are allocated from large
+ * chunks, which are charged to *memory_cache as a whole; for larger records,
+ * malloc overhead will be estimated. Any buffers used by rec_open() will not
+ * be tracked. Regular files are never spooled, unless they are decompressed
+ * (see rec_set_decompress()); instead, they are mapped into memory if possible
+ * (and read(2) otherwise), and the records are used in place.
  *
- * For default_delim, see rec_write().
+ * If literal_len is not 0, re must match exactly the literal_len (at most
+ * REC_LITERAL_MAX) bytes starting at literal; these are then searched for
+ * directly, which is much faster than running re. literal is copied, and need
+ * not remain valid after rec_open() returns.
+ *
+ * For default_delim, see rec_write(). default_delim is compiled once, and
+ * need not remain valid after rec_open() returns.
+ *
+ * re may be JIT-compiled with pcre2_jit_compile(), in which case the JIT code
+ * is used; otherwise, or if the JIT code runs out of stack, the interpreter is
+ * used.
  *
  * Returns the lowest unused record file descriptor ("rfd") on success, and
- * increases the internal reference count of re by 1 (if not maximal; see
- * pcre_refcount()). Otherwise, returns -1 and sets errno as for malloc(3) or
- * mkstemp(3).
+ * takes ownership of re, which may be shared between rfds; re is freed by
+ * rec_close() when no rfd uses it any longer. Otherwise, returns -1 and sets
+ * errno as for malloc(3) or mkstemp(3) (or to EMFILE if too many rfds are
+ * open), and re is still owned by the caller.
+ */
+int rec_open(struct rec_ctx *ctx, int fd, pcre2_code *re, const char *literal, size_t literal_len, const char *default_delim, size_t *memory_cache) __attribute__((nonnull(1, 3, 7)));
+
+/*
+ * Keep an index of the records of rfd in path, so that they need not be
+ * searched for again. Must be called before anything is read from rfd. An
+ * index is only valid for the file as it is now (i.e. its size, modification
+ * time, inode and device), and for key, which must identify the regular
+ * expression that was passed to rec_open() (e.g. its source).
+ *
+ * If path holds a valid index, rec_next() takes the records from there
+ * without looking at the file, and rec_index_open() returns 1. Otherwise, the
+ * records that rec_next() finds are written to a temporary file next to path,
+ * which rec_index_save() then puts in its place, and rec_index_open() returns
+ * 0; this is also returned, without doing anything, if rfd is not a regular
+ * file. On failure, returns -1 and sets errno as for malloc(3), open(2),
+ * mmap(2), mkstemp(3) or fwrite(3), or to EEXIST if path exists but is not an
+ * index (it is never overwritten).
+ */
+int rec_index_open(int rfd, const char *path, const char *key) __attribute__((nonnull(2, 3)));
+
+/*
+ * Save the index started by rec_index_open() for rfd, after rec_next() has
+ * returned all records. Does nothing if there is no such index, e.g. because
+ * a valid index was found. Returns 0 on success; otherwise, returns -1 and
+ * sets errno as for fwrite(3) or rename(2), or to EAGAIN if not all records
+ * were read.
+ */
+int rec_index_save(int rfd);
+
+/*
+ * Hand out the records of rfd as soon as they have been read, e.g. for input
+ * that never ends; by default, rec_next() first tries to read all of a
+ * non-seekable file into memory. Records of a non-seekable file are then never
+ * spooled to a temporary file either: if a record does not fit in the
+ * memory_cache, rec_next() and rec_next_batch() return -1 and set errno to
+ * ENOBUFS, and can be called again once other records have been freed. Must
+ * be called before anything is read from rfd.
+ */
+void rec_stream(int rfd);
+
+/*
+ * Split rfd into records of size bytes (except that the last one may be
+ * shorter) instead of searching for the regular expression; these records end
+ * in an empty delimiter. For a regular file, rec_next() and rec_skip() then
+ * take the records straight from its size at rec_open(), without reading it.
+ * Must be called before anything is read from rfd. Returns 0 on success;
+ * otherwise, returns -1 and sets errno to EINVAL if size is 0 or too large.
+ */
+int rec_fixed(int rfd, size_t size);
+
+/*
+ * Use up to threads threads (at least 1) to find records in files opened by
+ * subsequent calls to rec_open(). Currently, only large regular files with a
+ * literal delimiter are split up in parallel, and only if occurrences of the
+ * delimiter cannot overlap (as for "\n", but not "--"). The default is 1,
+ * i.e. no threads. Does nothing if threads are not supported.
+ */
+void rec_set_threads(int threads);
+
+/*
+ * If compress is not 0, compress the temporary files created by subsequent
+ * calls to rec_open() with LZ4, in blocks of 8k. This saves a lot of disk
+ * space and I/O for typical text, but every record read back from such a file
+ * costs decompressing a block. Returns 0 on success; otherwise, returns -1 and
+ * sets errno to ENOSYS if compression is not supported.
+ */
+int rec_set_compress(int compress);
+
+/*
+ * If decompress is not 0, subsequent calls to rec_open() check whether the
+ * input is compressed with gzip or zstd (as far as supported), and if so,
+ * decompress it as it is read, on a separate thread if possible. Input that
+ * merely starts with the same magic bytes, i.e. whose first 256k do not
+ * decompress, is read as it is. Decompressed input is treated like a pipe,
+ * even if it is a regular file: anything that does not fit in the
+ * memory_cache is spooled to a temporary file. Returns 0 on success;
+ * otherwise, returns -1 and sets errno to ENOSYS if neither format is
+ * supported.
+ */
+int rec_set_decompress(int decompress);
+
+/*
+ * If memfd is not 0, create temporary files (see rec_open() and
+ * rec_tmpfile()) in memory with memfd_create(2) instead of in $TMPDIR. These
+ * can still be paged out to swap. Returns 0 on success; otherwise, returns -1
+ * and sets errno to ENOSYS if memfd_create() is not supported.
+ */
+int rec_set_memfd(int memfd);
+
+/*
+ * Statistics, for rec_get_stats(). Records on disk are either in place in a
+ * regular file or in a temporary file; all others are in memory, charged to
+ * memory_cache.
+ */
+struct rec_stats {
+	uint64_t	 records;	/* Found by rec_next(), including discarded ones */
+	uint64_t	 records_mem;	/* Returned by rec_next() in memory */
+	uint64_t	 records_disk;	/* Returned by rec_next() on disk */
+	uint64_t	 bytes_read;	/* Total length of the records found */
+	uint64_t	 bytes_spooled;	/* Written to temporary files, as stored */
+	uint64_t	 preads;	/* Reads of records on disk */
+	uint64_t	 pread_bytes;	/* Bytes read by those */
+	size_t		 memory_used;	/* Currently charged to memory_cache */
+	size_t		 memory_peak;	/* Largest memory_used so far */
+	double		 spool_wall;	/* Seconds spent writing temporary files */
+	double		 spool_cpu;	/* CPU seconds for that, with compression */
+	double		 spool_wait;	/* Seconds rec_next() waited for that */
+};
+
+/*
+ * Fill in stats for everything done with ctx so far, plus the temporary files
+ * that are still being written and the memory charged to any memory_cache.
+ * Reads of records on disk include copy_file_range(2) and sendfile(2),
+ * counting each system call as one read. This is cheap enough to call now and
+ * then while reading.
  */
-int rec_open(int fd, pcre *re, pcre_extra *re_extra, const char *default_delim, size_t *memory_cache) __attribute__((nonnull(2, 3, 5)));
+void rec_get_stats(const struct rec_ctx *ctx, struct rec_stats *stats) __attribute__((nonnull(1, 2)));
 
 /*
  * Get next record. If rec is NULL, the data is discarded instead.
  *
  * Returns 0 on success and initializes rec (if non-NULL); otherwise, returns
  * -1 and sets errno as for read(2), write(2), or malloc(3), or to 0 on EOF, or
- * to EINVAL if there was an error while processing the regular expression.
- * Unless rec_next returns 0, rec is unchanged.
+ * to EINVAL if there was an error while processing the regular expression, or
+ * to EIO if the index of the file (see rec_index_open()) is corrupt, or to
+ * ENOBUFS if the file is streamed (see rec_stream()) and the record does not
+ * fit in memory. Unless rec_next returns 0, rec is unchanged.
+ */
+int rec_next(struct rec_ctx *ctx, int rfd, struct rec *rec) __attribute__((nonnull(1)));
+
+/*
+ * Get up to max (at least 1) records into recs[0] to recs[max - 1], as for
+ * rec_next(). Only the first record may cause more data to be read in; the
+ * batch simply ends where the data read so far does.
+ *
+ * Returns the number of records on success, which is at least 1; otherwise,
+ * returns -1 and sets errno as for rec_next(). If an error occurs after some
+ * records were found, those are returned, and the error happens again on the
+ * next call.
+ */
+ssize_t rec_next_batch(struct rec_ctx *ctx, int rfd, struct rec *recs, size_t max) __attribute__((nonnull(1, 3)));
+
+/*
+ * Discard up to n (at least 1) records, as for rec_next() with a NULL rec.
+ * With an index (see rec_index_open()), this takes constant time.
+ *
+ * Returns the number of records discarded, which is at least 1; otherwise,
+ * returns -1 and sets errno as for rec_next().
  */
-int rec_next(int rfd, struct rec *rec);
+ssize_t rec_skip(struct rec_ctx *ctx, int rfd, uint64_t n) __attribute__((nonnull(1)));
 
 /*
  * Write record to FILE *.
@@ -74,7 +261,98 @@ int rec_next(int rfd, struct rec *rec);
  * as for malloc(3), putc(3), fwrite(3), or read(2). Where appropriate,
  * strerror(errno) is already incorporated in the error message.
  */
-const char *rec_write(const struct rec *rec, const char *delim, FILE *file) __attribute__((nonnull(1, 3)));
+const char *rec_write(struct rec_ctx *ctx, const struct rec *rec, const char *delim, FILE *file) __attribute__((nonnull(1, 2, 4)));
+
+/*
+ * Write recs[0] to recs[n - 1] to FILE *, as for rec_write(), and set *written
+ * to the number of records that were written. The records are passed to
+ * rec_prefetch() a few dozen records ahead, so n should be much larger than
+ * that.
+ *
+ * Returns NULL on success; otherwise, returns an error message as for
+ * rec_write() for recs[*written].
+ */
+const char *rec_write_batch(struct rec_ctx *ctx, const struct rec *recs, size_t n, const char *delim, FILE *file, size_t *written) __attribute__((nonnull(1, 2, 5, 6)));
+
+/*
+ * Hint that rec will be passed to rec_write() soon, so that the data can be
+ * read in asynchronously (with posix_madvise() or posix_fadvise()) if it is
+ * not already in memory. Calling this a few dozen records ahead hides most
+ * of the latency of reading records from disk in a random order.
+ */
+void rec_prefetch(const struct rec *rec) __attribute__((nonnull(1)));
+
+/*
+ * Save rec to file (which should be a temporary file, see rec_tmpfile()), so
+ * that it can be read back by rec_load(). The rfd that rec came from must
+ * still be open at that time.
+ *
+ * The return values are as for rec_write(); errno may be set as for malloc(3),
+ * fwrite(3), or read(2).
+ */
+const char *rec_save(struct rec_ctx *ctx, const struct rec *rec, FILE *file) __attribute__((nonnull(1, 2, 3)));
+
+/*
+ * Read the next record saved by rec_save() from file into memory, charging it
+ * to the memory_cache of its rfd as for rec_next(). The record is then exactly
+ * like the one passed to rec_save(), except that it is always in memory.
+ *
+ * Returns 0 on success and initializes rec; otherwise, returns -1 and sets
+ * errno as for fread(3), to ENOMEM if the record does not fit in memory_cache,
+ * or to 0 on EOF.
+ */
+int rec_load(struct rec_ctx *ctx, struct rec *rec, FILE *file) __attribute__((nonnull(1, 2, 3)));
+
+/*
+ * Make copy a copy of rec, which must be freed separately. Records in memory
+ * are copied, and charged to the memory_cache of their rfd as for rec_next().
+ *
+ * Returns 0 on success; otherwise, returns -1 and sets errno to ENOMEM if the
+ * record does not fit in memory_cache.
+ */
+int rec_dup(struct rec_ctx *ctx, const struct rec *rec, struct rec *copy) __attribute__((nonnull(1, 2, 3)));
+
+/*
+ * A set of records with distinct data, for dropping duplicates. Records are
+ * compared without their delimiter (if its length is known), so that "a\n"
+ * and a final, unterminated "a" are the same. A set must only be used by one
+ * thread at a time.
+ */
+struct rec_unique;
+
+/*
+ * Allocate an empty set, whose memory is charged to memory_cache. Returns NULL
+ * and sets errno to ENOMEM on failure.
+ */
+struct rec_unique *rec_unique_new(size_t *memory_cache) __attribute__((nonnull(1)));
+
+/*
+ * Add rec to u, unless a record with the same data was added before. The set
+ * keeps its own copy of the data of records in memory, so rec can be freed
+ * independently. Its hash table and these copies are charged to the
+ * memory_cache of u; once that is full, they go to temporary files instead.
+ * Returns 1 if rec was added, and 0 if it is a duplicate; otherwise, returns
+ * -1 and sets errno to ENOMEM, to EOVERFLOW if u already holds UINT32_MAX - 1
+ * records, or as for write(2), pread(2) or mmap(2) if a temporary file
+ * cannot be written or read.
+ */
+int rec_unique_add(struct rec_ctx *ctx, struct rec_unique *u, const struct rec *rec) __attribute__((nonnull(1, 2, 3)));
+
+/*
+ * Free u and the records in it, before their rfds are closed. Does nothing if
+ * u is NULL.
+ */
+void rec_unique_free(struct rec_unique *u);
+
+/*
+ * Create a temporary file, opened for reading and writing, in the same place
+ * as the temporary files used by rec_next() (see the man page). The file has
+ * already been unlinked, so fclose() suffices to remove it.
+ *
+ * Returns NULL and sets errno as for malloc(3), mkstemp(3), or fdopen(3) on
+ * failure.
+ */
+FILE *rec_tmpfile(void);
 
 /*
  * Write a string to FILE *, processing it as the 'delim' argument above.
@@ -82,34 +360,30 @@ const char *rec_write(const struct rec *rec, const char *delim, FILE *file) __at
  * The return values are as above. errno may be set as for putc(3) or
  * fwrite(2).
  */
-const char *rec_write_str(const char *str, FILE *file) __attribute__((nonnull(1, 2)));
+const char *rec_write_str(struct rec_ctx *ctx, const char *str, FILE *file) __attribute__((nonnull(1, 2, 3)));
 
 /*
  * Free all resources associated with rec (but not rec itself).
  *
- * This decreases the internal reference count of the re argument used to open
- * rec by 1 (if not maximal) and pcre_free()s re and re_extra if the reference
- * count reaches zero. It is an error to call rec_free() while the reference
- * count of re is 0.
- *
  * Does nothing if rec is NULL.
  */
 void rec_free(struct rec *rec);
 
 /*
  * Free all resources allocated by rec_open(), including the file descriptor
- * passed to rec_open(). This does not free() the memory_cache argument to
- * rec_open().
+ * passed to rec_open() and, if no other rfd uses it, the re argument. This
+ * does not free() the memory_cache argument to rec_open().
  *
  * It is an error to call any rec_* function on a struct rec associated with
  * this rfd afterwards.
  *
  * Returns 0 on succcess; otherwise, returns -1 and sets errno as for close(2).
  */
-int rec_close(int rfd);
+int rec_close(struct rec_ctx *ctx, int rfd) __attribute__((nonnull(1)));
 
 /*
- * assert() that all rec_* resources have been deallocated, for debugging only.
+ * assert() that all rec_* resources (except contexts) have been deallocated,
+ * and all records freed, for debugging only.
  */
 #ifndef NDEBUG
 void rec_assert_released(void);